@@ -0,0 +1,514 @@
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "EventHandler.hpp"
+#include "EventSource.hpp"
+#include "Inotify.hpp"
+#include "ShardedInotify.hpp"
+
+// Synthetic trees and churn workloads against the watcher, for sizing hardware and catching regressions
+//
+// Every workload operates on entries named "op<N>", so that the handler can match an event to the operation that
+// caused it and measure the latency from the syscall to the delivery of the event.
+
+using Clock = std::chrono::steady_clock;
+
+namespace {
+
+// Command line parameters of a run
+struct BenchOptions {
+  std::string tree = "wide";       // Shape of the generated tree: wide or deep
+  std::string workload = "all";    // Churn to run after the crawl: storm, rename, modify, all or replay
+  size_t dirs = 100;               // Directories of a wide tree, levels of a deep tree
+  size_t files = 100;              // Files per directory
+  size_t ops = 10000;              // Operations per workload
+  size_t queue_limit = 0;          // max_queued_events to run with; 0 keeps the system setting
+  std::filesystem::path root;      // Where the tree is generated; a temporary directory if empty
+  inotify::InotifyOptions watcher; // Tunables passed through to the watcher
+};
+
+// Nanoseconds since the epoch of the steady clock
+int64_t nowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// Resident set size of the process in bytes
+size_t residentBytes()
+{
+  long pages = 0, resident = 0;
+  FILE* statm = std::fopen("/proc/self/statm", "r");
+  if (statm == nullptr) return 0;
+  if (std::fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+  std::fclose(statm);
+  return size_t(resident) * size_t(sysconf(_SC_PAGESIZE));
+}
+
+// Create an empty file, faster than going through std::ofstream for millions of files
+void touch(const std::string& path)
+{
+  int fd = open(path.c_str(), O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+  if (fd == -1)
+  {
+    std::perror(path.c_str());
+    std::exit(EXIT_FAILURE);
+  }
+  close(fd);
+}
+
+void makeDirectory(const std::string& path)
+{
+  if (mkdir(path.c_str(), 0755) == -1 && errno != EEXIST)
+  {
+    std::perror(path.c_str());
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+// Directories side by side under the root, each holding the same number of files
+size_t generateWide(const std::filesystem::path& root, size_t dirs, size_t files)
+{
+  for (size_t d = 0; d < dirs; ++d)
+  {
+    const std::string dir = (root / ("d" + std::to_string(d))).native();
+    makeDirectory(dir);
+    for (size_t f = 0; f < files; ++f) touch(dir + "/f" + std::to_string(f));
+  }
+  return dirs + 1;
+}
+
+// A single chain of nested directories with files on every level
+size_t generateDeep(const std::filesystem::path& root, size_t depth, size_t files)
+{
+  std::string dir = root.native();
+  for (size_t d = 0; d < depth; ++d)
+  {
+    dir += "/d";
+    makeDirectory(dir);
+    for (size_t f = 0; f < files; ++f) touch(dir + "/f" + std::to_string(f));
+  }
+  return depth + 1;
+}
+
+// Counts the delivered events and matches them to the operations of the running workload
+class BenchHandler : public inotify::EventHandler
+{
+ public:
+  // Begin a workload of which every operation is expected to result in the given number of events
+  void start(size_t ops)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _issued = std::make_unique<std::atomic<int64_t>[]>(ops);
+    _issued_cnt = ops;
+    _latencies.clear();
+    _latencies.reserve(ops);
+    _events = 0;
+    _overflows = 0;
+    _last_event = 0;
+  }
+
+  // The operation with the given index is about to be issued
+  void issue(size_t op) { _issued[op].store(nowNs(), std::memory_order_relaxed); }
+
+  // Same as issue, unless an earlier issue of the operation is still waiting for its event
+  void issueIfIdle(size_t op)
+  {
+    int64_t idle = 0;
+    _issued[op].compare_exchange_strong(idle, nowNs(), std::memory_order_relaxed);
+  }
+
+  void onBatch(const inotify::EventBatch& batch) override
+  {
+    const int64_t now = nowNs();
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    bool rescanned = false;
+    for (const auto& entry : batch)
+    {
+      _events++;
+      if (entry.type == inotify::EventType::Rescan)
+      {
+        rescanned = true;
+        continue;
+      }
+
+      // Latency of the first event of every operation, later ones (e.g. the delete of a storm) are counted only
+      const size_t op = opIndex(batch.path(entry));
+      if (op >= _issued_cnt) continue;
+      const int64_t issued = _issued[op].exchange(0, std::memory_order_relaxed);
+      if (issued != 0) _latencies.push_back(now - issued);
+    }
+
+    /* All directories of one overflow are rescanned within the same read, so they end up in a single batch */
+    if (rescanned) _overflows++;
+    _last_event = now;
+  }
+
+  // Wait until the expected number of events arrived, or no event arrived for the idle timeout
+  void wait(size_t expected, std::chrono::milliseconds idle)
+  {
+    for (;;)
+    {
+      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_events >= expected) return;
+      if (_last_event != 0 && nowNs() - _last_event > std::chrono::nanoseconds(idle).count()) return;
+    }
+  }
+
+  void report(const char* name, size_t expected, int64_t started)
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::sort(_latencies.begin(), _latencies.end());
+    const double seconds = double(std::max<int64_t>(_last_event - started, 1)) / 1e9;
+
+    std::printf("%-8s events %zu/%zu  %.0f events/s  overflows %zu", name, _events, expected, _events / seconds,
+        _overflows);
+    if (!_latencies.empty())
+    {
+      std::printf("  latency us p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f max %.1f", percentile(0.5), percentile(0.9),
+          percentile(0.99), percentile(0.999), _latencies.back() / 1e3);
+    }
+    std::printf("\n");
+  }
+
+ private:
+  // Index of an "op<N>" entry, or SIZE_MAX for other paths
+  static size_t opIndex(std::string_view path)
+  {
+    size_t slash = path.rfind('/');
+    std::string_view name = slash == std::string_view::npos ? path : path.substr(slash + 1);
+    if (name.size() < 3 || name.compare(0, 2, "op") != 0) return SIZE_MAX;
+    size_t index = 0;
+    for (char c : name.substr(2))
+    {
+      if (c < '0' || c > '9') return SIZE_MAX;
+      index = index * 10 + size_t(c - '0');
+    }
+    return index;
+  }
+
+  double percentile(double p) const
+  {
+    size_t index = std::min(_latencies.size() - 1, size_t(p * double(_latencies.size())));
+    return _latencies[index] / 1e3;
+  }
+
+ private:
+  std::mutex _mutex;
+  std::unique_ptr<std::atomic<int64_t>[]> _issued; // Issue time of every operation, 0 once its first event arrived
+  size_t _issued_cnt = 0;
+  std::vector<int64_t> _latencies;                 // Syscall to delivery, in nanoseconds
+  size_t _events = 0;
+  size_t _overflows = 0;
+  int64_t _last_event = 0;
+};
+
+// Create and delete files as fast as possible, two events per operation
+void runStorm(const std::filesystem::path& dir, BenchHandler& handler, size_t ops)
+{
+  handler.start(ops);
+  const int64_t started = nowNs();
+  for (size_t i = 0; i < ops; ++i)
+  {
+    const std::string path = (dir / ("op" + std::to_string(i))).native();
+    handler.issue(i);
+    touch(path);
+    unlink(path.c_str());
+  }
+  handler.wait(2 * ops, std::chrono::milliseconds(2000));
+  handler.report("storm", 2 * ops, started);
+}
+
+// Rename a big subtree back and forth, every rename has to rewrite the cached paths below it
+void runRename(const std::filesystem::path& subtree, BenchHandler& handler, size_t ops)
+{
+  handler.start(ops);
+  const int64_t started = nowNs();
+  std::filesystem::path current = subtree;
+  for (size_t i = 0; i < ops; ++i)
+  {
+    std::filesystem::path next = subtree.parent_path() / ("op" + std::to_string(i));
+    handler.issue(i);
+    if (rename(current.c_str(), next.c_str()) == -1)
+    {
+      std::perror(current.c_str());
+      std::exit(EXIT_FAILURE);
+    }
+    current = std::move(next);
+  }
+  handler.wait(ops, std::chrono::milliseconds(2000));
+  handler.report("rename", ops, started);
+  rename(current.c_str(), subtree.c_str());
+}
+
+// Append to the same few files over and over, one modification per operation. The kernel merges a modification with
+// an identical one that is still queued, so fewer events than operations may arrive.
+void runModify(const std::filesystem::path& dir, BenchHandler& handler, size_t ops)
+{
+  constexpr size_t FILE_CNT = 16;
+  std::vector<int> fds;
+  for (size_t i = 0; i < FILE_CNT; ++i)
+  {
+    fds.push_back(open((dir / ("op" + std::to_string(i))).c_str(), O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644));
+    if (fds.back() == -1)
+    {
+      std::perror("open");
+      std::exit(EXIT_FAILURE);
+    }
+  }
+
+  /* Let the creates of the files pass before counting the modifications */
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  handler.start(FILE_CNT);
+  const int64_t started = nowNs();
+  for (size_t i = 0; i < ops; ++i)
+  {
+    handler.issueIfIdle(i % FILE_CNT);
+    if (write(fds[i % FILE_CNT], "x", 1) != 1) std::perror("write");
+  }
+  handler.wait(ops, std::chrono::milliseconds(2000));
+  handler.report("modify", ops, started);
+
+  for (size_t i = 0; i < FILE_CNT; ++i)
+  {
+    close(fds[i]);
+    unlink((dir / ("op" + std::to_string(i))).c_str());
+  }
+}
+
+void printUsage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [options]" << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  --tree=wide|deep     Shape of the generated tree (default wide)" << std::endl;
+  std::cerr << "  --workload=NAME      storm, rename, modify or all (default all); replay processes a synthetic"
+            << std::endl;
+  std::cerr << "                       stream without the kernel and the filesystem" << std::endl;
+  std::cerr << "  --dirs=N             Directories of a wide tree, or depth of a deep tree (default 100)" << std::endl;
+  std::cerr << "  --files=N            Files per directory (default 100)" << std::endl;
+  std::cerr << "  --ops=N              Operations per workload (default 10000)" << std::endl;
+  std::cerr << "  --root=DIR           Generate the tree in DIR instead of a temporary directory" << std::endl;
+  std::cerr << "  --queue-limit=N      Set fs.inotify.max_queued_events to N for the run, needs root" << std::endl;
+  std::cerr << "  --pipeline=N         Read events on a separate thread into a ring of N buffers" << std::endl;
+  std::cerr << "  --io-uring           Read events through io_uring instead of epoll and read(2)" << std::endl;
+  std::cerr << "  --shards=N           Split the tree across N inotify instances and threads" << std::endl;
+  std::cerr << "  --crawl-threads=N    Crawl the directory tree with N threads at startup" << std::endl;
+  std::cerr << "  --overflow-reinit    Recover from overflows by crawling again, instead of rescanning" << std::endl;
+}
+
+bool parseArguments(int argc, char* argv[], BenchOptions& options)
+{
+  auto value = [](const std::string& arg) { return std::stoul(arg.substr(arg.find('=') + 1)); };
+
+  /* Rescans are reported as events, which lets the handler count the overflows */
+  options.watcher.overflow_recovery = inotify::OverflowRecovery::Rescan;
+
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg.rfind("--tree=", 0) == 0)
+      options.tree = arg.substr(std::strlen("--tree="));
+    else if (arg.rfind("--workload=", 0) == 0)
+      options.workload = arg.substr(std::strlen("--workload="));
+    else if (arg.rfind("--root=", 0) == 0)
+      options.root = arg.substr(std::strlen("--root="));
+    else if (arg.rfind("--dirs=", 0) == 0)
+      options.dirs = value(arg);
+    else if (arg.rfind("--files=", 0) == 0)
+      options.files = value(arg);
+    else if (arg.rfind("--ops=", 0) == 0)
+      options.ops = value(arg);
+    else if (arg.rfind("--queue-limit=", 0) == 0)
+      options.queue_limit = value(arg);
+    else if (arg.rfind("--pipeline=", 0) == 0)
+      options.watcher.pipeline_slots = value(arg);
+    else if (arg == "--io-uring")
+      options.watcher.io_uring = true;
+    else if (arg.rfind("--shards=", 0) == 0)
+      options.watcher.shard_count = value(arg);
+    else if (arg.rfind("--crawl-threads=", 0) == 0)
+      options.watcher.crawl_threads = value(arg);
+    else if (arg == "--overflow-reinit")
+      options.watcher.overflow_recovery = inotify::OverflowRecovery::Reinitialize;
+    else
+    {
+      printUsage(argv[0]);
+      return false;
+    }
+  }
+
+  if (options.tree != "wide" && options.tree != "deep")
+  {
+    printUsage(argv[0]);
+    return false;
+  }
+  return true;
+}
+
+// Append an inotify_event record to a synthetic stream, with the name padded like the kernel pads it
+void appendEvent(std::vector<uint8_t>& stream, int wd, uint32_t mask, uint32_t cookie, const std::string& name)
+{
+  const size_t len = (name.size() + sizeof(inotify_event)) / sizeof(inotify_event) * sizeof(inotify_event);
+  inotify_event header{wd, mask, cookie, uint32_t(len)};
+  const size_t offset = stream.size();
+  stream.resize(offset + sizeof(header) + len, 0);
+  std::memcpy(stream.data() + offset, &header, sizeof(header));
+  std::memcpy(stream.data() + offset + sizeof(header), name.data(), name.size());
+}
+
+// Process a synthetic stream of creates, modifies and deletes spread over all directories, with a rename of a subtree
+// every 100 operations, without the kernel. The watch descriptors of a fresh instance count up from 1 in crawl order,
+// and renames only touch the cache, so the stream is valid for the tree without knowing which directory is which.
+void runReplay(inotify::Inotify& watcher, BenchHandler& handler, size_t dir_cnt, std::string subtree, size_t ops)
+{
+  std::vector<uint8_t> stream;
+  size_t expected = 0;
+  for (size_t i = 0; i < ops; ++i)
+  {
+    const int wd = int(1 + i % dir_cnt);
+    const std::string name = "op" + std::to_string(i);
+    appendEvent(stream, wd, IN_CREATE, 0, name);
+    appendEvent(stream, wd, IN_MODIFY, 0, name);
+    appendEvent(stream, wd, IN_DELETE, 0, name);
+    expected += 3;
+    if (i % 100 == 99)
+    {
+      const std::string next = "op" + std::to_string(i) + "d";
+      appendEvent(stream, 1, IN_MOVED_FROM | IN_ISDIR, uint32_t(i), subtree);
+      appendEvent(stream, 1, IN_MOVED_TO | IN_ISDIR, uint32_t(i), next);
+      subtree = next;
+      expected++;
+    }
+  }
+
+  inotify::ReplaySource source(std::move(stream));
+  handler.start(ops);
+  const int64_t started = nowNs();
+  watcher.replay(source);
+  handler.report("replay", expected, started);
+}
+
+// Read or write an integer setting under /proc/sys
+size_t sysctl(const char* file, size_t value = 0)
+{
+  const std::string path = std::string("/proc/sys/fs/inotify/") + file;
+  if (value != 0)
+  {
+    FILE* out = std::fopen(path.c_str(), "w");
+    if (out == nullptr || std::fprintf(out, "%zu", value) < 0) std::perror(path.c_str());
+    if (out != nullptr) std::fclose(out);
+  }
+
+  size_t current = 0;
+  FILE* in = std::fopen(path.c_str(), "r");
+  if (in == nullptr) return 0;
+  if (std::fscanf(in, "%zu", &current) != 1) current = 0;
+  std::fclose(in);
+  return current;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[])
+{
+  BenchOptions options;
+  if (!parseArguments(argc, argv, options)) return EXIT_FAILURE;
+
+  const bool temporary = options.root.empty();
+  if (temporary)
+  {
+    char templ[] = "/tmp/inotify-bench.XXXXXX";
+    if (mkdtemp(templ) == nullptr)
+    {
+      std::perror("mkdtemp");
+      return EXIT_FAILURE;
+    }
+    options.root = templ;
+  }
+  std::filesystem::create_directories(options.root);
+
+  const size_t saved_queue_limit = sysctl("max_queued_events");
+  if (options.queue_limit != 0) sysctl("max_queued_events", options.queue_limit);
+
+  /* Generate the tree */
+  auto generation_start = Clock::now();
+  const size_t dir_cnt = options.tree == "wide" ? generateWide(options.root, options.dirs, options.files)
+                                                : generateDeep(options.root, options.dirs, options.files);
+  const double generation_ms =
+      std::chrono::duration<double, std::milli>(Clock::now() - generation_start).count();
+  std::printf("tree     %s, %zu directories, %zu files, generated in %.1f ms\n", options.tree.c_str(), dir_cnt,
+      options.files * (dir_cnt - 1), generation_ms);
+
+  /* Startup crawl; the growth of the resident set is dominated by the watch cache */
+  const size_t rss_before = residentBytes();
+  auto crawl_start = Clock::now();
+  std::unique_ptr<inotify::Watcher> watcher;
+  inotify::Inotify* single = nullptr; // The watcher if it is a single instance, which can replay
+  if (options.watcher.shard_count > 1)
+    watcher = std::make_unique<inotify::ShardedInotify>(options.root, std::vector<std::string>{}, options.watcher,
+        options.watcher.shard_count);
+  else
+  {
+    auto instance = std::make_unique<inotify::Inotify>(options.root, std::vector<std::string>{}, options.watcher);
+    single = instance.get();
+    watcher = std::move(instance);
+  }
+  const double crawl_ms = std::chrono::duration<double, std::milli>(Clock::now() - crawl_start).count();
+  const size_t rss_after = residentBytes();
+  std::printf("crawl    %.1f ms, %.0f directories/s, cache RSS %zu KiB (%.0f bytes per directory)\n", crawl_ms,
+      dir_cnt / (crawl_ms / 1e3), (rss_after - rss_before) / 1024, double(rss_after - rss_before) / dir_cnt);
+
+  BenchHandler handler;
+  watcher->setEventHandler(&handler);
+
+  /* Processing alone, on this thread; the watcher never runs */
+  if (options.workload == "replay")
+  {
+    if (single == nullptr)
+      std::fprintf(stderr, "replay needs a single instance, without --shards\n");
+    else
+      runReplay(*single, handler, dir_cnt, options.tree == "wide" ? "d0" : "d", options.ops);
+    watcher.reset();
+    if (options.queue_limit != 0) sysctl("max_queued_events", saved_queue_limit);
+    if (temporary) std::filesystem::remove_all(options.root);
+    return single == nullptr ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  std::thread watcher_thread([&watcher] { watcher->run(); });
+
+  /* Give the watcher time to register with the reactor before the churn starts */
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  const std::filesystem::path first_dir = options.root / "d";
+  const std::filesystem::path churn_dir = options.tree == "wide" ? options.root / "d0" : first_dir;
+  if (options.workload == "storm" || options.workload == "all") runStorm(churn_dir, handler, options.ops);
+  if (options.workload == "rename" || options.workload == "all")
+    runRename(options.tree == "wide" ? churn_dir : first_dir, handler, std::max<size_t>(options.ops / 100, 1));
+  if (options.workload == "modify" || options.workload == "all") runModify(churn_dir, handler, options.ops);
+
+  watcher->stop();
+  watcher_thread.join();
+  watcher.reset();
+
+  if (options.queue_limit != 0) sysctl("max_queued_events", saved_queue_limit);
+  if (temporary) std::filesystem::remove_all(options.root);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,30 @@
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+
+#include "EventStream.hpp"
+
+// Decodes arbitrary bytes as a binary event stream, the way a consumer of the watcher reads it. Corrupt streams have
+// to be rejected with std::runtime_error; anything else, like a read past the input, is a bug.
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  const char* bytes = reinterpret_cast<const char*>(data);
+  try
+  {
+    const size_t header_size = inotify::EventStreamReader::parseHeader(bytes, size);
+    size_t offset = EVENT_STREAM_HEADER_LEN;
+    inotify::EventRecord record;
+    while (size_t length = inotify::EventStreamReader::decode(bytes + offset, size - offset, header_size, record))
+    {
+      // The paths have to lie within the record
+      const char* begin = bytes + offset;
+      const char* end = begin + length;
+      if (record.path.data() < begin || record.old_path.data() + record.old_path.size() > end) __builtin_trap();
+      offset += length;
+    }
+  } catch (const std::runtime_error&)
+  {
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <string>
+
+#include "EventHandler.hpp"
+#include "EventSource.hpp"
+#include "Inotify.hpp"
+
+// Replays arbitrary bytes as the events of the inotify fd, through the decoding, move pairing and cache maintenance of
+// a fresh watcher per input. The watcher only reads the tree; directories named by the input that don't exist make it
+// recover by crawling again, which is part of what is fuzzed.
+//
+// The first byte of an input selects the tunables, so that coalescing, lazy watching and the overflow recovery
+// strategies are covered by the same corpus.
+
+namespace {
+
+// A small tree with siblings that share a prefix, created once per fuzzing process
+const std::filesystem::path& tree()
+{
+  static const std::filesystem::path root = [] {
+    char templ[] = "/tmp/inotify-fuzz.XXXXXX";
+    if (mkdtemp(templ) == nullptr) std::abort();
+    const std::filesystem::path path = templ;
+    for (const char* dir : {"a/b/c", "a/bb", "foo", "foobar/x"}) std::filesystem::create_directories(path / dir);
+    return path;
+  }();
+  return root;
+}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+  if (size == 0) return 0;
+
+  static const int null_fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  inotify::InotifyOptions options;
+  options.log_fd = null_fd;
+  if (data[0] & 0x01) options.coalesce_window = std::chrono::milliseconds(10);
+  if (data[0] & 0x02) options.lazy_depth = 1;
+  if (data[0] & 0x04) options.overflow_recovery = inotify::OverflowRecovery::Rescan;
+  if (data[0] & 0x08) options.close_write = true;
+
+  inotify::Inotify watcher(tree(), {"foobar/x"}, options);
+  inotify::EventHandler handler; // Builds every event and drops it
+  watcher.setEventHandler(&handler);
+
+  inotify::ReplaySource source(data + 1, size - 1);
+  watcher.replay(source);
+  return 0;
+}
@@ -0,0 +1,71 @@
+#include "include/Arena.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace inotify {
+
+/**
+ * Allocates the first chunk.
+ * @param chunk_size The size of the first chunk; later chunks are at least as large.
+ */
+Arena::Arena(size_t chunk_size) : _used(0)
+{
+  chunk_size = std::max<size_t>(chunk_size, 1);
+  _chunks.push_back(Chunk{std::unique_ptr<char[]>(new char[chunk_size]), chunk_size});
+}
+
+/**
+ * Allocates storage from the last chunk, or from a new chunk if it is full. The new chunk is twice the size of the
+ * last one, or larger if the allocation needs it.
+ * @param size The number of bytes.
+ * @return The storage, which stays valid until reset() is called.
+ */
+char* Arena::allocate(size_t size)
+{
+  if (_chunks.back().size - _used < size)
+  {
+    const size_t chunk_size = std::max(_chunks.back().size * 2, size);
+    _chunks.push_back(Chunk{std::unique_ptr<char[]>(new char[chunk_size]), chunk_size});
+    _used = 0;
+  }
+
+  char* data = _chunks.back().data.get() + _used;
+  _used += size;
+  return data;
+}
+
+/**
+ * Copies a string into the arena.
+ * @param text The string to copy.
+ * @return A view of the copy, which stays valid until reset() is called.
+ */
+std::string_view Arena::copy(std::string_view text)
+{
+  char* data = allocate(text.size());
+  if (!text.empty()) std::memcpy(data, text.data(), text.size());
+  return {data, text.size()};
+}
+
+/**
+ * Drops all allocations. If more than one chunk was used since the last reset, they are replaced by a single chunk of
+ * their total size, which is what the next load of the same size fits into.
+ */
+void Arena::reset()
+{
+  _used = 0;
+  if (_chunks.size() == 1) return;
+
+  const size_t total = capacity();
+  _chunks.clear();
+  _chunks.push_back(Chunk{std::unique_ptr<char[]>(new char[total]), total});
+}
+
+size_t Arena::capacity() const
+{
+  size_t total = 0;
+  for (const auto& chunk : _chunks) total += chunk.size;
+  return total;
+}
+
+}  // namespace inotify
@@ -0,0 +1,100 @@
+#include "include/Coalescer.hpp"
+
+#include <cstring>
+
+namespace inotify {
+
+/* The events that can be folded into a held event */
+static constexpr uint32_t COALESCED_MASK = IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE;
+
+/**
+ * Creates a coalescer.
+ * @param window How long the first event of a file is held back while later events are folded into it.
+ */
+Coalescer::Coalescer(std::chrono::nanoseconds window) : _window(window) {}
+
+/**
+ * Holds back a file event, folding it into an already held event of the same file.
+ * @param event The event to hold back.
+ * @param now The current time, used to compute the release deadline.
+ * @return True if the event is held, false if the event can't be coalesced and has to be processed now.
+ */
+bool Coalescer::add(const FileEventView& event, Clock::time_point now)
+{
+  if ((event.mask & COALESCED_MASK) == 0 || (event.mask & ~COALESCED_MASK) != 0) return false;
+
+  auto it = _index.find(makeKey(event.wd, event.filename));
+  if (it != _index.end())
+  {
+    /* A created file stays created; anything else becomes a modification, with the bits of all folded events */
+    FileEvent& held = it->second->event;
+    if (!(held.mask & IN_CREATE)) held.mask |= event.mask & (IN_MODIFY | IN_CLOSE_WRITE);
+    return true;
+  }
+
+  /* A lone IN_CLOSE_WRITE is reported as a modification; its bit is kept, the directory may only select that one */
+  FileEvent held(event);
+  held.mask = (event.mask & IN_CREATE) ? IN_CREATE : event.mask & (IN_MODIFY | IN_CLOSE_WRITE);
+  held.cookie = 0;
+
+  _pending.push_back(Pending{std::move(held), now + _window, _scratch});
+  _index.emplace(_scratch, std::prev(_pending.end()));
+  return true;
+}
+
+/**
+ * Releases the held event of a single file, e.g. before a delete or move of that file is processed.
+ * @param wd The watch descriptor of the directory that contains the file.
+ * @param name The name of the file.
+ * @param callback Receives the released event.
+ */
+void Coalescer::flush(int wd, std::string_view name, const Callback& callback)
+{
+  auto it = _index.find(makeKey(wd, name));
+  if (it == _index.end()) return;
+
+  Pending pending = std::move(*it->second);
+  _pending.erase(it->second);
+  _index.erase(it);
+  callback(pending.event.view());
+}
+
+/**
+ * Releases every held event whose window passed.
+ * @param now The current time.
+ * @param callback Receives the released events, in the order they were first seen.
+ */
+void Coalescer::flushExpired(Clock::time_point now, const Callback& callback)
+{
+  while (!_pending.empty() && _pending.front().deadline <= now)
+  {
+    Pending pending = std::move(_pending.front());
+    _pending.pop_front();
+    _index.erase(pending.key);
+    callback(pending.event.view());
+  }
+}
+
+/**
+ * Releases all held events, e.g. before a directory event changes the paths they resolve to.
+ * @param callback Receives the released events, in the order they were first seen.
+ */
+void Coalescer::flushAll(const Callback& callback)
+{
+  while (!_pending.empty())
+  {
+    Pending pending = std::move(_pending.front());
+    _pending.pop_front();
+    _index.erase(pending.key);
+    callback(pending.event.view());
+  }
+}
+
+const std::string& Coalescer::makeKey(int wd, std::string_view name)
+{
+  _scratch.assign(reinterpret_cast<const char*>(&wd), sizeof(wd));
+  _scratch.append(name);
+  return _scratch;
+}
+
+}  // namespace inotify
@@ -0,0 +1,388 @@
+#include "include/ContentVerifier.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+
+namespace inotify {
+
+namespace {
+
+/**
+ * XXH64 over a stream of blocks, after the reference implementation. Every block but the last one has to be a multiple
+ * of the 32 byte stripe, which the reads of a whole buffer are.
+ */
+class Xxh64
+{
+ public:
+  static constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+  static constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+  static constexpr uint64_t PRIME4 = 0x85EBCA77C2B2AE63ULL;
+  static constexpr uint64_t PRIME5 = 0x27D4EB2F165667C5ULL;
+
+  explicit Xxh64(uint64_t seed = 0)
+    : _acc{seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1}
+    , _seed(seed)
+    , _length(0)
+    , _tail(nullptr)
+    , _tail_size(0)
+  {
+  }
+
+  void update(const uint8_t* data, size_t size)
+  {
+    _length += size;
+    const uint8_t* end = data + size;
+    /* Four independent lanes, which keeps several multiplications in flight */
+    for (; end - data >= 32; data += 32)
+    {
+      _acc[0] = round(_acc[0], read64(data));
+      _acc[1] = round(_acc[1], read64(data + 8));
+      _acc[2] = round(_acc[2], read64(data + 16));
+      _acc[3] = round(_acc[3], read64(data + 24));
+    }
+    _tail = data;
+    _tail_size = end - data;
+  }
+
+  /* Requires the buffer of the last block to be unchanged */
+  uint64_t digest() const
+  {
+    uint64_t hash;
+    if (_length >= 32)
+    {
+      hash = rotl(_acc[0], 1) + rotl(_acc[1], 7) + rotl(_acc[2], 12) + rotl(_acc[3], 18);
+      for (uint64_t acc : _acc) hash = (hash ^ round(0, acc)) * PRIME1 + PRIME4;
+    }
+    else
+      hash = _seed + PRIME5;
+    hash += _length;
+
+    const uint8_t* data = _tail;
+    size_t size = _tail_size;
+    for (; size >= 8; data += 8, size -= 8) hash = rotl(hash ^ round(0, read64(data)), 27) * PRIME1 + PRIME4;
+    if (size >= 4)
+    {
+      hash = rotl(hash ^ (read32(data) * PRIME1), 23) * PRIME2 + PRIME3;
+      data += 4;
+      size -= 4;
+    }
+    for (; size > 0; ++data, --size) hash = rotl(hash ^ (*data * PRIME5), 11) * PRIME1;
+
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+  }
+
+ private:
+  static uint64_t rotl(uint64_t value, int bits) { return (value << bits) | (value >> (64 - bits)); }
+  static uint64_t round(uint64_t acc, uint64_t input) { return rotl(acc + input * PRIME2, 31) * PRIME1; }
+  static uint64_t read64(const uint8_t* data)
+  {
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+  }
+  static uint64_t read32(const uint8_t* data)
+  {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+  }
+
+ private:
+  uint64_t _acc[4];     /* Lane accumulators */
+  uint64_t _seed;       /* Seed of the hash */
+  uint64_t _length;     /* Bytes hashed so far */
+  const uint8_t* _tail; /* Bytes of the last block that don't fill a stripe */
+  size_t _tail_size;    /* Number of those bytes */
+};
+
+int64_t mtimeOf(const struct stat& st) { return int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec; }
+
+int64_t wallClock()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+/* Checks if a file may have been written again after its state was recorded, without changing its modification time:
+ * timestamps are at most as fine as one second on some filesystems, so the second of the recording is not trusted */
+bool isRacy(int64_t mtime, int64_t stated) { return mtime / 1000000000 >= stated / 1000000000; }
+
+/* Checks if a directory path is a proper prefix of a path */
+bool isBelow(std::string_view path, std::string_view dir)
+{
+  if (path.size() <= dir.size() || path.compare(0, dir.size(), dir) != 0) return false;
+  return dir.empty() || dir.back() == '/' || path[dir.size()] == '/';
+}
+
+}  // namespace
+
+/**
+ * Starts the workers.
+ * @param workers The number of threads that hash files.
+ * @param notify Called from a worker when results are waiting for collect(), not again until they were collected.
+ */
+ContentVerifier::ContentVerifier(size_t workers, Notify notify)
+  : _notify(std::move(notify)), _next_job(0), _in_flight(0), _stopping(false)
+{
+  for (size_t i = 0; i < (workers == 0 ? 1 : workers); ++i) _workers.emplace_back(&ContentVerifier::workerLoop, this);
+}
+
+/**
+ * Stops the workers after the files they are hashing; queued verifications are dropped.
+ */
+ContentVerifier::~ContentVerifier()
+{
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopping = true;
+  }
+  _wakeup.notify_all();
+  for (auto& worker : _workers) worker.join();
+}
+
+/**
+ * Verifies a modify of a file. A file without a recorded state is only hashed to record one, and its modify has to be
+ * reported right away. Otherwise the verdict is given to collect(); a file that is modified again while it is being
+ * verified is verified once more afterwards.
+ * @param path The path of the modified file.
+ * @return True if the modify has to be reported now, false if collect() decides about it.
+ */
+bool ContentVerifier::check(std::string_view path)
+{
+  auto it = _files.try_emplace(std::string(path), Entry{State{0, 0, 0, 0, 0}, 0, false, false, false}).first;
+  Entry& entry = it->second;
+  if (entry.job != 0)
+  {
+    entry.again = true;
+    return false;
+  }
+  return start(it->first, entry);
+}
+
+/**
+ * Drops the recorded state of a file that was created, deleted or moved; a verification in flight is abandoned. Its
+ * modify was not reported yet, so the caller reports it before the event that made it stale, keeping their order.
+ * @param path The path of the file.
+ * @return True if a modify of the file was still being verified.
+ */
+bool ContentVerifier::forget(std::string_view path)
+{
+  auto it = _files.find(std::string(path));
+  if (it == _files.end()) return false;
+  const bool pending = it->second.job != 0 && (it->second.report || it->second.again);
+  _files.erase(it);
+  return pending;
+}
+
+/**
+ * Drops the recorded states of the files below a directory that was deleted or moved.
+ * @param dir The path of the directory.
+ * @param pending Called for every file whose modify was still being verified.
+ */
+void ContentVerifier::forgetUnder(std::string_view dir, const Callback& pending)
+{
+  for (auto it = _files.begin(); it != _files.end();)
+  {
+    if (!isBelow(it->first, dir))
+    {
+      ++it;
+      continue;
+    }
+    if (it->second.job != 0 && (it->second.report || it->second.again)) pending(it->first);
+    it = _files.erase(it);
+  }
+}
+
+/**
+ * Applies the verifications that finished, in the order they finished. Results of files that were forgotten in the
+ * meantime are dropped.
+ * @param verdict Called for every modify that was compared, with whether the contents changed; files that could not
+ * be read count as changed.
+ * @return The number of bytes that the verifications read.
+ */
+uint64_t ContentVerifier::collect(const Verdict& verdict)
+{
+  std::vector<Result> results;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    results.swap(_results);
+  }
+
+  uint64_t bytes = 0;
+  for (auto& result : results)
+  {
+    _in_flight--;
+    bytes += result.bytes;
+    auto it = _files.find(result.path);
+    if (it == _files.end() || it->second.job != result.id) continue;
+
+    Entry& entry = it->second;
+    entry.job = 0;
+    entry.known = result.valid;
+    if (result.valid) entry.state = result.state;
+    if (entry.report) verdict(it->first, result.changed);
+
+    /* The state that the next modify is compared against is recorded now */
+    if (entry.again)
+    {
+      entry.again = false;
+      if (start(it->first, entry)) verdict(it->first, true);
+    }
+  }
+  return bytes;
+}
+
+/**
+ * Waits for the verifications in flight and applies them, e.g. before the watcher stops.
+ * @param verdict Called for every modify that was compared, as by collect().
+ * @return The number of bytes that the verifications read.
+ */
+uint64_t ContentVerifier::finish(const Verdict& verdict)
+{
+  uint64_t bytes = 0;
+  while (_in_flight > 0)
+  {
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      _finished.wait(lock, [this] { return !_results.empty(); });
+    }
+    bytes += collect(verdict);
+  }
+  return bytes;
+}
+
+/**
+ * Queues a verification of a file.
+ * @param path The path of the file, the key of its entry.
+ * @param entry The entry of the file.
+ * @return True if the file has no recorded state to compare against, so its modify is not decided by the verification.
+ */
+bool ContentVerifier::start(const std::string& path, Entry& entry)
+{
+  entry.job = ++_next_job;
+  entry.report = entry.known;
+  _in_flight++;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _jobs.push_back(Job{path, entry.job, entry.state, entry.known});
+  }
+  _wakeup.notify_one();
+  return !entry.known;
+}
+
+/**
+ * Takes verifications off the queue and hands their results back, until the verifier is destroyed.
+ */
+void ContentVerifier::workerLoop()
+{
+  std::vector<char> buffer(VERIFY_READ_LEN);
+  std::unique_lock<std::mutex> lock(_mutex);
+  while (true)
+  {
+    _wakeup.wait(lock, [this] { return _stopping || !_jobs.empty(); });
+    if (_stopping) return;
+
+    Job job = std::move(_jobs.front());
+    _jobs.pop_front();
+    lock.unlock();
+    Result result = verify(job, buffer);
+    lock.lock();
+
+    /* The owner is only woken up for the first result of a round, the others are collected along with it */
+    const bool first = _results.empty();
+    _results.push_back(std::move(result));
+    _finished.notify_all();
+    if (first)
+    {
+      lock.unlock();
+      _notify();
+      lock.lock();
+    }
+  }
+}
+
+/**
+ * Compares a file against its recorded state. Unchanged metadata means unchanged contents, like make and rsync assume,
+ * so the file is only read if its size, modification time or inode changed, or if its state was recorded in the same
+ * second it was modified in. The file is read rather than mapped, a mapping of a file that is truncated while it is
+ * hashed would fault.
+ * @param job The file and its recorded state.
+ * @param buffer The buffer that the file is read into.
+ * @return The current state and the verdict.
+ */
+ContentVerifier::Result ContentVerifier::verify(const Job& job, std::vector<char>& buffer)
+{
+  Result result{job.path, job.id, State{0, 0, 0, 0, 0}, false, true, 0};
+
+  int fd = open(job.path.c_str(), O_RDONLY | O_CLOEXEC | O_NOCTTY);
+  if (fd < 0) return result;
+
+  struct stat before;
+  const int64_t stated = wallClock();
+  if (fstat(fd, &before) != 0 || !S_ISREG(before.st_mode))
+  {
+    close(fd);
+    return result;
+  }
+  result.state = State{uint64_t(before.st_size), mtimeOf(before), uint64_t(before.st_ino), 0, stated};
+
+  const State& previous = job.previous;
+  if (job.known && result.state.size == previous.size && result.state.mtime == previous.mtime &&
+      result.state.inode == previous.inode && !isRacy(previous.mtime, previous.stated))
+  {
+    close(fd);
+    result.state.hash = previous.hash;
+    result.valid = true;
+    result.changed = false;
+    return result;
+  }
+
+  /* Fill the whole buffer with every read, only the last block may be shorter than a stripe */
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  Xxh64 hash;
+  bool failed = false;
+  bool eof = false;
+  while (!eof && !failed)
+  {
+    size_t filled = 0;
+    while (filled < buffer.size())
+    {
+      ssize_t length = read(fd, buffer.data() + filled, buffer.size() - filled);
+      if (length < 0 && errno == EINTR) continue;
+      if (length <= 0)
+      {
+        failed = length < 0;
+        eof = true;
+        break;
+      }
+      filled += length;
+    }
+    hash.update(reinterpret_cast<const uint8_t*>(buffer.data()), filled);
+    result.bytes += filled;
+  }
+
+  /* A file that was written while it was read is compared again on its next modify */
+  struct stat after;
+  failed = failed || fstat(fd, &after) != 0 || after.st_size != before.st_size || mtimeOf(after) != mtimeOf(before);
+  close(fd);
+  if (failed) return result;
+
+  result.state.hash = hash.digest();
+  result.valid = true;
+  result.changed = !job.known || result.state.size != previous.size || result.state.hash != previous.hash;
+  return result;
+}
+
+}  // namespace inotify
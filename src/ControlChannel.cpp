@@ -0,0 +1,120 @@
+#include "include/ControlChannel.hpp"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <unistd.h>
+
+#include "include/InotifyError.hpp"
+
+namespace inotify {
+
+namespace {
+
+sigset_t controlSignals()
+{
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGHUP);
+  sigaddset(&signals, SIGUSR1);
+  return signals;
+}
+
+}  // namespace
+
+/**
+ * Blocks the control signals in the calling thread and creates the signalfd and the command eventfd.
+ * @param handler Called on the loop thread for every signal and posted command.
+ * @throws InotifyError if the signals could not be blocked or the file descriptors could not be created.
+ */
+ControlChannel::ControlChannel(Handler handler)
+  : _handler(std::move(handler)), _reactor(nullptr), _signal_fd(-1), _command_fd(-1), _commands(0)
+{
+  const sigset_t signals = controlSignals();
+  if (pthread_sigmask(SIG_BLOCK, &signals, nullptr) != 0) throw InotifyError("Failed to block the control signals");
+
+  _signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (_signal_fd == -1) throw InotifyError("Failed to create the signalfd");
+
+  _command_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_command_fd == -1)
+  {
+    close(_signal_fd);
+    throw InotifyError("Failed to create the command eventfd");
+  }
+}
+
+ControlChannel::~ControlChannel()
+{
+  detach();
+  close(_command_fd);
+  close(_signal_fd);
+}
+
+/**
+ * Registers the channel with a reactor. A channel is serviced by one reactor at a time; attaching it again moves it.
+ * @param reactor The loop to dispatch the commands on; it has to outlive the attachment.
+ */
+void ControlChannel::attach(Reactor& reactor)
+{
+  detach();
+  reactor.add(_signal_fd, EPOLLIN, [this](uint32_t) { readSignals(); });
+  reactor.add(_command_fd, EPOLLIN, [this](uint32_t) { readCommands(); });
+  _reactor = &reactor;
+}
+
+void ControlChannel::detach()
+{
+  if (_reactor == nullptr) return;
+  _reactor->remove(_signal_fd);
+  _reactor->remove(_command_fd);
+  _reactor = nullptr;
+}
+
+/**
+ * Queues a command for the loop thread. Posting the same command again before it was dispatched has no extra effect.
+ * @param command The command to dispatch.
+ */
+void ControlChannel::post(Command command)
+{
+  _commands.fetch_or(1u << static_cast<uint32_t>(command), std::memory_order_release);
+  eventfd_write(_command_fd, 1);
+}
+
+void ControlChannel::readSignals()
+{
+  signalfd_siginfo info;
+  while (read(_signal_fd, &info, sizeof(info)) == sizeof(info))
+  {
+    switch (info.ssi_signo)
+    {
+      case SIGINT:
+      case SIGTERM:
+        _handler(Command::Stop);
+        break;
+      case SIGHUP:
+        _handler(Command::Reload);
+        break;
+      case SIGUSR1:
+        _handler(Command::DumpMetrics);
+        break;
+    }
+  }
+}
+
+void ControlChannel::readCommands()
+{
+  eventfd_t count;
+  eventfd_read(_command_fd, &count);
+
+  const uint32_t commands = _commands.exchange(0, std::memory_order_acquire);
+  for (Command command : {Command::Reload, Command::DumpMetrics, Command::Stop})
+  {
+    if (commands & (1u << static_cast<uint32_t>(command))) _handler(command);
+  }
+}
+
+}  // namespace inotify
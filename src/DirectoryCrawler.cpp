@@ -0,0 +1,223 @@
+#include "include/DirectoryCrawler.hpp"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <thread>
+
+namespace inotify {
+
+/* Size of the buffer used for a single getdents64 call */
+static constexpr size_t DIRENT_BUFFER_LEN = 32 * 1024;
+
+/* Layout of the records returned by getdents64 */
+struct linux_dirent64 {
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+ * Creates a crawler.
+ * @param workers The number of worker threads used to enumerate directories.
+ * @param filter Returns true for subdirectories (parent path and name) that are not crawled.
+ */
+DirectoryCrawler::DirectoryCrawler(size_t workers, Filter filter)
+  : _worker_cnt(workers == 0 ? 1 : workers), _filter(std::move(filter)), _pending(0), _queued(0), _aborted(false)
+{
+  for (size_t i = 0; i < _worker_cnt; ++i) _queues.push_back(std::make_unique<WorkQueue>());
+}
+
+/**
+ * Crawls the directory tree below the root and hands every directory, including the root, to the visitor.
+ * The visitor runs on the calling thread. A directory is always visited before any of its subdirectories.
+ * @param root The directory to crawl.
+ * @param visit Called for every directory; returning false aborts the crawl.
+ * @param progress Optionally called about once per second with the number of directories visited so far.
+ * @return Statistics of the crawl.
+ */
+DirectoryCrawler::Stats DirectoryCrawler::crawl(
+    const std::filesystem::path& root, const Visitor& visit, const Progress& progress)
+{
+  const auto start = std::chrono::steady_clock::now();
+  auto last_report = start;
+  Stats stats{0, std::chrono::microseconds(0), false};
+
+  _aborted = false;
+  _output.push_back(root);
+  _pending = 1;
+  _queued = 1;
+  _queues[0]->dirs.push_back(root);
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i < _worker_cnt; ++i) workers.emplace_back(&DirectoryCrawler::workerLoop, this, i);
+
+  std::vector<std::filesystem::path> batch;
+  for (;;)
+  {
+    {
+      std::unique_lock<std::mutex> lock(_output_mutex);
+      _output_cv.wait_for(lock, std::chrono::seconds(1), [this] { return !_output.empty() || _pending == 0; });
+      /* Only finished when nothing is queued and every discovered directory was handed over */
+      if (_output.empty() && _pending == 0) break;
+      batch.swap(_output);
+    }
+
+    for (const auto& dir : batch)
+    {
+      if (!stats.aborted && !visit(dir))
+      {
+        stats.aborted = true;
+        _aborted = true;
+      }
+      if (!stats.aborted) stats.directories++;
+    }
+    batch.clear();
+
+    if (progress && std::chrono::steady_clock::now() - last_report >= std::chrono::seconds(1))
+    {
+      last_report = std::chrono::steady_clock::now();
+      progress(stats.directories);
+    }
+  }
+
+  for (auto& worker : workers) worker.join();
+  for (auto& queue : _queues) queue->dirs.clear();
+
+  stats.elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+  return stats;
+}
+
+/**
+ * Enumerates directories until the crawl is done. A worker without anything to take sleeps until work is queued, so
+ * the others don't burn CPU while one of them is stuck listing a large directory on a slow filesystem.
+ */
+void DirectoryCrawler::workerLoop(size_t index)
+{
+  std::filesystem::path dir;
+  while (_pending > 0)
+  {
+    if (!takeWork(index, dir))
+    {
+      std::unique_lock<std::mutex> lock(_idle_mutex);
+      _idle_cv.wait(lock, [this] { return _queued > 0 || _pending == 0; });
+      continue;
+    }
+
+    if (!_aborted) enumerate(index, dir);
+
+    if (--_pending == 0)
+    {
+      wakeIdle();
+      std::lock_guard<std::mutex> lock(_output_mutex);
+      _output_cv.notify_one();
+    }
+  }
+}
+
+/**
+ * Takes the most recently queued directory of the worker's own queue, or the oldest directory of another worker's
+ * queue.
+ * Stealing from the front hands out the shallower, larger subtrees first.
+ */
+bool DirectoryCrawler::takeWork(size_t index, std::filesystem::path& dir)
+{
+  {
+    WorkQueue& own = *_queues[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    if (!own.dirs.empty())
+    {
+      dir = std::move(own.dirs.back());
+      own.dirs.pop_back();
+      _queued--;
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i < _worker_cnt; ++i)
+  {
+    WorkQueue& victim = *_queues[(index + i) % _worker_cnt];
+    std::lock_guard<std::mutex> lock(victim.mutex);
+    if (!victim.dirs.empty())
+    {
+      dir = std::move(victim.dirs.front());
+      victim.dirs.pop_front();
+      _queued--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Lists the subdirectories of a directory with getdents64 and queues them. Symbolic links are not followed.
+ */
+void DirectoryCrawler::enumerate(size_t index, const std::filesystem::path& dir)
+{
+  int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) return; /* Vanished or unreadable; there is nothing to crawl */
+
+  std::vector<std::filesystem::path> subdirs;
+  alignas(linux_dirent64) char buffer[DIRENT_BUFFER_LEN];
+
+  for (;;)
+  {
+    long length = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+    if (length <= 0) break;
+
+    for (long offset = 0; offset < length;)
+    {
+      auto entry = reinterpret_cast<linux_dirent64*>(buffer + offset);
+      offset += entry->d_reclen;
+
+      const char* name = entry->d_name;
+      if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+
+      bool is_dir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN)
+      {
+        /* Some filesystems don't fill in d_type */
+        struct stat st;
+        is_dir = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+      }
+
+      if (is_dir && !_filter(dir, name)) subdirs.push_back(dir / name);
+    }
+  }
+  close(fd);
+
+  for (const auto& subdir : subdirs) emit(subdir);
+
+  if (subdirs.empty()) return;
+  _pending += subdirs.size();
+  {
+    WorkQueue& own = *_queues[index];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    for (auto& subdir : subdirs) own.dirs.push_back(std::move(subdir));
+    _queued += subdirs.size();
+  }
+  wakeIdle();
+}
+
+/* Taking the lock orders the wakeup after the check of a worker that is about to wait, so it can't be missed */
+void DirectoryCrawler::wakeIdle()
+{
+  std::lock_guard<std::mutex> lock(_idle_mutex);
+  _idle_cv.notify_all();
+}
+
+void DirectoryCrawler::emit(const std::filesystem::path& dir)
+{
+  std::lock_guard<std::mutex> lock(_output_mutex);
+  _output.push_back(dir);
+  if (_output.size() == 1) _output_cv.notify_one();
+}
+
+}  // namespace inotify
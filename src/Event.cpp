@@ -0,0 +1,43 @@
+#include "include/Event.hpp"
+
+namespace inotify {
+
+/**
+ * Writes an event as a human readable line.
+ * @param logger The logger to write to.
+ * @param event The event to describe.
+ */
+void logEvent(Logger& logger, const Event& event)
+{
+  const char* path = event.path.c_str();
+  switch (event.type)
+  {
+    case EventType::Create:
+      logger.logEvent(event.is_dir ? "Created directory: %s" : "Created file: %s", path);
+      break;
+    case EventType::Delete:
+      logger.logEvent(event.is_dir ? "Deleted directory: %s" : "Deleted file: %s", path);
+      break;
+    case EventType::Modify:
+      logger.logEvent("Modified file: %s", path);
+      break;
+    case EventType::Move:
+      /* A move within the same directory is a rename */
+      if (event.old_path.parent_path() == event.path.parent_path())
+        logger.logEvent(
+            event.is_dir ? "Renamed directory: %s -> %s" : "Renamed file: %s -> %s", event.old_path.c_str(), path);
+      else
+        logger.logEvent(
+            event.is_dir ? "Moved directory: %s -> %s" : "Moved file: %s -> %s", event.old_path.c_str(), path);
+      break;
+    case EventType::MoveOut:
+      logger.logEvent(
+          event.is_dir ? "Moved out of watch directory: %s" : "Moved file out of watch directory: %s", path);
+      break;
+    case EventType::Rescan:
+      logger.logEvent("Changed directory: %s", path);
+      break;
+  }
+}
+
+}  // namespace inotify
@@ -0,0 +1,56 @@
+#include "include/EventBatch.hpp"
+
+namespace inotify {
+
+/**
+ * Appends an event, copying its paths into the arena.
+ * @param type What happened.
+ * @param is_dir Whether the event is about a directory.
+ * @param path The path the event is about; the new path of a move.
+ * @param old_path The previous path of a move, empty otherwise.
+ * @param cookie The kernel cookie of a move half.
+ * @param time When the event was read from the kernel.
+ */
+void EventBatch::add(EventType type,
+    bool is_dir,
+    std::string_view path,
+    std::string_view old_path,
+    uint32_t cookie,
+    std::chrono::steady_clock::time_point time)
+{
+  Entry entry{type, is_dir, cookie, uint32_t(_arena.size()), uint32_t(path.size()), 0, 0, time};
+  _arena.append(path);
+  entry.old_path_offset = _arena.size();
+  entry.old_path_size = old_path.size();
+  _arena.append(old_path);
+  _entries.push_back(entry);
+}
+
+void EventBatch::add(const Event& event)
+{
+  add(event.type, event.is_dir, event.path.native(), event.old_path.native(), event.cookie, event.time);
+}
+
+void EventBatch::clear()
+{
+  _entries.clear();
+  _arena.clear();
+}
+
+/**
+ * Copies an entry into a standalone event, for consumers that handle events one at a time.
+ * @param index The index of the entry.
+ * @return The event.
+ */
+Event EventBatch::event(size_t index) const
+{
+  const Entry& entry = _entries[index];
+  return Event{entry.type,
+      entry.is_dir,
+      std::filesystem::path(path(entry)),
+      std::filesystem::path(oldPath(entry)),
+      entry.cookie,
+      entry.time};
+}
+
+}  // namespace inotify
@@ -0,0 +1,47 @@
+#include "include/EventHandler.hpp"
+
+namespace inotify {
+
+/**
+ * Hands the events of a batch to onEvent() one by one.
+ * @param batch The events of one read.
+ */
+void EventHandler::onBatch(const EventBatch& batch)
+{
+  for (size_t i = 0; i < batch.size(); ++i) onEvent(batch.event(i));
+}
+
+/**
+ * Calls the callback that matches the type of the event.
+ * @param event The event to dispatch.
+ */
+void EventHandler::onEvent(const Event& event)
+{
+  switch (event.type)
+  {
+    case EventType::Create:
+      onCreate(event);
+      break;
+    case EventType::Delete:
+      onDelete(event);
+      break;
+    case EventType::Modify:
+      onModify(event);
+      break;
+    case EventType::Move:
+      onMove(event);
+      break;
+    case EventType::MoveOut:
+      onMoveOut(event);
+      break;
+    case EventType::Rescan:
+      onRescan(event);
+      break;
+  }
+}
+
+LoggingHandler::LoggingHandler(Logger::Mode mode) : _logger(mode) {}
+
+void LoggingHandler::onEvent(const Event& event) { logEvent(_logger, event); }
+
+}  // namespace inotify
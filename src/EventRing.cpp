@@ -0,0 +1,62 @@
+#include "include/EventRing.hpp"
+
+#include <algorithm>
+
+namespace inotify {
+
+/**
+ * Allocates all buffers of the ring.
+ * @param capacity The number of buffers.
+ * @param slot_size The size of every buffer in bytes.
+ */
+EventRing::EventRing(size_t capacity, size_t slot_size)
+  : _slots(std::max<size_t>(capacity, 1)), _slot_size(slot_size), _head(0), _max_occupancy(0), _tail(0)
+{
+  for (auto& slot : _slots) slot.data = std::make_unique<uint8_t[]>(slot_size);
+}
+
+/**
+ * Returns the slot at the head of the ring to be filled by the producer.
+ * @return The free slot, or nullptr if every slot is still waiting for the consumer.
+ */
+EventRing::Slot* EventRing::acquire()
+{
+  const size_t head = _head.load(std::memory_order_relaxed);
+  if (head - _tail.load(std::memory_order_acquire) == _slots.size()) return nullptr;
+  return &_slots[head % _slots.size()];
+}
+
+/**
+ * Publishes the slot returned by the last acquire(); its contents become visible to the consumer.
+ */
+void EventRing::publish()
+{
+  const size_t head = _head.load(std::memory_order_relaxed) + 1;
+  _head.store(head, std::memory_order_release);
+
+  const size_t occupancy = head - _tail.load(std::memory_order_relaxed);
+  if (occupancy > _max_occupancy.load(std::memory_order_relaxed))
+    _max_occupancy.store(occupancy, std::memory_order_relaxed);
+}
+
+/**
+ * Returns the oldest published slot.
+ * @return The slot, or nullptr if the ring is empty.
+ */
+EventRing::Slot* EventRing::front()
+{
+  const size_t tail = _tail.load(std::memory_order_relaxed);
+  if (_head.load(std::memory_order_acquire) == tail) return nullptr;
+  return &_slots[tail % _slots.size()];
+}
+
+/**
+ * Releases the slot returned by front(), so that the producer can fill it again.
+ */
+void EventRing::pop() { _tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+void EventRing::clear() { _tail.store(_head.load(std::memory_order_acquire), std::memory_order_release); }
+
+size_t EventRing::size() const { return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire); }
+
+}  // namespace inotify
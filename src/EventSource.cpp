@@ -0,0 +1,60 @@
+#include "include/EventSource.hpp"
+
+#include <sys/inotify.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+#include "include/InotifyError.hpp"
+
+namespace inotify {
+
+ReplaySource::ReplaySource(std::vector<uint8_t> events) : _events(std::move(events)), _offset(0) {}
+
+ReplaySource::ReplaySource(const uint8_t* data, size_t size) : _events(data, data + size), _offset(0) {}
+
+/**
+ * Loads a recorded stream.
+ * @param path The file the events were recorded to.
+ * @return The source that replays it.
+ * @throws InotifyError if the file can't be read.
+ */
+ReplaySource ReplaySource::fromFile(const std::filesystem::path& path)
+{
+  std::ifstream in(path, std::ios::binary);
+  if (!in) throw InotifyError("Failed to open the recording " + path.string());
+  std::vector<uint8_t> events((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+  if (in.bad()) throw InotifyError("Failed to read the recording " + path.string());
+  return ReplaySource(std::move(events));
+}
+
+/**
+ * Hands out the next records.
+ * @param buffer The buffer to copy them into.
+ * @param size The size of the buffer.
+ * @return The number of bytes copied, 0 at the end of the stream.
+ */
+ssize_t ReplaySource::read(uint8_t* buffer, size_t size)
+{
+  /* Whole records only, like the kernel; the header is copied out, the stream need not be aligned */
+  size_t length = 0;
+  while (_offset + length + sizeof(inotify_event) <= _events.size())
+  {
+    inotify_event header;
+    std::memcpy(&header, _events.data() + _offset + length, sizeof(header));
+    const size_t record_len = sizeof(inotify_event) + header.len;
+    if (_events.size() - _offset - length < record_len || size - length < record_len) break;
+    length += record_len;
+  }
+
+  /* What can't be decoded is passed on in raw bytes, so that the stream always ends */
+  if (length == 0) length = std::min(size, pending());
+
+  std::memcpy(buffer, _events.data() + _offset, length);
+  _offset += length;
+  return ssize_t(length);
+}
+
+}  // namespace inotify
@@ -0,0 +1,183 @@
+#include "include/EventWriter.hpp"
+
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+
+#include "include/InotifyError.hpp"
+
+namespace inotify {
+
+static_assert(uint8_t(RecordType::Create) == uint8_t(EventType::Create) &&
+                  uint8_t(RecordType::Delete) == uint8_t(EventType::Delete) &&
+                  uint8_t(RecordType::Modify) == uint8_t(EventType::Modify) &&
+                  uint8_t(RecordType::Move) == uint8_t(EventType::Move) &&
+                  uint8_t(RecordType::MoveOut) == uint8_t(EventType::MoveOut) &&
+                  uint8_t(RecordType::Rescan) == uint8_t(EventType::Rescan),
+    "The record types of the stream are the event types");
+
+namespace {
+
+/* Names of the event types in the JSON output, indexed by EventType */
+constexpr const char* TYPE_NAMES[] = {"create", "delete", "modify", "move", "move_out", "rescan"};
+
+template <typename T>
+void append(std::string& out, T value)
+{
+  /* Little-endian, like every Linux target the watcher runs on */
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+/* Appends a JSON string; the bytes of the path are kept, only quotes, backslashes and control characters are escaped */
+void appendJson(std::string& out, std::string_view text)
+{
+  out += '"';
+  for (char c : text)
+  {
+    if (c == '"' || c == '\\')
+    {
+      out += '\\';
+      out += c;
+    }
+    else if (uint8_t(c) < 0x20)
+    {
+      char escape[8];
+      std::snprintf(escape, sizeof(escape), "\\u%04x", unsigned(uint8_t(c)));
+      out += escape;
+    }
+    else
+      out += c;
+  }
+  out += '"';
+}
+
+}  // namespace
+
+/**
+ * Creates a writer; the binary stream header is written right away, so a reader can check the stream before the first
+ * event.
+ * @param format How the events are encoded.
+ * @param roots The watched roots; the root id of an event is the index of the root its path is in.
+ * @param fd The output, e.g. a pipe to the consumer; not owned.
+ * @throws InotifyError if the stream header could not be written.
+ */
+EventWriter::EventWriter(Format format, const std::vector<std::filesystem::path>& roots, int fd)
+  : _format(format), _fd(fd)
+{
+  for (const auto& root : roots)
+  {
+    /* Spelled like the paths of the events, which are built from the roots as given */
+    std::string path = root.native();
+    while (path.size() > 1 && path.back() == '/') path.pop_back();
+    _roots.push_back(std::move(path));
+  }
+
+  if (_format == Format::Binary)
+  {
+    _buffer.append(EVENT_STREAM_MAGIC, 4);
+    append<uint16_t>(_buffer, EVENT_STREAM_VERSION);
+    append<uint16_t>(_buffer, EVENT_RECORD_HEADER_LEN);
+    flush();
+  }
+}
+
+/**
+ * Encodes all events of a batch and writes them at once.
+ * @param batch The events of one read.
+ */
+void EventWriter::onBatch(const EventBatch& batch)
+{
+  for (const auto& entry : batch)
+    encode(entry.type, entry.is_dir, batch.path(entry), batch.oldPath(entry), entry.cookie, entry.time);
+  flush();
+}
+
+void EventWriter::onEvent(const Event& event)
+{
+  encode(event.type, event.is_dir, event.path.native(), event.old_path.native(), event.cookie, event.time);
+  flush();
+}
+
+/**
+ * Appends an event to the buffer in the output format.
+ */
+void EventWriter::encode(EventType type,
+    bool is_dir,
+    std::string_view path,
+    std::string_view old_path,
+    uint32_t cookie,
+    std::chrono::steady_clock::time_point time)
+{
+  const uint64_t time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+  const uint16_t root = rootOf(path);
+
+  if (_format == Format::Binary)
+  {
+    append<uint32_t>(_buffer, EVENT_RECORD_HEADER_LEN + path.size() + old_path.size());
+    append<uint8_t>(_buffer, uint8_t(type));
+    append<uint8_t>(_buffer, is_dir ? RECORD_DIR : 0);
+    append<uint16_t>(_buffer, root);
+    append<uint32_t>(_buffer, cookie);
+    append<uint64_t>(_buffer, time_ns);
+    append<uint32_t>(_buffer, path.size());
+    append<uint32_t>(_buffer, old_path.size());
+    _buffer.append(path);
+    _buffer.append(old_path);
+    return;
+  }
+
+  /* Every object has all fields, in the same order; the ones that don't apply are null, or 0 for the cookie */
+  char fields[128];
+  std::snprintf(fields,
+      sizeof(fields),
+      "{\"type\":\"%s\",\"dir\":%s,\"time\":%" PRIu64 ",\"root\":",
+      TYPE_NAMES[int(type)],
+      is_dir ? "true" : "false",
+      time_ns);
+  _buffer += fields;
+  _buffer += root == RECORD_NO_ROOT ? "null" : std::to_string(root);
+  _buffer += ",\"path\":";
+  appendJson(_buffer, path);
+  _buffer += ",\"old_path\":";
+  if (type == EventType::Move)
+    appendJson(_buffer, old_path);
+  else
+    _buffer += "null";
+  _buffer += ",\"cookie\":";
+  _buffer += std::to_string(cookie);
+  _buffer += "}\n";
+}
+
+/**
+ * Finds the root of a path. The roots are never nested, so the first one that is a prefix is the one.
+ * @return The index of the root, or RECORD_NO_ROOT if the path is in none of them.
+ */
+uint16_t EventWriter::rootOf(std::string_view path) const
+{
+  for (size_t i = 0; i < _roots.size() && i < RECORD_NO_ROOT; ++i)
+  {
+    const std::string& root = _roots[i];
+    if (path.compare(0, root.size(), root) != 0) continue;
+    if (path.size() == root.size() || root.back() == '/' || path[root.size()] == '/') return uint16_t(i);
+  }
+  return RECORD_NO_ROOT;
+}
+
+/**
+ * Writes the buffer out, retrying after partial writes.
+ * @throws InotifyError if the output can't be written, e.g. because the consumer went away.
+ */
+void EventWriter::flush()
+{
+  size_t written = 0;
+  while (written < _buffer.size())
+  {
+    ssize_t length = write(_fd, _buffer.data() + written, _buffer.size() - written);
+    if (length < 0 && errno == EINTR) continue;
+    if (length < 0) throw InotifyError("Failed to write events");
+    written += length;
+  }
+  _buffer.clear();
+}
+
+}  // namespace inotify
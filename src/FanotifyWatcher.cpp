@@ -0,0 +1,409 @@
+#include "include/FanotifyWatcher.hpp"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+
+#include "include/InotifyError.hpp"
+
+namespace inotify {
+
+/**
+ * Constructor for a watcher that marks the whole filesystem of the root with fanotify.
+ * @param path The root directory to monitor for file system changes.
+ * @param ignored_dirs Ignore patterns for the entries to be excluded from monitoring.
+ * @param options Tunables of the instance; close_write selects FAN_CLOSE_WRITE instead of FAN_MODIFY.
+ * @throws InotifyError if fanotify could not be initialized, e.g. without CAP_SYS_ADMIN.
+ */
+FanotifyWatcher::FanotifyWatcher(const std::filesystem::path& path,
+    const std::vector<std::string>& ignored_dirs,
+    const InotifyOptions& options)
+  : _root(std::filesystem::absolute(path).lexically_normal())
+  , _ignore(ignored_dirs, _root)
+  , _options(options)
+  , _reactor(std::make_unique<Reactor>())
+  , _fanotify_fd(-1)
+  , _mount_fd(-1)
+  , _event_buffer(FANOTIFY_BUFFER_MIN, FANOTIFY_BUFFER_MAX)
+  , _stopped(false)
+  , _handler(nullptr)
+  , _control(nullptr)
+  , _logger{options.log_mode, options.log_fd}
+{
+  initialize();
+}
+
+FanotifyWatcher::~FanotifyWatcher()
+{
+  if (_control) _control->detach();
+  terminate();
+}
+
+/**
+ * Initializes the fanotify group, marks the filesystem of the root and registers the group with the reactor.
+ */
+void FanotifyWatcher::initialize()
+{
+  _fanotify_fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY);
+  if (_fanotify_fd < 0) throw InotifyError("Failed to initialize fanotify");
+
+  /* Any directory of the filesystem works for open_by_handle_at. Holding the root itself open would keep it from being
+   * deleted, so use the mount point that contains it */
+  std::filesystem::path mount_point = _root;
+  struct stat root_st, parent_st;
+  if (stat(_root.c_str(), &root_st) == 0)
+  {
+    while (mount_point.has_relative_path() && stat(mount_point.parent_path().c_str(), &parent_st) == 0 &&
+           parent_st.st_dev == root_st.st_dev)
+      mount_point = mount_point.parent_path();
+  }
+
+  _mount_fd = open(mount_point.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (_mount_fd < 0)
+  {
+    terminate();
+    throw InotifyError("Failed to open mount point " + mount_point.string());
+  }
+
+  /* Directory entry events, also for subdirectories, and either every write or only the closing of written files */
+  uint64_t mask = FAN_CREATE | FAN_DELETE | FAN_ONDIR | (_options.close_write ? FAN_CLOSE_WRITE : FAN_MODIFY);
+  if (fanotify_mark(_fanotify_fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask | FAN_RENAME, AT_FDCWD, _root.c_str()) == -1)
+  {
+    /* Kernels before 5.17 only report the two halves of a move, without anything to pair them by */
+    if (errno != EINVAL ||
+        fanotify_mark(_fanotify_fd,
+            FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+            mask | FAN_MOVED_FROM | FAN_MOVED_TO,
+            AT_FDCWD,
+            _root.c_str()) == -1)
+    {
+      terminate();
+      throw InotifyError("Failed to mark the filesystem of " + _root.string());
+    }
+  }
+
+  /* Watch for the root directory being deleted or moved */
+  if (fanotify_mark(_fanotify_fd, FAN_MARK_ADD, FAN_DELETE_SELF | FAN_MOVE_SELF | FAN_ONDIR, AT_FDCWD, _root.c_str()) ==
+      -1)
+  {
+    terminate();
+    throw InotifyError("Failed to mark root directory " + _root.string());
+  }
+
+  _reactor->add(_fanotify_fd, EPOLLIN, [this](uint32_t) { drainEvents(); });
+}
+
+/**
+ * Gracefully terminates the fanotify instance, closing its file descriptors.
+ */
+void FanotifyWatcher::terminate() noexcept
+{
+  if (_fanotify_fd >= 0)
+  {
+    _reactor->remove(_fanotify_fd);
+    close(_fanotify_fd);
+  }
+  if (_mount_fd >= 0) close(_mount_fd);
+  _fanotify_fd = -1;
+  _mount_fd = -1;
+}
+
+/**
+ * Starts the watcher, processing file events in an ongoing loop.
+ */
+void FanotifyWatcher::run()
+{
+  _stopped = false;
+  while (!_stopped)
+  {
+    _reactor->runOnce();
+  }
+}
+
+/**
+ * Stops the watcher by setting the _stopped flag and waking up the reactor.
+ */
+void FanotifyWatcher::stop()
+{
+  _stopped = true;
+  _reactor->wakeup();
+}
+
+/**
+ * Sets the consumer of the events. Without a handler the events are logged. Has to be set before the watcher runs.
+ * @param handler Called on the watcher thread with the events of every read; not owned, has to outlive the watcher.
+ */
+void FanotifyWatcher::setEventHandler(EventHandler* handler) { _handler = handler; }
+
+/**
+ * Services a control channel on the reactor of the watcher. Has to be called before the watcher runs, or from the loop
+ * thread.
+ * @param channel The channel to service, or null to detach the current one; not owned, has to outlive the watcher.
+ */
+void FanotifyWatcher::setControlChannel(ControlChannel* channel)
+{
+  if (_control) _control->detach();
+  _control = channel;
+  if (_control) _control->attach(*_reactor);
+}
+
+/**
+ * Replaces the ignore patterns without restarting the watcher. There are no watches to fix up, the mark covers the
+ * whole filesystem; only the cached directory paths are dropped, since they remember whether they are ignored.
+ * @param patterns The new ignore patterns; they replace all of the current ones.
+ */
+void FanotifyWatcher::setIgnorePatterns(const std::vector<std::string>& patterns)
+{
+  _reactor->post([this, patterns] {
+    _ignore = IgnoreMatcher(patterns, _root);
+    _directories.clear();
+    _logger.logEvent("Reloaded ignore rules");
+  });
+}
+
+/**
+ * Formats the runtime metrics of the watcher in the Prometheus text format. There are no watches, so the watch count
+ * and the cache metrics stay zero.
+ */
+std::string FanotifyWatcher::metrics() const { return _metrics.format(); }
+
+/**
+ * Reads and processes events until the non-blocking fanotify file descriptor has no more events queued.
+ * @throws InotifyError if reading from the fanotify file descriptor failed.
+ */
+void FanotifyWatcher::drainEvents()
+{
+  /* Size the buffer to drain the whole queue in one read, the events of the last wakeup are all processed; if the
+     queue can't be measured, the buffer keeps its size */
+  int queued = 0;
+  if (ioctl(_fanotify_fd, FIONREAD, &queued) == 0)
+  {
+    _metrics.queue_depth.record(queued);
+    _event_buffer.fit(size_t(queued));
+  }
+  _metrics.read_buffer_bytes.set(_event_buffer.size());
+
+  uint64_t wakeup_bytes = 0;
+  while (!_stopped)
+  {
+    ssize_t length = read(_fanotify_fd, _event_buffer.data(), _event_buffer.size());
+    if (length == -1 && errno == EAGAIN) break;
+    if (length == -1 && errno == EINTR) continue;
+    if (length == -1) throw InotifyError("Failed to read from fanotify file descriptor");
+    _read_time = std::chrono::steady_clock::now();
+    _metrics.reads.add();
+    _metrics.bytes.add(length);
+    wakeup_bytes += length;
+
+    uint64_t event_cnt = 0;
+    auto metadata = reinterpret_cast<const fanotify_event_metadata*>(_event_buffer.data());
+    for (; FAN_EVENT_OK(metadata, length) && !_stopped; metadata = FAN_EVENT_NEXT(metadata, length))
+    {
+      if (metadata->vers != FANOTIFY_METADATA_VERSION) throw InotifyError("Unsupported fanotify metadata version");
+      event_cnt++;
+      processEvent(metadata);
+    }
+    _metrics.events.add(event_cnt);
+    _metrics.events_per_read.record(event_cnt);
+
+    /* One batch per read */
+    if (_handler && !_batch.empty())
+    {
+      _handler->onBatch(_batch);
+      _batch.clear();
+    }
+    countDroppedLines();
+  }
+
+  if (wakeup_bytes > 0) _metrics.bytes_per_wakeup.record(wakeup_bytes);
+}
+
+/**
+ * Mirrors the lines that the async logs dropped, of the watcher and of a handler that logs the events, in the metrics.
+ */
+void FanotifyWatcher::countDroppedLines()
+{
+  const uint64_t dropped = _logger.dropped() + (_handler ? _handler->dropped() : 0);
+  const uint64_t counted = _metrics.dropped_log_lines.value();
+  if (dropped > counted) _metrics.dropped_log_lines.add(dropped - counted);
+}
+
+/**
+ * Processes a single event. An event can combine several changes of the same entry, e.g. a creation and a
+ * modification; they are reported in the order they must have happened.
+ * @param metadata The event to process.
+ */
+void FanotifyWatcher::processEvent(const fanotify_event_metadata* metadata)
+{
+  if (metadata->fd >= 0) close(metadata->fd);
+
+  if (metadata->mask & FAN_Q_OVERFLOW)
+  {
+    /* There are no watches to repair; consumers have to rescan the tree */
+    _logger.logEvent("Queue overflow occurred");
+    _metrics.overflows.add();
+    _directories.clear();
+    emit(EventType::Rescan, true, _root);
+    return;
+  }
+
+  if (metadata->mask & (FAN_DELETE_SELF | FAN_MOVE_SELF))
+  {
+    _logger.logEvent("Nothing to watch.");
+    stop();
+    return;
+  }
+
+  /* Collect the directory and name records of the event */
+  const Directory* dir = nullptr;
+  const Directory* old_dir = nullptr;
+  const Directory* new_dir = nullptr;
+  const char* name = nullptr;
+  const char* old_name = nullptr;
+  const char* new_name = nullptr;
+
+  auto record = reinterpret_cast<const uint8_t*>(metadata) + metadata->metadata_len;
+  auto end = reinterpret_cast<const uint8_t*>(metadata) + metadata->event_len;
+  while (record + sizeof(fanotify_event_info_header) <= end)
+  {
+    auto header = reinterpret_cast<const fanotify_event_info_header*>(record);
+    if (header->len == 0 || record + header->len > end) break;
+
+    auto info = reinterpret_cast<const fanotify_event_info_fid*>(record);
+    auto handle = reinterpret_cast<const struct file_handle*>(info->handle);
+    const char* entry = reinterpret_cast<const char*>(handle->f_handle + handle->handle_bytes);
+    switch (header->info_type)
+    {
+      case FAN_EVENT_INFO_TYPE_DFID_NAME:
+        dir = resolve(info);
+        name = entry;
+        break;
+      case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+        old_dir = resolve(info);
+        old_name = entry;
+        break;
+      case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+        new_dir = resolve(info);
+        new_name = entry;
+        break;
+    }
+    record += header->len;
+  }
+
+  const bool is_dir = metadata->mask & FAN_ONDIR;
+  auto included = [this, is_dir](const Directory* parent, const char* entry) {
+    return parent != nullptr && !parent->excluded && entry != nullptr && !_ignore.matches(parent->path, entry, is_dir);
+  };
+
+  if (metadata->mask & FAN_RENAME)
+  {
+    const bool from = included(old_dir, old_name);
+    const bool to = included(new_dir, new_name);
+    const std::filesystem::path old_path = from ? std::filesystem::path(old_dir->path) / old_name : "";
+    const std::filesystem::path new_path = to ? std::filesystem::path(new_dir->path) / new_name : "";
+    if (from && to)
+      emit(EventType::Move, is_dir, new_path, old_path);
+    else if (from)
+      emit(EventType::MoveOut, is_dir, old_path);
+    else if (to)
+      emit(EventType::Create, is_dir, new_path);
+  }
+
+  if (included(dir, name))
+  {
+    const std::filesystem::path full_path = std::filesystem::path(dir->path) / name;
+    if (metadata->mask & FAN_MOVED_FROM) emit(EventType::MoveOut, is_dir, full_path);
+    if (metadata->mask & (FAN_CREATE | FAN_MOVED_TO)) emit(EventType::Create, is_dir, full_path);
+    if ((metadata->mask & (FAN_MODIFY | FAN_CLOSE_WRITE)) && !is_dir) emit(EventType::Modify, false, full_path);
+    if (metadata->mask & FAN_DELETE) emit(EventType::Delete, is_dir, full_path);
+  }
+
+  /* Paths below a moved or deleted directory changed; the resolved directories point into the cache, so it is only
+   * dropped once they are no longer used */
+  if (is_dir && (metadata->mask & (FAN_RENAME | FAN_MOVED_FROM | FAN_DELETE))) _directories.clear();
+}
+
+/**
+ * Resolves the directory file handle of an info record to a path, remembering the result by handle. The cache is
+ * dropped whenever a directory is moved or deleted, since that changes or invalidates the remembered paths.
+ * @param info The info record with the file handle of the directory.
+ * @return The resolved directory, or nullptr if the directory no longer exists.
+ */
+const FanotifyWatcher::Directory* FanotifyWatcher::resolve(const struct fanotify_event_info_fid* info)
+{
+  auto handle = reinterpret_cast<const struct file_handle*>(info->handle);
+  std::string key(reinterpret_cast<const char*>(&handle->handle_type), sizeof(handle->handle_type));
+  key.append(reinterpret_cast<const char*>(handle->f_handle), handle->handle_bytes);
+
+  auto it = _directories.find(key);
+  if (it != _directories.end()) return &it->second;
+
+  int fd = open_by_handle_at(_mount_fd, const_cast<struct file_handle*>(handle), O_PATH | O_CLOEXEC);
+  if (fd == -1) return nullptr;
+
+  char path[PATH_MAX];
+  ssize_t length = readlink(("/proc/self/fd/" + std::to_string(fd)).c_str(), path, sizeof(path) - 1);
+  close(fd);
+  if (length <= 0) return nullptr;
+
+  if (_directories.size() >= MAX_CACHED_DIRS) _directories.clear();
+  std::string dir_path(path, length);
+  bool excluded = isExcluded(dir_path);
+  return &_directories.emplace(std::move(key), Directory{std::move(dir_path), excluded}).first->second;
+}
+
+/**
+ * Checks if a directory is outside of the root, or if it or one of its ancestors below the root is ignored.
+ * @param path The absolute path of the directory.
+ * @return True if the events of the directory are not reported.
+ */
+bool FanotifyWatcher::isExcluded(const std::string& path) const
+{
+  const std::string& root = _root.native();
+  if (path.compare(0, root.size(), root) != 0) return true;
+  if (path.size() > root.size() && path[root.size()] != '/' && root != "/") return true;
+  if (_ignore.empty()) return false;
+
+  /* Check every component below the root, the way the inotify backend skips ignored subtrees */
+  size_t pos = root.size();
+  while (pos < path.size())
+  {
+    if (path[pos] == '/')
+    {
+      pos++;
+      continue;
+    }
+
+    size_t next = path.find('/', pos);
+    if (next == std::string::npos) next = path.size();
+    if (_ignore.matches(std::string_view(path).substr(0, pos), std::string_view(path).substr(pos, next - pos), true))
+      return true;
+    pos = next;
+  }
+
+  return false;
+}
+
+/**
+ * Adds an event to the batch of the current read, or logs it if no handler is set.
+ * @param type What happened.
+ * @param is_dir Whether the event is about a directory.
+ * @param path The path the event is about; the new path of a move.
+ * @param old_path The previous path of a move.
+ */
+void FanotifyWatcher::emit(
+    EventType type, bool is_dir, const std::filesystem::path& path, const std::filesystem::path& old_path)
+{
+  if (_handler)
+    _batch.add(type, is_dir, path.native(), old_path.native(), 0, _read_time);
+  else
+    logEvent(_logger, Event{type, is_dir, path, old_path, 0, _read_time});
+}
+
+}  // namespace inotify
@@ -1,5 +1,7 @@
 #include "include/FileEvent.hpp"
 
+#include <cstring>
+
 namespace inotify {
 
 FileEvent::FileEvent(const inotify_event* const event)
@@ -7,6 +9,58 @@ FileEvent::FileEvent(const inotify_event* const event)
 {
 }
 
+FileEvent::FileEvent(const FileEventView& event)
+  : wd(event.wd), mask(event.mask), cookie(event.cookie), filename(event.filename)
+{
+}
+
 FileEvent::~FileEvent() {}
 
+/**
+ * Decodes the next event record and advances past it.
+ * @param event The view to fill in.
+ * @return True if an event was decoded, false if the buffer is exhausted.
+ */
+bool FileEventReader::next(FileEventView& event)
+{
+  size_t record_len;
+  if (_offset >= _length || !decode(_buffer + _offset, _length - _offset, event, record_len)) return false;
+
+  _offset += record_len;
+  return true;
+}
+
+/**
+ * Decodes the next event record without advancing past it.
+ * @param event The view to fill in.
+ * @return True if an event was decoded, false if the buffer is exhausted.
+ */
+bool FileEventReader::peek(FileEventView& event) const
+{
+  size_t record_len;
+  return _offset < _length && decode(_buffer + _offset, _length - _offset, event, record_len);
+}
+
+/**
+ * Decodes a single inotify_event record. The name is padded with null bytes by the kernel, so its length is bounded by
+ * the record length.
+ * @return False if the record is truncated.
+ */
+bool FileEventReader::decode(const uint8_t* record, size_t available, FileEventView& event, size_t& record_len)
+{
+  if (available < sizeof(inotify_event)) return false;
+
+  inotify_event header;
+  std::memcpy(&header, record, sizeof(header));
+  record_len = sizeof(inotify_event) + header.len;
+  if (record_len > available) return false;
+
+  const char* name = reinterpret_cast<const char*>(record + sizeof(inotify_event));
+  event.wd = header.wd;
+  event.mask = header.mask;
+  event.cookie = header.cookie;
+  event.filename = std::string_view(name, strnlen(name, header.len));
+  return true;
+}
+
 }  // namespace inotify
@@ -0,0 +1,272 @@
+#include "include/IgnoreMatcher.hpp"
+
+#include <algorithm>
+
+namespace inotify {
+
+/**
+ * Compiles a list of ignore patterns.
+ * @param patterns The patterns; empty ones and comments starting with '#' are skipped.
+ * @param root The root directory that anchored patterns are relative to.
+ */
+IgnoreMatcher::IgnoreMatcher(const std::vector<std::string>& patterns, const std::filesystem::path& root)
+  : IgnoreMatcher(patterns, std::vector<std::filesystem::path>{root})
+{
+}
+
+/**
+ * Compiles the ignore patterns for a watcher of several roots.
+ * @param patterns The patterns to compile.
+ * @param roots The root directories that anchored patterns are relative to; they must not be nested.
+ */
+IgnoreMatcher::IgnoreMatcher(const std::vector<std::string>& patterns, const std::vector<std::filesystem::path>& roots)
+{
+  for (const auto& root : roots)
+  {
+    std::string& anchor = _roots.emplace_back(root.native());
+    while (anchor.size() > 1 && anchor.back() == '/') anchor.pop_back();
+  }
+  for (const auto& pattern : patterns) add(pattern);
+}
+
+/**
+ * Checks if an entry of a directory is ignored.
+ * @param parent The absolute path of the directory that contains the entry.
+ * @param name The name of the entry.
+ * @param is_dir Whether the entry is a directory.
+ * @return True if a pattern matches the entry.
+ */
+bool IgnoreMatcher::matches(std::string_view parent, std::string_view name, bool is_dir) const
+{
+  if (_pattern_cnt == 0) return false;
+  if (matchesName(name, is_dir)) return true;
+  if (_paths.empty() && _dir_paths.empty() && _path_globs.empty()) return false;
+
+  /* Anchored patterns only apply inside of a root */
+  auto root = std::find_if(_roots.begin(), _roots.end(), [parent](const std::string& root) {
+    return parent.compare(0, root.size(), root) == 0 &&
+           (parent.size() == root.size() || parent[root.size()] == '/' || root.back() == '/');
+  });
+  if (root == _roots.end()) return false;
+  parent.remove_prefix(root->size());
+  while (!parent.empty() && parent.front() == '/') parent.remove_prefix(1);
+  while (!parent.empty() && parent.back() == '/') parent.remove_suffix(1);
+
+  std::string relative;
+  relative.reserve(parent.size() + 1 + name.size());
+  relative.append(parent);
+  if (!relative.empty()) relative.push_back('/');
+  relative.append(name);
+  return matchesRelative(relative, is_dir);
+}
+
+/**
+ * Checks if an absolute path is ignored.
+ * @param path The absolute path of the entry.
+ * @param is_dir Whether the entry is a directory.
+ * @return True if a pattern matches the entry.
+ */
+bool IgnoreMatcher::matches(const std::filesystem::path& path, bool is_dir) const
+{
+  return matches(std::string_view(path.native()), is_dir);
+}
+
+/**
+ * Checks if an absolute path is ignored.
+ * @param path The absolute path of the entry.
+ * @param is_dir Whether the entry is a directory.
+ * @return True if a pattern matches the entry.
+ */
+bool IgnoreMatcher::matches(std::string_view path, bool is_dir) const
+{
+  if (_pattern_cnt == 0) return false;
+
+  std::string_view native = path;
+  while (native.size() > 1 && native.back() == '/') native.remove_suffix(1);
+  size_t slash = native.rfind('/');
+  if (slash == std::string_view::npos) return matches(std::string_view(), native, is_dir);
+  return matches(native.substr(0, slash), native.substr(slash + 1), is_dir);
+}
+
+/**
+ * Compiles a single pattern and files it under the matching set.
+ * @param pattern The pattern to add.
+ */
+void IgnoreMatcher::add(std::string_view pattern)
+{
+  if (pattern.empty() || pattern.front() == '#') return;
+
+  bool dir_only = false;
+  while (pattern.size() > 1 && pattern.back() == '/')
+  {
+    dir_only = true;
+    pattern.remove_suffix(1);
+  }
+
+  /* A slash anywhere but at the end anchors the pattern to the root */
+  const bool anchored = pattern.find('/') != std::string_view::npos;
+  while (!pattern.empty() && pattern.front() == '/') pattern.remove_prefix(1);
+  if (pattern.empty()) return;
+
+  if (pattern.find_first_of("*?[") == std::string_view::npos)
+  {
+    std::string_view literal = _literals.emplace_back(pattern);
+    if (anchored)
+      (dir_only ? _dir_paths : _paths).insert(literal);
+    else
+      (dir_only ? _dir_names : _names).insert(literal);
+  }
+  else
+  {
+    (anchored ? _path_globs : _name_globs).push_back(compile(pattern, dir_only));
+  }
+  _pattern_cnt++;
+}
+
+bool IgnoreMatcher::matchesName(std::string_view name, bool is_dir) const
+{
+  if (_names.count(name) || (is_dir && _dir_names.count(name))) return true;
+  for (const auto& glob : _name_globs)
+  {
+    if ((is_dir || !glob.dir_only) && match(glob.tokens, 0, name)) return true;
+  }
+  return false;
+}
+
+bool IgnoreMatcher::matchesRelative(std::string_view relative, bool is_dir) const
+{
+  if (_paths.count(relative) || (is_dir && _dir_paths.count(relative))) return true;
+  for (const auto& glob : _path_globs)
+  {
+    if ((is_dir || !glob.dir_only) && match(glob.tokens, 0, relative)) return true;
+  }
+  return false;
+}
+
+/**
+ * Compiles a glob into a sequence of tokens. Consecutive plain characters become a single literal token.
+ * @param pattern The glob, without a trailing slash.
+ * @param dir_only Whether the glob only applies to directories.
+ * @return The compiled glob.
+ */
+IgnoreMatcher::Glob IgnoreMatcher::compile(std::string_view pattern, bool dir_only)
+{
+  Glob glob{{}, dir_only};
+  auto literal = [&glob]() -> std::string& {
+    if (glob.tokens.empty() || glob.tokens.back().kind != Token::Literal)
+      glob.tokens.push_back(Token{Token::Literal, {}, {}});
+    return glob.tokens.back().literal;
+  };
+
+  for (size_t i = 0; i < pattern.size(); ++i)
+  {
+    const char c = pattern[i];
+    if (c == '*')
+    {
+      if (i + 1 < pattern.size() && pattern[i + 1] == '*')
+      {
+        /* "**" matches across components; followed by a slash it matches zero or more whole components */
+        Token token{Token::GlobStar, {}, {}};
+        i++;
+        if (i + 1 < pattern.size() && pattern[i + 1] == '/')
+        {
+          token.literal = "/";
+          i++;
+        }
+        glob.tokens.push_back(std::move(token));
+      }
+      else if (glob.tokens.empty() || glob.tokens.back().kind != Token::Star)
+      {
+        glob.tokens.push_back(Token{Token::Star, {}, {}});
+      }
+    }
+    else if (c == '?')
+    {
+      glob.tokens.push_back(Token{Token::AnyChar, {}, {}});
+    }
+    else if (c == '[' && pattern.find(']', i + 2) != std::string_view::npos)
+    {
+      Token token{Token::Class, {}, {}};
+      size_t j = i + 1;
+      const bool negated = pattern[j] == '!' || pattern[j] == '^';
+      if (negated) j++;
+
+      /* A ']' right after the opening bracket is a member of the class */
+      for (bool first = true; j < pattern.size() && (first || pattern[j] != ']'); first = false)
+      {
+        unsigned char from = pattern[j];
+        unsigned char to = from;
+        if (j + 2 < pattern.size() && pattern[j + 1] == '-' && pattern[j + 2] != ']')
+        {
+          to = pattern[j + 2];
+          j += 2;
+        }
+        for (unsigned ch = from; ch <= to; ++ch) token.chars.set(ch);
+        j++;
+      }
+
+      if (negated) token.chars.flip();
+      token.chars.reset('/');
+      glob.tokens.push_back(std::move(token));
+      i = j;
+    }
+    else if (c == '\\' && i + 1 < pattern.size())
+    {
+      literal().push_back(pattern[++i]);
+    }
+    else
+    {
+      literal().push_back(c);
+    }
+  }
+
+  return glob;
+}
+
+/**
+ * Matches the tokens of a glob against a text, backtracking only at wildcards.
+ * @param tokens The compiled glob.
+ * @param token The index of the first token to match.
+ * @param text The remaining text.
+ * @return True if the tokens match the whole text.
+ */
+bool IgnoreMatcher::match(const std::vector<Token>& tokens, size_t token, std::string_view text)
+{
+  for (; token < tokens.size(); ++token)
+  {
+    const Token& current = tokens[token];
+    switch (current.kind)
+    {
+      case Token::Literal:
+        if (text.compare(0, current.literal.size(), current.literal) != 0) return false;
+        text.remove_prefix(current.literal.size());
+        break;
+      case Token::AnyChar:
+        if (text.empty() || text.front() == '/') return false;
+        text.remove_prefix(1);
+        break;
+      case Token::Class:
+        if (text.empty() || !current.chars.test(static_cast<unsigned char>(text.front()))) return false;
+        text.remove_prefix(1);
+        break;
+      case Token::Star:
+      case Token::GlobStar:
+        /* A trailing star matches the rest, unless it would have to cross a component */
+        if (token + 1 == tokens.size())
+          return current.kind == Token::GlobStar || text.find('/') == std::string_view::npos;
+
+        for (size_t skip = 0; skip <= text.size(); ++skip)
+        {
+          /* A globstar followed by a slash only ends at the start of a component */
+          const bool boundary = current.literal.empty() || skip == 0 || text[skip - 1] == '/';
+          if (boundary && match(tokens, token + 1, text.substr(skip))) return true;
+          if (skip < text.size() && text[skip] == '/' && current.kind == Token::Star) return false;
+        }
+        return false;
+    }
+  }
+
+  return text.empty();
+}
+
+}  // namespace inotify
@@ -1,83 +1,255 @@
 
 #include "include/Inotify.hpp"
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cerrno>
 #include <cstring>
 #include <stack>
+#include <utility>
+#include <unordered_map>
 
+#include "include/DirectoryCrawler.hpp"
 #include "include/FileEvent.hpp"
 #include "include/InotifyError.hpp"
+#include "include/Snapshot.hpp"
 
 namespace inotify {
 
+namespace {
+
+/* The path of a root without trailing slashes, for comparing roots */
+std::string_view rootKey(std::string_view path)
+{
+  while (path.size() > 1 && path.back() == '/') path.remove_suffix(1);
+  return path;
+}
+
+/* How many levels a path is below a directory that contains it, 0 for the directory itself */
+int depthBelow(std::string_view dir, std::string_view path)
+{
+  dir = rootKey(dir);
+  if (dir == "/") dir = {};
+  if (path.size() <= dir.size()) return 0;
+  const std::string_view rest = rootKey(path.substr(dir.size()));
+  return int(std::count(rest.begin(), rest.end(), '/'));
+}
+
+}  // namespace
+
 /**
  * Constructor for initializing the Inotify watcher with a root path and a list of directories to ignore.
+ * The watcher runs its own event loop.
  * @param path The root directory to monitor for file system changes.
- * @param ignored_dirs List of directory names to be excluded from monitoring.
+ * @param ignored_dirs Ignore patterns for the entries to be excluded from monitoring.
+ * @param options Tunables of the instance.
  * @throws std::invalid_argument if the root directory could not be watched.
  */
-Inotify::Inotify(const std::filesystem::path &path, const std::vector<std::string> &ignored)
-  : _root(path), _ignored_dirs(ignored), _logger{}
+Inotify::Inotify(
+    const std::filesystem::path &path, const std::vector<std::string> &ignored, const InotifyOptions &options)
+  : Inotify(std::vector<std::filesystem::path>{path}, ignored, options, std::make_unique<Reactor>(), nullptr)
 {
-  initialize();
-  int dir_watch_cnt = watchDirectory(path);
-  if (dir_watch_cnt == -1)
-    throw InotifyError("Failed to watch root directory " + path.string());
-  else if (dir_watch_cnt == 0)
-    throw std::invalid_argument("Root directory is in the ignored list: " + path.string());
 }
 
 /**
- * Destructor that cleans up resources related to inotify and epoll file descriptors.
+ * Constructor for a watcher that is dispatched by a shared event loop.
+ * @param path The root directory to monitor for file system changes.
+ * @param ignored_dirs Ignore patterns for the entries to be excluded from monitoring.
+ * @param options Tunables of the instance.
+ * @param reactor The event loop; it has to outlive the watcher.
+ * @throws std::invalid_argument if the root directory could not be watched.
  */
-Inotify::~Inotify() { terminate(); }
+Inotify::Inotify(const std::filesystem::path &path,
+    const std::vector<std::string> &ignored,
+    const InotifyOptions &options,
+    Reactor &reactor)
+  : Inotify(std::vector<std::filesystem::path>{path}, ignored, options, nullptr, &reactor)
+{
+}
 
 /**
- * Initializes the inotify instance and sets up epoll for handling events.
+ * Constructor for a watcher of several independent trees, which share the inotify fd, the cache, the read buffer and
+ * the event loop. Every root is handled on its own: when one is deleted or moved only that root is unwatched.
+ * @param roots The root directories to monitor; they must not be nested in each other.
+ * @param ignored_dirs Ignore patterns for the entries to be excluded from monitoring, anchored to every root.
+ * @param options Tunables of the instance; mask rules apply to the subtrees of every root.
+ * @throws std::invalid_argument if there is no root, the roots are nested or a root could not be watched.
  */
-void Inotify::initialize()
+Inotify::Inotify(const std::vector<std::filesystem::path> &roots,
+    const std::vector<std::string> &ignored,
+    const InotifyOptions &options)
+  : Inotify(roots, ignored, options, std::make_unique<Reactor>(), nullptr)
 {
-  /* Initialize the inotify instance */
-  _inotify_fd = inotify_init();
-  if (_inotify_fd < 0) throw InotifyError("Failed to initialize inotify");
+}
+
+/**
+ * Constructor for a watcher of several trees that is dispatched by a shared event loop.
+ * @param roots The root directories to monitor; they must not be nested in each other.
+ * @param ignored_dirs Ignore patterns for the entries to be excluded from monitoring, anchored to every root.
+ * @param options Tunables of the instance.
+ * @param reactor The event loop; it has to outlive the watcher.
+ * @throws std::invalid_argument if there is no root, the roots are nested or a root could not be watched.
+ */
+Inotify::Inotify(const std::vector<std::filesystem::path> &roots,
+    const std::vector<std::string> &ignored,
+    const InotifyOptions &options,
+    Reactor &reactor)
+  : Inotify(roots, ignored, options, nullptr, &reactor)
+{
+}
+
+Inotify::Inotify(const std::vector<std::filesystem::path> &roots,
+    const std::vector<std::string> &ignored,
+    const InotifyOptions &options,
+    std::unique_ptr<Reactor> own_reactor,
+    Reactor *reactor)
+  : _ignore_patterns(ignored)
+  , _options(options)
+  , _own_reactor(std::move(own_reactor))
+  , _reactor(reactor != nullptr ? reactor : _own_reactor.get())
+  , _event_buffer(EVENT_BUFFER_MIN, EVENT_BUFFER_MAX)
+  , _stopped(false)
+  , _handler(nullptr)
+  , _control(nullptr)
+  , _move_timer(-1)
+  , _coalesce_timer(-1)
+  , _reader_stopped(true)
+  , _reader_blocked(false)
+  , _ring_fd(-1)
+  , _space_fd(-1)
+  , _ring_generation(0)
+  , _reader_stalls(0)
+  , _source(nullptr)
+  , _record_fd(-1)
+  , _warm_start(false)
+  , _logger{options.log_mode, options.log_fd}
+{
+  if (roots.empty()) throw std::invalid_argument("No root directory to watch");
+  for (const auto &root : roots)
+  {
+    const std::string error = checkRoot(root);
+    if (!error.empty()) throw std::invalid_argument(error + ": " + root.string());
+    _roots.push_back(root);
+    addMaskRules(root);
+  }
+  _ignore = IgnoreMatcher(_ignore_patterns, _roots);
+
+  if (_options.coalesce_window.count() > 0) _coalescer = std::make_unique<Coalescer>(_options.coalesce_window);
+  if (_options.verify_threads > 0)
+  {
+    /* Verdicts are applied on the loop thread, like the other events */
+    _verifier = std::make_unique<ContentVerifier>(
+        _options.verify_threads, [this] { _reactor->post([this] { completeVerifications(false); }); });
+  }
+
+  if (!_options.record_file.empty())
+  {
+    _record_fd = open(_options.record_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (_record_fd == -1) throw InotifyError("Failed to create the recording " + _options.record_file.string());
+  }
 
-  /* Initialize the event file descriptor for interrupting */
-  _event_fd = eventfd(0, EFD_NONBLOCK);
-  if (_event_fd < 0) throw InotifyError("Failed to initialize event file descriptor");
+  if (_options.pipeline_slots > 0)
+  {
+    /* The reader thread signals published buffers through _ring_fd, the reactor processes them */
+    _ring = std::make_unique<EventRing>(_options.pipeline_slots, EVENT_BUFFER_LEN);
+    _ring_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    _space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_ring_fd == -1 || _space_fd == -1) throw InotifyError("Failed to create the pipeline eventfds");
+    _reactor->add(_ring_fd, EPOLLIN, [this](uint32_t) { consumeRing(); });
+  }
+
+  if (_options.io_uring)
+  {
+    /* The ring takes over the waiting; the reactor only runs when its epoll fd, polled through the ring, is ready */
+    if (_ring)
+      _logger.logEvent("io_uring can't be combined with pipelining, reading with epoll");
+    else if (!_own_reactor)
+      _logger.logEvent("io_uring needs a watcher with its own event loop, reading with epoll");
+    else if (!UringReader::supported())
+      _logger.logEvent("io_uring is not available, reading with epoll");
+    else
+    {
+      /* The buffer is registered once, so it can't adapt; it is as large as the adaptive one gets, and a read takes
+         everything that is queued up to that, like a fitted read does */
+      _uring = std::make_unique<UringReader>(EVENT_BUFFER_MAX, _reactor->fd());
+      _metrics.read_buffer_bytes.set(_uring->size());
+    }
+  }
 
-  /* Initialize the epoll instance */
-  _epoll_fd = epoll_create1(0);
-  if (_epoll_fd < 0) throw InotifyError("Failed to initialize epoll instance");
+  initialize();
 
-  /* Register inotify file descriptor with epoll */
-  _inotify_epoll_event.events = EPOLLIN;
-  _inotify_epoll_event.data.fd = _inotify_fd;
+  /* Restart from the snapshot of the last run if there is a usable one, otherwise crawl the whole tree; roots that
+   * are not in the snapshot are crawled either way */
+  int dir_watch_cnt = _options.snapshot_file.empty() ? -1 : watchFromSnapshot();
+  _warm_start = dir_watch_cnt > 0;
+  for (const auto &root : _roots)
+  {
+    if (_wd_cache.find(root) != -1) continue;
+    dir_watch_cnt = watchRoot(root);
+    if (dir_watch_cnt == -1)
+      throw InotifyError("Failed to watch root directory " + root.string());
+    else if (dir_watch_cnt == 0)
+      throw std::invalid_argument("Root directory is in the ignored list: " + root.string());
+  }
+  _metrics.watches.set(_wd_cache.size());
+}
 
-  if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _inotify_fd, &_inotify_epoll_event) == -1)
-    throw InotifyError("Failed to add inotify file descriptor to epoll");
+/**
+ * Destructor that cleans up resources related to the inotify file descriptor.
+ */
+Inotify::~Inotify()
+{
+  if (_control) _control->detach();
+  stopReader();
+  terminate();
+  if (_ring)
+  {
+    _reactor->remove(_ring_fd);
+    close(_ring_fd);
+    close(_space_fd);
+  }
+  if (_record_fd != -1) close(_record_fd);
+}
 
-  /* Register event file descriptor with epoll for interrupts */
-  _stop_epoll_event.events = EPOLLIN;
-  _stop_epoll_event.data.fd = _event_fd;
+/**
+ * Initializes the non-blocking inotify instance and registers it with the reactor.
+ */
+void Inotify::initialize()
+{
+  /* Initialize the inotify instance */
+  _inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (_inotify_fd < 0) throw InotifyError("Failed to initialize inotify");
 
-  if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, _event_fd, &_stop_epoll_event) == -1)
-    throw InotifyError("Failed to add event file descriptor to epoll");
+  /* Drain the inotify file descriptor whenever it becomes readable, unless the reader thread or the ring does */
+  if (_uring)
+    _uring->setFd(_inotify_fd);
+  else if (!_ring)
+    _reactor->add(_inotify_fd, EPOLLIN, [this](uint32_t) { drainEvents(); });
 }
 
 /**
- * Gracefully terminates the inotify instance, closing all file descriptors.
+ * Gracefully terminates the inotify instance, closing its file descriptor.
  */
 void Inotify::terminate() noexcept
 {
-  epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, _inotify_fd, 0);
-  epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, _event_fd, 0);
+  if (_coalesce_timer != -1) _reactor->cancelTimer(_coalesce_timer);
+  if (_move_timer != -1) _reactor->cancelTimer(_move_timer);
+  _coalesce_timer = -1;
+  _move_timer = -1;
+  if (_uring)
+    _uring->setFd(-1); /* Waits for the read in flight, so it doesn't read from a reused fd */
+  else if (!_ring)
+    _reactor->remove(_inotify_fd);
   close(_inotify_fd);
-  close(_epoll_fd);
-  close(_event_fd);
 }
 
 /**
@@ -86,78 +258,326 @@ void Inotify::terminate() noexcept
 void Inotify::run()
 {
   _stopped = false;
+  if (_warm_start)
+  {
+    /* Now that the consumer is in place, tell it what changed while the watcher was not running */
+    _warm_start = false;
+    reportSnapshotChanges();
+  }
+
+  if (_ring) startReader();
   while (!_stopped)
   {
     runOnce();
   }
+  stopReader();
+
+  /* Don't lose the events that are still held back */
+  expireMoves(true);
+  if (_coalescer) flushCoalesced(true);
+  if (_verifier) completeVerifications(true);
+  deliverBatch();
+  if (!_options.snapshot_file.empty()) saveSnapshot();
+
+  if (_ring)
+  {
+    PipelineStats stats = pipelineStats();
+    _logger.logEvent("Pipeline: %lu buffers (%lu bytes) read, max. %zu of %zu buffers queued, reader stalled %lu times",
+        stats.buffers,
+        stats.bytes,
+        stats.max_occupancy,
+        stats.capacity,
+        stats.stalls);
+  }
+
+  if (_reader_error) std::rethrow_exception(std::exchange(_reader_error, nullptr));
+}
+
+/**
+ * Processes a stream of events instead of the events of the inotify fd, on the calling thread and as fast as they can
+ * be processed; the kernel queue is not read in the meantime. The events are handled exactly like those of the kernel,
+ * against the watches of the crawl, and the held back ones are delivered before it returns. Must not be called while
+ * run() is running.
+ * @param source The events, e.g. a recording or a synthetic stream.
+ * @throws InotifyError if a recovery of the cache fails.
+ */
+void Inotify::replay(EventSource &source)
+{
+  _stopped = false;
+  _source = &source;
+  try
+  {
+    while (!_stopped && source.pending() > 0) drainEvents();
+  } catch (...)
+  {
+    _source = nullptr;
+    throw;
+  }
+  _source = nullptr;
+
+  expireMoves(true);
+  if (_coalescer) flushCoalesced(true);
+  if (_verifier) completeVerifications(true);
+  deliverBatch();
 }
 
 /**
- * Stops the inotify watcher by setting the _stopped flag and writing a signal to the eventfd.
+ * Stops the inotify watcher by setting the _stopped flag and waking up the reactor.
  */
 void Inotify::stop()
 {
   _stopped = true;
+  if (_ring) eventfd_write(_space_fd, 1); /* Interrupt the reader thread */
+  if (_uring) _uring->wakeup();           /* Interrupt the io_uring_enter call */
 
-  /* Write a signal to the eventfd to interrupt the epoll_wait call */
-  uint64_t buffer = 1;
-  write(_event_fd, &buffer, sizeof(buffer));
+  /* Interrupt the epoll_wait call */
+  _reactor->wakeup();
 }
 
 /**
- * When the cache is in an unrecoverable state, reinitialize the current inotify and epoll descriptors
- * and rebuild the cache by watching the given root directory and its subdirectories. Also clears the event queue and
- * event buffer.
- * @throws InotifyError if the inotify and epoll instances could not be reinitialized, or if the root directory could
- * not be watched.
+ * When the cache is in an unrecoverable state, reinitialize the current inotify descriptor
+ * and rebuild the cache by watching the root directories and their subdirectories. Also clears the event queue and
+ * event buffer. Roots that can no longer be watched are dropped.
+ * @throws InotifyError if the inotify instance could not be reinitialized, or if none of the root directories could
+ * be watched.
  */
 void Inotify::reinitialize()
 {
   _logger.logEvent("Cache reached inconsistent state; Reinitializing...");
-  /* Removes the watch descriptors and clears all entries from the cache */
-  for (auto it = _wd_cache.begin(); it != _wd_cache.end();)
+  const auto started = std::chrono::steady_clock::now();
+  /* The reader thread reads from the inotify fd that is replaced, and the queued buffers refer to its watches */
+  const bool pipelined = _reader.joinable();
+  stopReader();
+  if (_ring)
   {
-    inotify_rm_watch(_inotify_fd, it->first);
-    it = _wd_cache.erase(it);
+    _ring->clear();
+    _ring_generation++;
   }
 
+  /* Removes the watch descriptors and clears all entries from the cache */
+  for (int wd : _wd_cache.descriptors()) inotify_rm_watch(_inotify_fd, wd);
+  _wd_cache.clear();
+  _unexpanded.clear();
+  _watched_ahead.clear();
+  _pending_moves.clear(); /* The new watches cover wherever the moved entries went */
+
   terminate();
   initialize();
-  if (watchDirectory(_root) <= 0)
+  for (const auto &root : std::vector<std::filesystem::path>(_roots))
+  {
+    if (watchRoot(root) <= 0) dropRoot(root); /* Also unwatches what was crawled of it */
+  }
+  if (_roots.empty())
   {
     _logger.logEvent("Failed to reinitialize inotify instance");
     throw InotifyError("Failed to reinitialize inotify instance");
   }
 
-  std::queue<FileEvent> empty;
-  std::swap(_event_queue, empty); /* Clear the event queue */
-  _event_buffer.fill(0);          /* Clear the event buffer */
+  _event_reader = FileEventReader(); /* Drop the undecoded events */
+  if (pipelined) startReader();
+
+  _metrics.reinitializations.add();
+  _metrics.reinitialize_us.record(
+      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count());
+  _metrics.watches.set(_wd_cache.size());
   _logger.logEvent("Cache reached inconsistent state; Success.");
 }
 
 /**
- * Checks if a specified directory is in the ignored directories list.
- * @param path The directory path to check.
- * @return True if the path is in the ignored list, false otherwise.
+ * Repairs the cache after the kernel event queue overflowed, using the recovery strategy of the options.
+ * Falls back to a full reinitialization if the rescan could not repair the cache.
  */
-bool Inotify::isIgnored(const std::string &path_name) const
+void Inotify::recoverOverflow()
 {
-  for (const auto &ignored : _ignored_dirs)
+  if (_options.overflow_recovery == OverflowRecovery::Reinitialize)
   {
-    if (path_name == ignored) return true;
+    reinitialize();
+    return;
   }
 
-  return false;
+  _logger.logEvent("Rescanning changed directories...");
+  int rescan_cnt = rescanDirectories();
+  if (rescan_cnt == -1)
+    reinitialize();
+  else
+    _logger.logEvent("Rescanned %d changed directories", rescan_cnt);
+}
+
+/**
+ * Compares the recorded inode and modification time of every cached directory against the filesystem. Directories
+ * that changed are listed again: subdirectories that disappeared are zapped and reported as deleted, new ones are
+ * watched and reported as created, and the directory itself is reported as changed so that consumers can rescan its
+ * files. The inotify instance and all other watches are kept.
+ * @return The number of directories that were rescanned, or -1 if the cache could not be repaired.
+ */
+int Inotify::rescanDirectories()
+{
+  int rescan_cnt = 0;
+  for (int wd : _wd_cache.descriptors())
+  {
+    if (!_wd_cache.contains(wd)) continue; /* Removed while rescanning its parent */
+
+    const std::filesystem::path dir_path = _wd_cache.path(wd);
+    const WatchCache::Node &node = _wd_cache.node(wd);
+    struct stat st;
+    if (stat(dir_path.c_str(), &st) == -1 || st.st_ino != node.inode)
+    {
+      /* The directory itself is gone or replaced; its parent reports it, unless it is the root */
+      if (node.parent == -1) return -1;
+      continue;
+    }
+
+    int64_t mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    if (mtime == node.mtime) continue;
+
+    _wd_cache.setStat(wd, st.st_ino, mtime);
+    rescan_cnt++;
+    emit(EventType::Rescan, true, dir_path.native());
+
+    /* None of its subdirectories were watched, so there is nothing to compare; the rescan covers them */
+    if (_unexpanded.count(wd))
+    {
+      expandDirectory(wd);
+      continue;
+    }
+
+    /* Index the cached subdirectories by name; whatever is left after the listing no longer exists */
+    std::unordered_map<std::string, int> cached;
+    for (int child : _wd_cache.children(wd)) cached.emplace(_wd_cache.name(child), child);
+
+    DIR *dir = opendir(dir_path.c_str());
+    if (dir == nullptr) continue;
+
+    std::vector<std::filesystem::path> created;
+    while (dirent *entry = readdir(dir))
+    {
+      const std::string name = entry->d_name;
+      if (name == "." || name == "..") continue;
+
+      bool is_dir = entry->d_type == DT_DIR;
+      if (entry->d_type == DT_UNKNOWN)
+      {
+        struct stat entry_st;
+        is_dir = fstatat(dirfd(dir), entry->d_name, &entry_st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(entry_st.st_mode);
+      }
+      if (!is_dir || isForeign(wd, name, true) || isIgnored(dir_path / name, true)) continue;
+
+      /* A directory with the same name but another inode was replaced while the events were lost */
+      auto it = cached.find(name);
+      if (it != cached.end() && _wd_cache.node(it->second).inode == entry->d_ino)
+        cached.erase(it);
+      else
+        created.push_back(dir_path / name);
+    }
+    closedir(dir);
+
+    for (const auto &[name, child] : cached)
+    {
+      emit(EventType::Delete, true, (dir_path / name).native());
+      /* The kernel may already have dropped the watches, so failures to remove them are expected */
+      for (int child_wd : _wd_cache.subtree(child))
+      {
+        inotify_rm_watch(_inotify_fd, child_wd);
+        _wd_cache.erase(child_wd);
+      }
+    }
+
+    for (const auto &path : created)
+    {
+      emit(EventType::Create, true, path.native());
+      if (watchDirectory(path, lazyDepth(path)) == -1) return -1;
+    }
+  }
+
+  return rescan_cnt;
+}
+
+/**
+ * Checks if a path matches the ignore patterns.
+ * @param path The absolute path to check.
+ * @param is_dir Whether the path is a directory.
+ * @return True if the path is ignored, false otherwise.
+ */
+bool Inotify::isIgnored(const std::filesystem::path &path, bool is_dir) const { return _ignore.matches(path, is_dir); }
+
+bool Inotify::isIgnored(std::string_view path, bool is_dir) const { return _ignore.matches(path, is_dir); }
+
+/**
+ * Replaces the ignore patterns without restarting the watcher. The change is applied on the event loop: only the
+ * subtrees that became ignored are unwatched, and only the ones that are no longer ignored are crawled, every other
+ * watch stays in place. No events are reported for the subtrees that come and go.
+ * @param patterns The new ignore patterns; they replace all of the current ones.
+ */
+void Inotify::setIgnorePatterns(const std::vector<std::string> &patterns)
+{
+  _reactor->post([this, patterns] { applyIgnorePatterns(patterns); });
+}
+
+/**
+ * Swaps the ignore rules and brings the watches in line with them.
+ * @param patterns The new ignore patterns.
+ */
+void Inotify::applyIgnorePatterns(const std::vector<std::string> &patterns)
+{
+  _ignore_patterns = patterns;
+  const IgnoreMatcher previous = std::exchange(_ignore, IgnoreMatcher(patterns, _roots));
+  int unwatched_cnt = 0;
+  int watched_cnt = 0;
+
+  /* Unwatch the subtrees that are ignored now; the roots stay watched whatever the rules say */
+  const std::vector<int> roots = _wd_cache.roots();
+  for (int wd : _wd_cache.descriptors())
+  {
+    if (!_wd_cache.contains(wd) || std::find(roots.begin(), roots.end(), wd) != roots.end()) continue;
+    const std::filesystem::path path = _wd_cache.path(wd);
+    if (!isIgnored(path, true)) continue;
+
+    int zap_cnt = zapSubdirectories(path);
+    if (zap_cnt == -1)
+    {
+      /* Cache reached inconsistent state; try to recover */
+      reinitialize();
+      return;
+    }
+    unwatched_cnt += zap_cnt;
+  }
+
+  /* Crawl the subdirectories that were ignored before and are not anymore, which needs a listing of every watched
+   * directory; nothing can have been ignored without previous rules */
+  if (!previous.empty())
+  {
+    for (int wd : _wd_cache.descriptors())
+    {
+      if (!_wd_cache.contains(wd)) continue;
+
+      std::error_code error;
+      for (const auto &entry : std::filesystem::directory_iterator(_wd_cache.path(wd), error))
+      {
+        std::error_code type_error;
+        if (!entry.is_directory(type_error) || !previous.matches(entry.path(), true) || isIgnored(entry.path(), true) ||
+            isForeign(wd, entry.path().filename().native(), true) || _wd_cache.find(entry.path()) != -1)
+          continue;
+
+        int watch_cnt = watchDirectory(entry.path(), lazyDepth(entry.path()));
+        if (watch_cnt > 0) watched_cnt += watch_cnt;
+      }
+    }
+  }
+
+  _metrics.watches.set(_wd_cache.size());
+  _logger.logEvent("Reloaded ignore rules: unwatched %d and watched %d directories", unwatched_cnt, watched_cnt);
 }
 
 /**
  * Adds a directory and all of it's subdirectories to the inotify watch list while doing some sanity checks.
  * @param path The directory path to monitor.
+ * @param depth How many levels below the directory are watched, or -1 for all of them. The directories at the last
+ * level are the edge of the lazily watched tree; their subdirectories are watched once they see activity.
  * @return The number of directories that were added to the watch list, or -1 if the directory could not be watched.
  */
-int Inotify::watchDirectory(const std::filesystem::path &path)
+int Inotify::watchDirectory(const std::filesystem::path &path, int depth)
 {
-  std::stack<std::filesystem::path> dirs;
+  std::stack<std::pair<std::filesystem::path, int>> dirs;
   if (!std::filesystem::is_directory(path))
   {
     _logger.logEvent("Failed to watch directory: %s", path.c_str());
@@ -165,27 +585,36 @@ int Inotify::watchDirectory(const std::filesystem::path &path)
   }
 
   /* Check if the directory is in the ignored list */
-  if (isIgnored(path.filename())) return 0;
+  if (isIgnored(path, true)) return 0;
 
   int dir_cnt = 0;
-  dirs.push(path);
+  dirs.emplace(path, 0);
 
   while (!dirs.empty())
   {
-    std::filesystem::path dir = dirs.top();
+    auto [dir, level] = std::move(dirs.top());
     dirs.pop();
-    if (addWatch(dir) == -1) return -1;
+    int wd = addWatch(dir);
+    if (wd == -1) return -1;
     dir_cnt++;
 
+    if (depth >= 0 && level >= depth)
+    {
+      _unexpanded.insert(wd);
+      continue;
+    }
+    _unexpanded.erase(wd);
+
     /* Using recursive_directory_iterator doesn't allow to properly
      * ignore the directories since it traverses into the subdirectories even if we ignore them
      * So we use directory_iterator and manually push the subdirectories onto the stack
      */
     for (const auto &entry : std::filesystem::directory_iterator(dir))
     {
-      if (entry.is_directory() && !isIgnored(entry.path().filename()))
+      if (entry.is_directory() && !isForeign(wd, entry.path().filename().native(), true) &&
+          !isIgnored(entry.path(), true))
       {
-        dirs.push(entry.path());
+        dirs.emplace(entry.path(), level + 1);
       }
     }
   }
@@ -194,209 +623,992 @@ int Inotify::watchDirectory(const std::filesystem::path &path)
 }
 
 /**
- * Registers a specific directory path with inotify and adds it to the watch descriptor cache.
- * @param path The directory path to add to the inotify watch list.
- * @return The watch descriptor for the directory, or -1 if the watch could not be added.
+ * Adds a directory and all of it's subdirectories to the inotify watch list, enumerating the tree with a pool of
+ * crawler threads. The watches are still added from the calling thread, parents before children.
+ * @param path The directory path to monitor.
+ * @param depth How many levels below the directory are watched, or -1 for all of them, as for watchDirectory().
+ * @return The number of directories that were added to the watch list, or -1 if the directory could not be watched.
  */
-int Inotify::addWatch(const std::filesystem::path &path)
+int Inotify::watchDirectoryParallel(const std::filesystem::path &path, int depth)
 {
-  /* Watch for file creation, deletion, and modification events, and don't follow symbolic links */
-  int flags = IN_MODIFY | IN_CREATE | IN_MOVE | IN_DELETE | IN_DONT_FOLLOW;
-  if (_wd_cache.empty())
-  {
-    flags |= IN_DELETE_SELF | IN_MOVE_SELF; /* Watch for the root directory being deleted or moved */
-  }
-
-  int wd = inotify_add_watch(_inotify_fd, path.c_str(), flags);
-  if (wd == -1)
+  if (!std::filesystem::is_directory(path))
   {
-    _logger.logEvent("Failed to add watch for directory: %s", path.c_str());
+    _logger.logEvent("Failed to watch directory: %s", path.c_str());
     return -1;
   }
 
-  _wd_cache.insert(std::make_pair(wd, path));
-  return wd;
+  /* Check if the directory is in the ignored list */
+  if (isIgnored(path, true)) return 0;
+
+  auto filter = [this, &path, depth](const std::filesystem::path &parent, const std::string &name) {
+    if (depth >= 0 && depthBelow(path.native(), parent.native()) >= depth) return true;
+    /* Only the subdirectories of the root are distributed between shards */
+    if (_options.shard_count > 1 && parent == path && shardOf(name, _options.shard_count) != _options.shard_index)
+      return true;
+    return _ignore.matches(parent.native(), name, true);
+  };
+  DirectoryCrawler crawler(_options.crawl_threads, filter);
+  auto stats = crawler.crawl(
+      path,
+      [this, &path, depth](const std::filesystem::path &dir) {
+        int wd = addWatch(dir);
+        if (wd != -1 && depth >= 0 && depthBelow(path.native(), dir.native()) >= depth) _unexpanded.insert(wd);
+        return wd != -1;
+      },
+      [this, &path](size_t dir_cnt) {
+        _logger.logEvent("Crawling %s: %zu directories watched", path.c_str(), dir_cnt);
+      });
+
+  if (stats.aborted) return -1;
+
+  _logger.logEvent("Crawled %s: %zu directories watched in %.3f s",
+      path.c_str(),
+      stats.directories,
+      stats.elapsed.count() / 1e6);
+  return stats.directories;
 }
 
-/* Find the watch descriptor for the given path
- * @param path The path of the directory
- * @return The watch descriptor for the given path, or -1 if the path is not found in the cache
+/**
+ * Watches a root directory using the crawl mode of the options.
+ * @param path The root directory to monitor.
+ * @return The number of directories that were added to the watch list, or -1 if the directory could not be watched.
  */
-int Inotify::findWd(const std::filesystem::path &path)
+int Inotify::watchRoot(const std::filesystem::path &path)
 {
-  for (const auto &[wd, dir] : _wd_cache)
-  {
-    if (dir == path) return wd;
-  }
-
-  return -1;
+  const int depth = _options.lazy_depth;
+  return _options.crawl_threads > 1 ? watchDirectoryParallel(path, depth) : watchDirectory(path, depth);
 }
 
 /**
- * Processes a single iteration of file events, checking for new events and updating as needed.
+ * Watches the subdirectories of a directory at the edge of the lazily watched tree, which becomes the edge in its
+ * place. Called when the directory sees activity: a subtree that is used again is watched level by level, following
+ * the activity. Subdirectories that are watched already, e.g. because they were just created, are kept.
+ * @param wd The watch descriptor of the directory.
+ * @return The number of directories that were added to the watch list.
  */
-void Inotify::runOnce()
+int Inotify::expandDirectory(int wd)
 {
-  while (_event_queue.empty() && !_stopped)
-  {
-    ssize_t length = readEventsIntoBuffer();
-    if (length > 0) readEventsFromBuffer(length);
-  }
+  /* Watch descriptors are not reused by the kernel, so a stale one is simply no longer cached */
+  _unexpanded.erase(wd);
+  if (!_wd_cache.contains(wd)) return 0;
+  _metrics.expansions.add();
 
-  while (!_event_queue.empty() && !_stopped)
+  const std::filesystem::path dir_path = _wd_cache.path(wd);
+  int dir_cnt = 0;
+  std::error_code error;
+  for (const auto &entry : std::filesystem::directory_iterator(dir_path, error))
   {
-    FileEvent event = _event_queue.front();
-    _event_queue.pop();
+    if (!entry.is_directory(error) || isForeign(wd, entry.path().filename().native(), true) ||
+        isIgnored(entry.path(), true) || findWd(entry.path()) != -1)
+      continue;
 
-    /* If the root directory that is watched is deleted or moved, stop watching */
-    if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF))
-    {
-      _stopped = true;
-      _logger.logEvent("Nothing to watch.");
-    }
-    else if (event.mask & IN_Q_OVERFLOW)
-    {
-      /* Some events are lost when the queue overflows,
-       * at which point the best approach is to simply reinitialize the
-       * inotify file descriptor, zap and rebuild the cache  */
-      _logger.logEvent("Queue overflow occurred");
-      reinitialize();
-    }
-    else if (event.mask & IN_ISDIR)
-    {
-      processDirectoryEvent(event);
-    }
-    else
-    {
-      processFileEvent(event);
-    }
+    /* A subdirectory that is gone again is reported by its parent's events */
+    const int watch_cnt = watchDirectory(entry.path(), 0);
+    if (watch_cnt > 0) dir_cnt += watch_cnt;
   }
+  return dir_cnt;
 }
 
 /**
- * Reads inotify events into the event buffer.
- * @return The number of bytes read into the buffer.
- * @throws InotifyError if the events could not be read.
+ * Watches the subtree of a watched directory down to a depth, on the event loop, e.g. before a consumer starts working
+ * in a part of the tree that is only watched lazily. Nothing is reported for what is in the subtree already.
+ * @param path The directory; nothing is done if it is not watched itself.
+ * @param depth How many levels below the directory are watched, or -1 for all of them.
  */
-ssize_t Inotify::readEventsIntoBuffer()
+void Inotify::expand(const std::filesystem::path &path, int depth)
 {
-  int triggered_events = epoll_wait(_epoll_fd, _epoll_events, MAX_EVENTS, -1);
+  _reactor->post([this, path, depth] { expandSubtree(path, depth); });
+}
 
-  if (triggered_events == -1) return 0;
+void Inotify::expandSubtree(const std::filesystem::path &path, int depth)
+{
+  /* Not watched by this instance, e.g. by a shard the subtree is not assigned to */
+  if (findWd(path) == -1) return;
 
-  ssize_t length = 0;
+  const size_t watch_cnt = _wd_cache.size();
+  if (watchDirectory(path, depth) == -1) _logger.logEvent("Failed to expand directory: %s", path.c_str());
+  _metrics.watches.set(_wd_cache.size());
+  _logger.logEvent("Expanded %s: %zu directories watched", path.c_str(), _wd_cache.size() - watch_cnt);
+}
 
-  for (int i = 0; i < triggered_events; ++i)
+/**
+ * Tells how deep a directory that turns up in the tree, e.g. by being moved from an unwatched part of it, is watched.
+ * @param path The path of the directory.
+ * @return The levels below the directory that are watched upfront, or -1 for all of them.
+ */
+int Inotify::lazyDepth(const std::filesystem::path &path) const
+{
+  if (_options.lazy_depth < 0) return -1;
+  for (const auto &root : _roots)
   {
-    /* Check if the event fd was triggered by the stop signal */
-    if (_epoll_events[i].data.fd == _event_fd) break; /* Stop if stop signal received */
-
-    /* Check if the inotify fd was triggered */
-    if (_epoll_events[i].data.fd == _inotify_fd)
-    {
-      length = read(_inotify_fd, _event_buffer.data(), _event_buffer.size()); /* Read events into buffer */
-      if (length == -1) throw InotifyError("Failed to read events from inotify");
-    }
+    const std::string_view key = rootKey(root.native());
+    if (path.native().compare(0, key.size(), key) == 0)
+      return std::max(0, _options.lazy_depth - depthBelow(key, path.native()));
   }
-
-  return length;
+  return 0;
 }
 
 /**
- * Reads inotify events from the event buffer and pushes them onto the event queue.
- * @param length The number of bytes to read from the buffer.
+ * Watches another root directory, next to the ones that are watched already. The root is crawled on the event loop;
+ * no events are reported for what is in it already. A path that can't be watched, or is nested in a root or contains
+ * one, is logged and left out.
+ * @param path The root directory to monitor.
  */
-void Inotify::readEventsFromBuffer(ssize_t length)
+void Inotify::addRoot(const std::filesystem::path &path)
 {
-  uint8_t *event_buffer = _event_buffer.data();
-  ssize_t i = 0;
-  while (i < length)
-  {
-    auto event = reinterpret_cast<inotify_event *>(event_buffer + i);
-
-    /*
-     * In cases when the mask is set to IN_IGNORED, it means that the watch descriptor was removed either explicitly or
-     * implicitly. Since we are manually handling the removal of watch descriptors, we need to ignore these events to
-     * prevent cache inconsistencies.
-     *
-     * So we only push the event onto the queue if the mask does not contain IN_IGNORED.
-     */
-    if (!(event->mask & IN_IGNORED))
-    {
-      _event_queue.push(FileEvent(event));
-    }
+  _reactor->post([this, path] { insertRoot(path); });
+}
 
-    i += EVENT_SIZE + event->len;
-  }
+/**
+ * Stops watching a root directory, on the event loop. The other roots stay watched; the watcher stops when the last
+ * root is removed.
+ * @param path The root directory, as it was added.
+ */
+void Inotify::removeRoot(const std::filesystem::path &path)
+{
+  _reactor->post([this, path] { dropRoot(path); });
 }
 
 /**
- * The directory oldPathPrefix/oldName was renamed to newPathPrefix/newName.
- * Fix up cache entries for old_path_prefix/name and all of its subdirectories to reflect the change.
- * @param old_path_prefix The old path prefix to replace.
- * @param new_path_prefix The new path prefix to replace with.
+ * Adds a root and crawls it.
+ * @param path The root directory to monitor.
  */
-void Inotify::rewriteCachedPaths(const std::string &old_path_prefix, const std::string &new_path_prefix)
+void Inotify::insertRoot(const std::filesystem::path &path)
 {
-  for (auto &[wd, path] : _wd_cache)
+  const std::string error = checkRoot(path);
+  if (!error.empty())
   {
-    const std::string path_str = path.string();
+    _logger.logEvent("Failed to add root %s: %s", path.c_str(), error.c_str());
+    return;
+  }
 
-    /* Check if the path starts with the old path prefix  */
-    if (path_str.rfind(old_path_prefix, 0) == 0)
+  _roots.push_back(path);
+  _ignore = IgnoreMatcher(_ignore_patterns, _roots);
+  addMaskRules(path);
+
+  const int dir_cnt = watchRoot(path);
+  if (dir_cnt <= 0)
+  {
+    _logger.logEvent("Failed to add root %s: %s", path.c_str(), dir_cnt == 0 ? "It is ignored" : "It can't be watched");
+    for (int wd : _wd_cache.subtree(_wd_cache.find(path)))
     {
-      /* Ensure the prefix is followed by a separator or ends there (indicating it's a full directory match) */
-      if (path_str.size() == old_path_prefix.size() ||
-          path_str[old_path_prefix.size()] == std::filesystem::path::preferred_separator)
-      {
-        /* Get the suffix and rewrite the path */
-        std::string old_path_suffix = path_str.substr(old_path_prefix.size());
-        path = new_path_prefix + std::move(old_path_suffix);
-      }
+      inotify_rm_watch(_inotify_fd, wd);
+      _wd_cache.erase(wd);
     }
+    _roots.pop_back();
+    _ignore = IgnoreMatcher(_ignore_patterns, _roots);
+    return;
   }
+
+  _metrics.watches.set(_wd_cache.size());
+  _logger.logEvent("Watching root %s: %d directories", path.c_str(), dir_cnt);
 }
 
-/* Zap watches and cache entries for the given path and it's subdirectories
- * @param old_path The path of the directory
- * @return The number of entries that were (tried to be) removed from the cache, or -1 if an inotify_rm_watch call
- * failed.
+/**
+ * Removes the watches of a root and all of its subdirectories. Stops the watcher if no root is left.
+ * @param path The root directory.
  */
-int Inotify::zapSubdirectories(const std::filesystem::path &old_path)
+void Inotify::dropRoot(const std::filesystem::path &path)
 {
-  int remove_cnt = 0;
-  for (auto it = _wd_cache.begin(); it != _wd_cache.end();)
+  auto root = std::find_if(_roots.begin(), _roots.end(), [&path](const std::filesystem::path &root) {
+    return rootKey(root.native()) == rootKey(path.native());
+  });
+  if (root == _roots.end()) return;
+  const std::filesystem::path dropped = std::move(*root);
+  _roots.erase(root);
+
+  /* The kernel already dropped the watches of a deleted tree, so failures to remove them are expected */
+  for (int wd : _wd_cache.subtree(_wd_cache.find(dropped)))
   {
-    if (it->second.string().rfind(old_path.string(), 0) == 0)
-    {
-      if (inotify_rm_watch(_inotify_fd, it->first) == -1) return -1;
-      it = _wd_cache.erase(it);
-      remove_cnt++;
-    }
-    else
-    {
-      ++it;
-    }
+    inotify_rm_watch(_inotify_fd, wd);
+    _wd_cache.erase(wd);
   }
+  _ignore = IgnoreMatcher(_ignore_patterns, _roots);
+  _metrics.watches.set(_wd_cache.size());
+  _logger.logEvent("Stopped watching root %s", dropped.c_str());
 
-  return remove_cnt;
+  if (_roots.empty())
+  {
+    _stopped = true;
+    _logger.logEvent("Nothing to watch.");
+  }
 }
 
-/* Processes an event that occurred against a directory.
- * @param event The event to process.
+/**
+ * Checks if a path can be added as another root. Roots must not be nested in each other, so that every directory
+ * belongs to exactly one root.
+ * @param path The root directory to check.
+ * @return The reason why the path can't be added, or an empty string if it can.
  */
-void Inotify::processDirectoryEvent(const FileEvent &event)
+std::string Inotify::checkRoot(const std::filesystem::path &path) const
 {
-  /* The path of the directory that the event occurred in */
-  const std::filesystem::path &dir_path = _wd_cache.at(event.wd);
+  auto normal = [](const std::filesystem::path &path) {
+    std::error_code error;
+    std::string normal = std::filesystem::absolute(path, error).lexically_normal().native();
+    while (normal.size() > 1 && normal.back() == '/') normal.pop_back();
+    return normal;
+  };
+  auto contains = [](std::string_view outer, std::string_view inner) {
+    return inner.size() > outer.size() && inner.compare(0, outer.size(), outer) == 0 &&
+           (inner[outer.size()] == '/' || outer.back() == '/');
+  };
+
+  const std::string key = normal(path);
+  for (const auto &root : _roots)
+  {
+    const std::string other = normal(root);
+    if (key == other) return "Root directory is watched already";
+    if (contains(other, key) || contains(key, other)) return "Root directories must not be nested";
+  }
+  return {};
+}
+
+/**
+ * Checks if a path is one of the roots.
+ * @param path The path of a directory, as it is cached.
+ * @return True if the path is a root.
+ */
+bool Inotify::isRoot(const std::filesystem::path &path) const
+{
+  const std::string_view key = rootKey(path.native());
+  return std::any_of(
+      _roots.begin(), _roots.end(), [key](const std::filesystem::path &root) { return rootKey(root.native()) == key; });
+}
+
+/**
+ * Keys the mask rules by the absolute path of their subtree under a root, so that they can be looked up when a watch
+ * is added.
+ * @param root The root directory that the subtrees of the rules are relative to.
+ */
+void Inotify::addMaskRules(const std::filesystem::path &root)
+{
+  for (const auto &rule : _options.mask_rules)
+  {
+    std::string subtree = (root / rule.subtree).lexically_normal().native();
+    while (subtree.size() > 1 && subtree.back() == '/') subtree.pop_back();
+    _mask_rules[subtree] = rule.events;
+  }
+}
+
+/**
+ * Restores the watches of the directories in the snapshot file, without listing any directory. Directories that no
+ * longer exist, or were replaced by another inode, are left out and remembered as deleted. Roots that are not in the
+ * snapshot, or were replaced, are left unwatched. The recorded modification
+ * times are those of the snapshot, so that reportSnapshotChanges() rescans exactly the directories that changed.
+ * @return The number of directories that were added to the watch list, or -1 if there is no usable snapshot.
+ */
+int Inotify::watchFromSnapshot()
+{
+  if (access(_options.snapshot_file.c_str(), F_OK) == -1) return -1;
+
+  const auto start = std::chrono::steady_clock::now();
+  int dir_cnt = 0;
+  size_t root_cnt = 0;
+  try
+  {
+    Snapshot snapshot(_options.snapshot_file);
+    std::vector<int> wds(snapshot.size(), -1); /* Entry index to watch descriptor, -1 if not restored */
+    std::vector<bool> parents(snapshot.size(), false); /* Entries with a restored subdirectory */
+
+    for (size_t i = 0; i < snapshot.size(); ++i)
+    {
+      const Snapshot::Entry &entry = snapshot.entry(i);
+      const std::string_view name = snapshot.name(i);
+
+      /* Only the trees of the roots are restored; parents come first, so a missing parent means a missing subtree */
+      std::filesystem::path path;
+      if (entry.parent == -1)
+      {
+        auto root = std::find_if(_roots.begin(), _roots.end(), [name](const std::filesystem::path &root) {
+          return rootKey(root.native()) == rootKey(name);
+        });
+        if (root == _roots.end() || _wd_cache.find(*root) != -1) continue;
+        path = *root;
+      }
+      else
+      {
+        int parent_wd = wds[entry.parent];
+        if (parent_wd == -1 || isForeign(parent_wd, name, true)) continue;
+        path = _wd_cache.path(parent_wd) / name;
+      }
+
+      if (isIgnored(path, true)) continue;
+
+      struct stat st;
+      if (lstat(path.c_str(), &st) == -1 || !S_ISDIR(st.st_mode) || st.st_ino != entry.inode)
+      {
+        if (entry.parent == -1) continue;
+        _snapshot_deleted.push_back(path);
+        continue;
+      }
+
+      int wd = addWatch(path, &st);
+      if (wd == -1) throw std::runtime_error("Failed to restore the watch of " + path.string());
+      _wd_cache.setStat(wd, entry.inode, entry.mtime);
+      wds[i] = wd;
+      dir_cnt++;
+      if (entry.parent == -1)
+        root_cnt++;
+      else
+        parents[entry.parent] = true;
+    }
+
+    /* The snapshot of a lazily watched tree ends at its edge, which is where the restored one continues */
+    if (_options.lazy_depth >= 0)
+    {
+      for (size_t i = 0; i < snapshot.size(); ++i)
+        if (wds[i] != -1 && !parents[i]) _unexpanded.insert(wds[i]);
+    }
+  } catch (const std::exception &e)
+  {
+    _logger.logEvent("Ignoring snapshot: %s", e.what());
+    dir_cnt = 0;
+  }
+
+  if (dir_cnt == 0)
+  {
+    /* Start over with a full crawl */
+    for (int wd : _wd_cache.descriptors()) inotify_rm_watch(_inotify_fd, wd);
+    _wd_cache.clear();
+    _unexpanded.clear();
+    _snapshot_deleted.clear();
+    return -1;
+  }
+
+  _logger.logEvent("Restored %zu of %zu roots from %s: %d directories watched in %.3f s",
+      root_cnt,
+      _roots.size(),
+      _options.snapshot_file.c_str(),
+      dir_cnt,
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+  return dir_cnt;
+}
+
+/**
+ * Reports the changes that happened while the watcher was not running: directories of the snapshot that are gone are
+ * reported as deleted, and the directories whose modification time changed are rescanned.
+ */
+void Inotify::reportSnapshotChanges()
+{
+  _read_time = std::chrono::steady_clock::now();
+  for (const auto &path : _snapshot_deleted) emit(EventType::Delete, true, path.native());
+  _snapshot_deleted.clear();
+
+  int rescan_cnt = rescanDirectories();
+  if (rescan_cnt == -1)
+    reinitialize();
+  else
+    _logger.logEvent("Rescanned %d directories that changed since the snapshot", rescan_cnt);
+  deliverBatch();
+}
+
+/**
+ * Saves the directory index to the snapshot file. Failures are logged, they don't affect the shutdown.
+ * Directories that changed while the watcher was running keep the modification time of when they were watched, so
+ * they are rescanned once more on the next start.
+ */
+void Inotify::saveSnapshot()
+{
+  try
+  {
+    Snapshot::save(_options.snapshot_file, _wd_cache);
+    _logger.logEvent("Saved %zu directories to %s", _wd_cache.size(), _options.snapshot_file.c_str());
+  } catch (const std::exception &e)
+  {
+    _logger.logEvent("Failed to save snapshot: %s", e.what());
+  }
+}
+
+/**
+ * Registers a specific directory path with inotify and adds it to the watch descriptor cache.
+ * @param path The directory path to add to the inotify watch list.
+ * @param st The status of the directory if it is known already, used when the state of the directory is recorded.
+ * @return The watch descriptor for the directory, or -1 if the watch could not be added.
+ */
+int Inotify::addWatch(const std::filesystem::path &path, const struct stat *st)
+{
+  /* Watch for the selected file events and don't follow symbolic links. Creations, deletions and moves are always
+   * needed to keep track of the subdirectories */
+  const uint32_t mask = eventMask(path);
+  uint32_t flags = mask | IN_CREATE | IN_MOVE | IN_DELETE | IN_DONT_FOLLOW;
+  if (_options.only_dir) flags |= IN_ONLYDIR;
+  if (_options.excl_unlink) flags |= IN_EXCL_UNLINK;
+  if (isRoot(path))
+  {
+    flags |= IN_DELETE_SELF | IN_MOVE_SELF; /* Watch for the root directory being deleted or moved */
+  }
+
+  int wd = inotify_add_watch(_inotify_fd, path.c_str(), flags);
+  if (wd == -1)
+  {
+    _logger.logEvent("Failed to add watch for directory: %s", path.c_str());
+    return -1;
+  }
+
+  _wd_cache.insert(wd, path);
+  _wd_cache.setMask(wd, mask);
+
+  /* Record the state of the directory after the watch is in place, so that a rescan can tell what changed */
+  struct stat current;
+  if (_options.overflow_recovery == OverflowRecovery::Rescan || !_options.snapshot_file.empty())
+  {
+    if (st == nullptr && stat(path.c_str(), &current) == 0) st = &current;
+    if (st != nullptr)
+      _wd_cache.setStat(wd, st->st_ino, int64_t(st->st_mtim.tv_sec) * 1000000000 + st->st_mtim.tv_nsec);
+  }
+
+  return wd;
+}
+
+/**
+ * Resolves the file events that are selected for a directory: its own mask rule if there is one, otherwise the mask of
+ * its parent directory, and the mask of the options for a root.
+ * @param path The path of the directory.
+ * @return The mask of the selected inotify events.
+ */
+uint32_t Inotify::eventMask(const std::filesystem::path &path) const
+{
+  if (!_mask_rules.empty())
+  {
+    std::string key = path.native();
+    while (key.size() > 1 && key.back() == '/') key.pop_back();
+    auto rule = _mask_rules.find(key);
+    if (rule != _mask_rules.end()) return rule->second;
+  }
+
+  int parent = _wd_cache.find(path.parent_path());
+  if (parent != -1) return _wd_cache.node(parent).mask;
+
+  return IN_CREATE | IN_MOVE | IN_DELETE | (_options.close_write ? IN_CLOSE_WRITE : IN_MODIFY);
+}
+
+/* Find the watch descriptor for the given path
+ * @param path The path of the directory
+ * @return The watch descriptor for the given path, or -1 if the path is not found in the cache
+ */
+int Inotify::findWd(const std::filesystem::path &path) { return _wd_cache.find(path); }
+
+/**
+ * Processes a single iteration of the event loop, dispatching whatever file descriptors are ready.
+ */
+void Inotify::runOnce()
+{
+  if (_uring)
+    _uring->wait([this](UringReader::Completion completion, int result) { completeUring(completion, result); });
+  else
+    _reactor->runOnce();
+}
+
+/**
+ * Handles a completion of the io_uring reader. Every read is the whole wakeup, the next one is only submitted by the
+ * next io_uring_enter, which waits for it as well.
+ * @param completion What completed.
+ * @param result The length of the events that were read, or a negative errno.
+ * @throws InotifyError if the inotify fd could not be read.
+ */
+void Inotify::completeUring(UringReader::Completion completion, int result)
+{
+  switch (completion)
+  {
+    case UringReader::Completion::Read:
+      /* Interrupted reads and reads of a replaced fd are simply submitted again */
+      if (result == -EAGAIN || result == -EINTR || result == -ECANCELED) return;
+      if (result < 0) throw InotifyError("Failed to read events from inotify");
+      _read_time = std::chrono::steady_clock::now();
+      _metrics.reads.add();
+      _metrics.bytes.add(result);
+      _metrics.bytes_per_wakeup.record(result);
+      _metrics.queue_depth.record(result); /* The read drained the queue, unless it filled the buffer */
+      recordEvents(_uring->data(), result);
+      _event_reader = FileEventReader(_uring->data(), result);
+      resolveStraddledMoves();
+      processEvents();
+      deliverBatch();
+      _metrics.watches.set(_wd_cache.size());
+      if (_coalescer) scheduleCoalescedFlush();
+      break;
+    case UringReader::Completion::Ready:
+      _reactor->runOnce(0); /* Timers, posted tasks and the fds of the control channel */
+      break;
+    case UringReader::Completion::Stop:
+      break; /* stop() set the flag already */
+  }
+}
+
+/**
+ * Reads and processes events until the non-blocking inotify file descriptor has no more events queued.
+ * Draining a whole burst before going back to epoll_wait saves wakeups.
+ */
+void Inotify::drainEvents()
+{
+  /* Size the buffer to drain the whole queue in one read, the events of the last wakeup are all processed; if the
+     queue can't be measured, the buffer keeps its size */
+  int queued = 0;
+  if (_source)
+    queued = int(std::min<size_t>(_source->pending(), EVENT_BUFFER_MAX));
+  else if (ioctl(_inotify_fd, FIONREAD, &queued) == -1)
+    queued = -1;
+  if (queued >= 0)
+  {
+    _metrics.queue_depth.record(queued);
+    _event_buffer.fit(size_t(queued));
+  }
+  _metrics.read_buffer_bytes.set(_event_buffer.size());
+
+  uint64_t wakeup_bytes = 0;
+  while (!_stopped)
+  {
+    ssize_t length = readEventsIntoBuffer();
+    if (length <= 0) break;
+    _read_time = std::chrono::steady_clock::now();
+    _metrics.reads.add();
+    _metrics.bytes.add(length);
+    wakeup_bytes += length;
+    recordEvents(_event_buffer.data(), length);
+    readEventsFromBuffer(length);
+    resolveStraddledMoves();
+    processEvents();
+    deliverBatch();
+  }
+
+  if (wakeup_bytes > 0) _metrics.bytes_per_wakeup.record(wakeup_bytes);
+  _metrics.watches.set(_wd_cache.size());
+  if (_coalescer) scheduleCoalescedFlush();
+}
+
+/**
+ * Starts the thread that reads the inotify fd into the ring.
+ */
+void Inotify::startReader()
+{
+  if (_reader.joinable()) return;
+
+  eventfd_t count;
+  eventfd_read(_space_fd, &count); /* Forget stop requests of an earlier run */
+  _reader_stopped = false;
+  _reader = std::thread(&Inotify::readerLoop, this);
+}
+
+/**
+ * Stops the reader thread and waits for it. Buffers that it published stay in the ring.
+ */
+void Inotify::stopReader()
+{
+  if (!_reader.joinable()) return;
+
+  _reader_stopped = true;
+  eventfd_write(_space_fd, 1);
+  _reader.join();
+}
+
+/**
+ * Body of the reader thread in pipelined mode: reads bursts of events into free slots of the ring and signals the
+ * reactor for every published buffer. While the ring is full the kernel queues the events, and the reader waits until
+ * the processing releases a slot.
+ */
+void Inotify::readerLoop()
+{
+  try
+  {
+    while (!_reader_stopped)
+    {
+      EventRing::Slot *slot = _ring->acquire();
+      if (slot == nullptr)
+      {
+        /* Announce the wait before checking again, so that a slot released in between is not missed */
+        _reader_blocked = true;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        slot = _ring->acquire();
+        if (slot == nullptr)
+        {
+          _reader_stalls.fetch_add(1, std::memory_order_relaxed);
+          pollfd space{_space_fd, POLLIN, 0};
+          poll(&space, 1, -1);
+          eventfd_t count;
+          eventfd_read(_space_fd, &count);
+          continue;
+        }
+        _reader_blocked = false;
+      }
+
+      ssize_t length = read(_inotify_fd, slot->data.get(), _ring->slotSize());
+      if (length == -1 && (errno == EAGAIN || errno == EINTR))
+      {
+        /* Wait for more events, or for stop() */
+        pollfd fds[2] = {{_inotify_fd, POLLIN, 0}, {_space_fd, POLLIN, 0}};
+        poll(fds, 2, -1);
+        if (fds[1].revents & POLLIN)
+        {
+          eventfd_t count;
+          eventfd_read(_space_fd, &count);
+        }
+        continue;
+      }
+      if (length == -1) throw InotifyError("Failed to read events from inotify");
+
+      slot->length = length;
+      slot->time = std::chrono::steady_clock::now();
+      _ring->publish();
+      _metrics.reads.add(); /* The reader thread is the only writer of the read counters in pipelined mode */
+      _metrics.bytes.add(length);
+      eventfd_write(_ring_fd, 1);
+    }
+  } catch (...)
+  {
+    /* Rethrown by run() */
+    _reader_error = std::current_exception();
+    stop();
+  }
+}
+
+/**
+ * Processes the buffers that the reader thread published, in place, and releases their slots.
+ */
+void Inotify::consumeRing()
+{
+  eventfd_t count;
+  eventfd_read(_ring_fd, &count);
+  _metrics.queue_depth.record(_ring->size());
+
+  uint64_t wakeup_bytes = 0;
+  while (!_stopped)
+  {
+    EventRing::Slot *slot = _ring->front();
+    if (slot == nullptr) break;
+
+    const uint64_t generation = _ring_generation;
+    wakeup_bytes += slot->length;
+    _read_time = slot->time;
+    recordEvents(slot->data.get(), slot->length);
+    _event_reader = FileEventReader(slot->data.get(), slot->length);
+    resolveStraddledMoves();
+    processEvents();
+    deliverBatch();
+
+    /* A reinitialization while processing dropped the slot already */
+    if (generation != _ring_generation) continue;
+    _event_reader = FileEventReader();
+    _ring->pop();
+    std::atomic_thread_fence(std::memory_order_seq_cst); /* Pairs with the fence of the waiting reader */
+    if (_reader_blocked.exchange(false)) eventfd_write(_space_fd, 1);
+  }
+
+  if (wakeup_bytes > 0) _metrics.bytes_per_wakeup.record(wakeup_bytes);
+  _metrics.watches.set(_wd_cache.size());
+  if (_coalescer) scheduleCoalescedFlush();
+}
+
+/**
+ * Services a control channel on the reactor of the watcher, so that signals and commands are handled by the same
+ * epoll_wait as the inotify events. Has to be called before the watcher runs, or from the loop thread.
+ * @param channel The channel to service, or null to detach the current one; not owned, has to outlive the watcher.
+ */
+void Inotify::setControlChannel(ControlChannel *channel)
+{
+  if (_control) _control->detach();
+  _control = channel;
+  if (_control) _control->attach(*_reactor);
+}
+
+/**
+ * Formats the runtime metrics of the watcher in the Prometheus text format.
+ */
+std::string Inotify::metrics() const { return _metrics.format(); }
+
+/**
+ * Returns the counters of the pipelined mode.
+ */
+Inotify::PipelineStats Inotify::pipelineStats() const
+{
+  if (!_ring) return PipelineStats{};
+  return PipelineStats{_metrics.reads.value(),
+      _metrics.bytes.value(),
+      _reader_stalls.load(std::memory_order_relaxed),
+      _ring->size(),
+      _ring->maxOccupancy(),
+      _ring->capacity()};
+}
+
+/**
+ * Processes the events decoded from the event buffer.
+ */
+void Inotify::processEvents()
+{
+  watchAhead();
+
+  uint64_t event_cnt = 0;
+  FileEventView event;
+  while (!_stopped && nextEvent(event))
+  {
+    event_cnt++;
+
+    /* If a root directory that is watched is deleted or moved, stop watching it; the other roots are not affected */
+    if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+    {
+      if (_wd_cache.contains(event.wd))
+      {
+        /* The root is reported as gone once, by the first shard */
+        const std::filesystem::path root = _wd_cache.path(event.wd);
+        if (_options.shard_index == 0)
+          emit(event.mask & IN_DELETE_SELF ? EventType::Delete : EventType::MoveOut, true, root.native());
+        dropRoot(root);
+      }
+    }
+    else if (event.mask & IN_Q_OVERFLOW)
+    {
+      /* Some events are lost when the queue overflows,
+       * at which point either the inotify file descriptor is reinitialized and the cache rebuilt,
+       * or the changed directories are rescanned, depending on the options */
+      _logger.logEvent("Queue overflow occurred");
+      _metrics.overflows.add();
+      expireMoves(true);
+      if (_coalescer) flushCoalesced(true);
+      recoverOverflow();
+    }
+    else if (!_wd_cache.contains(event.wd))
+    {
+      /* Still queued for a watch that was removed, e.g. of a subtree that is ignored now */
+    }
+    else if (event.mask & IN_ISDIR)
+    {
+      /* Directory events change the paths that held back file events resolve to */
+      if (_coalescer) flushCoalesced(true);
+      processDirectoryEvent(event);
+    }
+    else if (_coalescer && !_coalescer->add(event, _read_time))
+    {
+      /* Keep the order of the events of one file */
+      _coalescer->flush(event.wd, event.filename, [this](const FileEventView &held) { processFileEvent(held); });
+      processFileEvent(event);
+    }
+    else if (!_coalescer)
+    {
+      processFileEvent(event);
+    }
+
+    /* Activity at the edge of the lazily watched tree */
+    if (!_unexpanded.empty() && _unexpanded.count(event.wd)) expandDirectory(event.wd);
+  }
+
+  _watched_ahead.clear(); /* Of creates that were not reached, e.g. because of a reinitialization */
+  _metrics.events.add(event_cnt);
+  _metrics.events_per_read.record(event_cnt);
+}
+
+/**
+ * Adds the watches of the directories that were created in, or moved into, the tree before the file events that are
+ * queued ahead of them are processed. During a large extraction a mkdir can sit behind thousands of file events, and
+ * what is created in the new directory before it is watched is missed. Only the watches are added early; the events
+ * are still reported in their order. The pass stops at any other directory event, which may change the paths that
+ * the later events resolve to.
+ */
+void Inotify::watchAhead()
+{
+  FileEventReader reader = _event_reader;
+  FileEventView event;
+  bool behind = false; /* File events are queued ahead of the current event */
+  while (reader.next(event))
+  {
+    if (event.mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) break;
+    if (event.mask & IN_IGNORED || isMalformed(event) || !_wd_cache.contains(event.wd)) continue;
+    if (!(event.mask & IN_ISDIR))
+    {
+      behind = true;
+      continue;
+    }
+
+    /* Only new directories; a move within the tree is a rename that the cache follows */
+    const bool moved_in = event.mask & IN_MOVED_TO && !_pending_moves.count(event.cookie);
+    if (!(event.mask & IN_CREATE) && !moved_in) break;
+    if (!behind || isForeign(event.wd, event.filename, true)) continue;
+
+    const std::filesystem::path full_path = _wd_cache.path(event.wd) / event.filename;
+    if (_watched_ahead.count(full_path.native())) continue;
+    const bool watched = watchDirectory(full_path, lazyDepth(full_path)) != -1;
+    _watched_ahead.emplace(full_path.native(), watched);
+    _metrics.early_watches.add();
+  }
+}
+
+/**
+ * Reads inotify events into the event buffer, from the source that is replayed or else from the inotify fd.
+ * @return The number of bytes read into the buffer, or 0 if no events are queued.
+ * @throws InotifyError if the events could not be read.
+ */
+ssize_t Inotify::readEventsIntoBuffer()
+{
+  if (_source) return _source->read(_event_buffer.data(), _event_buffer.size());
+
+  ssize_t length = read(_inotify_fd, _event_buffer.data(), _event_buffer.size()); /* Read events into buffer */
+  if (length == -1)
+  {
+    if (errno == EAGAIN || errno == EINTR) return 0;
+    throw InotifyError("Failed to read events from inotify");
+  }
+
+  return length;
+}
+
+/**
+ * Appends the events of a read to the recording, if one was asked for, as they came from the kernel. A recording that
+ * can't be written is given up, the watcher keeps running.
+ * @param data The events.
+ * @param length Their size in bytes.
+ */
+void Inotify::recordEvents(const uint8_t *data, size_t length)
+{
+  if (_record_fd == -1 || _source) return;
+
+  size_t written = 0;
+  while (written < length)
+  {
+    ssize_t result = write(_record_fd, data + written, length - written);
+    if (result < 0 && errno == EINTR) continue;
+    if (result < 0)
+    {
+      _logger.logEvent("Failed to write the recording, stopped recording: %s", std::strerror(errno));
+      close(_record_fd);
+      _record_fd = -1;
+      return;
+    }
+    written += result;
+  }
+}
+
+/**
+ * Prepares the events in the event buffer to be decoded in place. No event is copied out of the buffer.
+ * @param length The number of bytes to read from the buffer.
+ */
+void Inotify::readEventsFromBuffer(ssize_t length) { _event_reader = FileEventReader(_event_buffer.data(), length); }
+
+/**
+ * Decodes the next event from the event buffer.
+ * @param event The view to fill in; it points into the event buffer and is valid until the next read.
+ * @return True if an event was decoded, false if all events of the buffer were processed.
+ */
+bool Inotify::nextEvent(FileEventView &event)
+{
+  while (_event_reader.next(event))
+  {
+    /*
+     * In cases when the mask is set to IN_IGNORED, it means that the watch descriptor was removed either explicitly or
+     * implicitly. Since we are manually handling the removal of watch descriptors, we need to ignore these events to
+     * prevent cache inconsistencies.
+     *
+     * So we only hand out the event if the mask does not contain IN_IGNORED.
+     */
+    if (event.mask & IN_IGNORED) continue;
+    if (isMalformed(event))
+    {
+      _metrics.malformed_events.add();
+      continue;
+    }
+    return true;
+  }
+
+  return false;
+}
+
+/**
+ * Checks for records that the kernel never produces, e.g. in a corrupt or synthetic stream that is replayed: a name
+ * that is no single path component would make the paths built from it leave the directory of the watch.
+ * @param event The decoded event.
+ * @return True if the event has to be dropped.
+ */
+bool Inotify::isMalformed(const FileEventView &event)
+{
+  const std::string_view name = event.filename;
+  if (name.find('/') != std::string_view::npos || name == "." || name == "..") return true;
+
+  /* The events about an entry of a directory always name the entry */
+  return name.empty() && (event.mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) != 0;
+}
+
+/**
+ * Decodes the next event from the event buffer without consuming it.
+ * @param event The view to fill in.
+ * @return True if there is an unprocessed event left in the buffer.
+ */
+bool Inotify::peekEvent(FileEventView &event)
+{
+  while (_event_reader.peek(event))
+  {
+    if (!(event.mask & IN_IGNORED))
+    {
+      if (!isMalformed(event)) return true;
+      _metrics.malformed_events.add();
+    }
+    _event_reader.next(event); /* Skip the IN_IGNORED or malformed event */
+  }
+
+  return false;
+}
+
+/**
+ * The directory oldPathPrefix/oldName was renamed to newPathPrefix/newName.
+ * Fix up cache entries for old_path_prefix/name and all of its subdirectories to reflect the change.
+ * Only the subtree of the renamed directory is visited.
+ * @param old_path_prefix The old path prefix to replace.
+ * @param new_path_prefix The new path prefix to replace with.
+ */
+void Inotify::rewriteCachedPaths(const std::string &old_path_prefix, const std::string &new_path_prefix)
+{
+  const auto started = std::chrono::steady_clock::now();
+  int wd = findWd(old_path_prefix);
+  if (wd != -1) _wd_cache.rename(wd, new_path_prefix);
+  _metrics.rename_rewrite_ns.record(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - started).count());
+}
+
+/* Zap watches and cache entries for the given path and it's subdirectories
+ * @param old_path The path of the directory
+ * @return The number of entries that were (tried to be) removed from the cache, or -1 if an inotify_rm_watch call
+ * failed.
+ */
+int Inotify::zapSubdirectories(const std::filesystem::path &old_path)
+{
+  int remove_cnt = 0;
+  for (int wd : _wd_cache.subtree(findWd(old_path)))
+  {
+    if (inotify_rm_watch(_inotify_fd, wd) == -1) return -1;
+    _wd_cache.erase(wd);
+    remove_cnt++;
+  }
+
+  return remove_cnt;
+}
+
+/* Processes an event that occurred against a directory.
+ * @param event The event to process.
+ */
+void Inotify::processDirectoryEvent(const FileEventView &event)
+{
+  /* The second half of a move whose first half was in an earlier read */
+  if (event.mask & IN_MOVED_TO)
+  {
+    auto pending = _pending_moves.find(event.cookie);
+    if (pending != _pending_moves.end())
+    {
+      const std::filesystem::path old_path = std::move(pending->second.path);
+      _pending_moves.erase(pending);
+      completeMove(true, old_path, event);
+      return;
+    }
+  }
+
+  /* Subdirectories of the root that are watched by another shard */
+  if (isForeign(event.wd, event.filename, true)) return;
+
+  /* The path of the directory that the event occurred in */
+  const std::filesystem::path dir_path = _wd_cache.path(event.wd);
   /* The path of the directory that the event is about */
-  const std::filesystem::path &full_path = dir_path / event.filename;
+  const std::filesystem::path full_path = dir_path / event.filename;
 
   if (event.mask & IN_DELETE)
   {
-    _logger.logEvent("Deleted directory: %s", full_path.c_str());
+    emit(EventType::Delete, true, full_path.native());
     int child_wd = findWd(full_path);
-    if (child_wd != -1) _wd_cache.erase(child_wd);
+    for (int wd : _wd_cache.subtree(child_wd)) _wd_cache.erase(wd);
     /* No need to remove watch descriptor or zap subdirectories; */
     /* that happens automatically due to the order of how the events are processed.
      * Removing the cache entry is enough */
@@ -404,9 +1616,19 @@ void Inotify::processDirectoryEvent(const FileEvent &event)
   /* New subdirectory was created, or a subdirectory was renamed into the watch directory */
   else if (event.mask & (IN_CREATE | IN_MOVED_TO))
   {
-    _logger.logEvent("Created directory: %s", full_path.c_str());
-    /* Start watching the new subdirectory and its subdirectories */
-    if (watchDirectory(full_path) == -1)
+    /* The cookie of a move tells consumers that this is the second half of a move from outside */
+    emit(EventType::Create, true, full_path.native(), {}, event.cookie);
+    /* Start watching the new subdirectory and its subdirectories, unless that was done ahead of the file events */
+    bool watched;
+    auto ahead = _watched_ahead.find(full_path.native());
+    if (ahead != _watched_ahead.end())
+    {
+      watched = ahead->second;
+      _watched_ahead.erase(ahead);
+    }
+    else
+      watched = watchDirectory(full_path, lazyDepth(full_path)) != -1;
+    if (!watched)
     {
       /* Failed to recognize the directory or add the watch descriptor to it or it's subdirectories;
        * In this case try to recover */
@@ -416,69 +1638,17 @@ void Inotify::processDirectoryEvent(const FileEvent &event)
   /* A subdirectory was renamed or moved out of the watch directory */
   else if (event.mask & IN_MOVED_FROM)
   {
-    /* If no more events in the queue, we assume there will be no corresponding IN_MOVED_TO event  */
-    if (_event_queue.empty())
+    /* The corresponding IN_MOVED_TO event usually follows right away */
+    FileEventView next_event;
+    if (peekEvent(next_event) && next_event.mask & IN_MOVED_TO && next_event.cookie == event.cookie)
     {
-      _logger.logEvent("Moved out of watch directory: %s", full_path.c_str());
-      if (zapSubdirectories(full_path) == -1)
-      {
-        /* Cache reached inconsistent state; try to recover */
-        reinitialize();
-      }
+      nextEvent(next_event);
+      completeMove(true, full_path, next_event);
     }
-    else /* We assume that the next event is the corresponding IN_MOVED_TO event */
+    else
     {
-      const auto next_event = _event_queue.front();
-
-      if (next_event.mask & IN_MOVED_TO && next_event.cookie == event.cookie)
-      {
-        _event_queue.pop();
-
-        const std::filesystem::path &next_dir_path = _wd_cache.at(next_event.wd);
-        const std::filesystem::path &next_full_path = next_dir_path / next_event.filename;
-
-        if (dir_path == next_dir_path)
-          _logger.logEvent("Renamed directory: %s -> %s", full_path.c_str(), next_full_path.c_str());
-        else
-          _logger.logEvent("Moved directory: %s -> %s", full_path.c_str(), next_full_path.c_str());
-
-        if (isIgnored(next_full_path.filename()))
-        {
-          /* The new path is in the ignored list;
-           * zap the watch descriptor and cache entries for the old path and it's subdirectories
-           * and do nothing for the new path */
-          if (zapSubdirectories(full_path) == -1)
-          {
-            /* Cache reached inconsistent state; try to recover */
-            reinitialize();
-          }
-        }
-        else if (isIgnored(full_path.filename()))
-        {
-          /* The old path is in the ignored list;
-           * watch the new path and it's subdirectories */
-          if (watchDirectory(next_full_path) == -1)
-          {
-            /* Cache reached inconsistent state; try to recover */
-            reinitialize();
-          }
-        }
-        else
-        {
-          /* Update the cache entries for the old and new paths */
-          rewriteCachedPaths(full_path, next_full_path);
-        }
-      }
-      else
-      {
-        /* Hanging IN_MOVED_FROM event. Treat it as a move out of the watch directory */
-        _logger.logEvent("Moved out of watch directory: %s", full_path.c_str());
-        if (zapSubdirectories(full_path) == -1)
-        {
-          /* Cache reached inconsistent state; try to recover */
-          reinitialize();
-        }
-      }
+      /* It may still be in the next read, or it never comes because the directory left the watched tree */
+      deferMove(true, full_path, event.cookie);
     }
   }
 }
@@ -486,55 +1656,404 @@ void Inotify::processDirectoryEvent(const FileEvent &event)
 /* Processes an event that occurred against a file.
  * @param event The event to process.
  */
-void Inotify::processFileEvent(const FileEvent &event)
+void Inotify::processFileEvent(const FileEventView &event)
 {
-  /* The path of the directory that the event occurred in */
-  const std::filesystem::path &dir_path = _wd_cache.at(event.wd);
+  /* The second half of a move whose first half was in an earlier read */
+  if (event.mask & IN_MOVED_TO)
+  {
+    auto pending = _pending_moves.find(event.cookie);
+    if (pending != _pending_moves.end())
+    {
+      const std::filesystem::path old_path = std::move(pending->second.path);
+      _pending_moves.erase(pending);
+      completeMove(false, old_path, event);
+      return;
+    }
+  }
+
+  /* Files directly in the root are reported by the first shard only */
+  if (isForeign(event.wd, event.filename, false)) return;
 
-  /* The path of the file that the event is about */
-  const std::filesystem::path &full_path = dir_path / event.filename;
+  /* Events that were only requested from the kernel to keep track of subdirectories */
+  if (!(event.mask & _wd_cache.node(event.wd).mask)) return;
+
+  /* The path of the file that the event is about; built in the arena, it is only valid until the batch is delivered */
+  const std::string_view full_path = _wd_cache.path(event.wd, event.filename, _path_arena);
+
+  /* A file that matches the ignore patterns; a move to a name that isn't ignored is reported as created */
+  if (isIgnored(full_path, false))
+  {
+    FileEventView next_event;
+    if (!(event.mask & IN_MOVED_FROM) || !peekEvent(next_event) || !(next_event.mask & IN_MOVED_TO) ||
+        next_event.cookie != event.cookie)
+      return;
+
+    nextEvent(next_event);
+    if (!_wd_cache.contains(next_event.wd)) return; /* Moved to a directory that is no longer watched */
+    const std::string_view next_full_path = _wd_cache.path(next_event.wd, next_event.filename, _path_arena);
+    if (!isForeign(next_event.wd, next_event.filename, false) && !isIgnored(next_full_path, false))
+      emit(EventType::Create, false, next_full_path, {}, event.cookie);
+    return;
+  }
 
   /* A file was created or renamed into the watch directory */
-  if (event.mask & (IN_CREATE | IN_MOVED_TO)) _logger.logEvent("Created file: %s", full_path.c_str());
+  if (event.mask & (IN_CREATE | IN_MOVED_TO)) emit(EventType::Create, false, full_path, {}, event.cookie);
 
   /* A file was deleted */
   else if (event.mask & IN_DELETE)
-    _logger.logEvent("Deleted file: %s", full_path.c_str());
+    emit(EventType::Delete, false, full_path);
 
-  /* A file was modified */
-  else if (event.mask & IN_MODIFY)
-    _logger.logEvent("Modified file: %s", full_path.c_str());
+  /* A file was modified, or closed after writing */
+  else if (event.mask & (IN_MODIFY | IN_CLOSE_WRITE))
+    emit(EventType::Modify, false, full_path);
 
   /* A file was renamed or moved from the watch directory */
   else if (event.mask & IN_MOVED_FROM)
   {
-    /* If no more events in the queue, we assume there will be no corresponding IN_MOVED_TO event */
-    if (_event_queue.empty())
+    /* The corresponding IN_MOVED_TO event usually follows right away */
+    FileEventView next_event;
+    if (peekEvent(next_event) && next_event.mask & IN_MOVED_TO && next_event.cookie == event.cookie)
     {
-      _logger.logEvent("Moved file out of watch directory: %s", full_path.c_str());
+      nextEvent(next_event);
+      completeMove(false, full_path, next_event);
     }
-    else /* We assume that the next event is the corresponding IN_MOVED_TO event */
+    else
     {
-      const FileEvent next_event = _event_queue.front();
+      /* It may still be in the next read, or it never comes because the file left the watched tree */
+      deferMove(false, full_path, event.cookie);
+    }
+  }
+}
 
-      /* Check if the next event is IN_MOVED_TO with the same cookie */
-      if (next_event.mask & IN_MOVED_TO && next_event.cookie == event.cookie)
-      {
-        _event_queue.pop();
-        const std::filesystem::path &next_dir_path = _wd_cache.at(next_event.wd);
-        const std::filesystem::path &next_full_path = next_dir_path / next_event.filename;
-
-        if (dir_path == next_dir_path)
-          _logger.logEvent("Renamed file: %s -> %s", full_path.c_str(), next_full_path.c_str());
-        else
-          _logger.logEvent("Moved file: %s -> %s", full_path.c_str(), next_full_path.c_str());
-      }
-      else
-      {
-        /* Hanging IN_MOVED_FROM event. Treat it as a move out of the watch directory */
-        _logger.logEvent("Moved file out of watch directory: %s", full_path.c_str());
-      }
+/**
+ * Handles a move of which both halves were seen.
+ * @param is_dir Whether a directory was moved.
+ * @param old_path The path before the move, from the IN_MOVED_FROM event.
+ * @param to The IN_MOVED_TO event.
+ */
+void Inotify::completeMove(bool is_dir, const std::filesystem::path &old_path, const FileEventView &to)
+{
+  /* The watch of the destination is gone already, e.g. its subtree was unwatched while the events were queued */
+  if (!_wd_cache.contains(to.wd))
+  {
+    expireMove(is_dir, old_path, to.cookie);
+    return;
+  }
+
+  if (!is_dir)
+  {
+    /* A move into the root of another shard is reported by that shard as created, and a move to an ignored name
+     * is reported as a move out */
+    const std::string_view new_path = _wd_cache.path(to.wd, to.filename, _path_arena);
+    if (isForeign(to.wd, to.filename, false) || isIgnored(new_path, false))
+      emit(EventType::MoveOut, false, old_path.native(), {}, to.cookie);
+    else
+      emit(EventType::Move, false, new_path, old_path.native(), to.cookie);
+    return;
+  }
+
+  const std::filesystem::path new_path = _wd_cache.path(to.wd) / to.filename;
+
+  if (isForeign(to.wd, to.filename, true))
+  {
+    /* Moved into a subtree of another shard, which reports it as created;
+     * zap the watch descriptor and cache entries for the old path and it's subdirectories */
+    expireMove(true, old_path, to.cookie);
+    return;
+  }
+
+  emit(EventType::Move, true, new_path.native(), old_path.native(), to.cookie);
+
+  if (isIgnored(new_path, true))
+  {
+    /* The new path is in the ignored list;
+     * zap the watch descriptor and cache entries for the old path and it's subdirectories
+     * and do nothing for the new path */
+    if (zapSubdirectories(old_path) == -1)
+    {
+      /* Cache reached inconsistent state; try to recover */
+      reinitialize();
     }
   }
+  else if (isIgnored(old_path, true))
+  {
+    /* The old path is in the ignored list;
+     * watch the new path and it's subdirectories, down to the lazy edge */
+    if (watchDirectory(new_path, lazyDepth(new_path)) == -1)
+    {
+      /* Cache reached inconsistent state; try to recover */
+      reinitialize();
+    }
+  }
+  else if (findWd(old_path) == -1)
+  {
+    /* Moved from below the edge of the lazily watched tree, where it was not watched yet */
+    if (watchDirectory(new_path, lazyDepth(new_path)) == -1) reinitialize();
+  }
+  else
+  {
+    /* Update the cache entries for the old and new paths */
+    rewriteCachedPaths(old_path, new_path);
+  }
+}
+
+/**
+ * Handles a move whose IN_MOVED_TO event was not seen, as a move out of the watched tree.
+ * @param is_dir Whether a directory was moved.
+ * @param old_path The path before the move.
+ * @param cookie The cookie of the move.
+ */
+void Inotify::expireMove(bool is_dir, const std::filesystem::path &old_path, uint32_t cookie)
+{
+  emit(EventType::MoveOut, is_dir, old_path.native(), {}, cookie);
+  if (is_dir && zapSubdirectories(old_path) == -1)
+  {
+    /* Cache reached inconsistent state; try to recover */
+    reinitialize();
+  }
+}
+
+/**
+ * Holds back an IN_MOVED_FROM event whose IN_MOVED_TO event was not in the same read. If the other half arrives within
+ * the move timeout the move is completed by its cookie, so a rename that straddles two reads doesn't zap and re-crawl
+ * the renamed subtree. Until then events inside of a held back directory are still reported under its old path.
+ * @param is_dir Whether a directory was moved.
+ * @param old_path The path before the move.
+ * @param cookie The cookie of the move.
+ */
+void Inotify::deferMove(bool is_dir, const std::filesystem::path &old_path, uint32_t cookie)
+{
+  if (_options.move_timeout.count() == 0 || cookie == 0)
+  {
+    expireMove(is_dir, old_path, cookie);
+    return;
+  }
+
+  _pending_moves[cookie] = PendingMove{is_dir, old_path, std::chrono::steady_clock::now() + _options.move_timeout};
+  scheduleMoveExpiry();
+}
+
+/**
+ * Gives up on the held back moves when a new read does not start with one of their IN_MOVED_TO events. The kernel
+ * queues the two halves of a move back to back, so the IN_MOVED_FROM of a move that straddles two reads was the last
+ * event of one read and its IN_MOVED_TO can only be the first event of the next one. This keeps moves out of the tree
+ * in order with the events that follow them, the timeout only applies when no further events arrive.
+ */
+void Inotify::resolveStraddledMoves()
+{
+  if (_pending_moves.empty()) return;
+
+  FileEventView first;
+  if (!peekEvent(first) || !(first.mask & IN_MOVED_TO) || !_pending_moves.count(first.cookie))
+  {
+    const auto read_time = _read_time;
+    expireMoves(true);
+    _read_time = read_time;
+  }
+}
+
+/**
+ * Treats the held back moves whose timeout passed as moves out of the watched tree.
+ * @param everything Expire all held back moves instead of only those whose timeout passed.
+ */
+void Inotify::expireMoves(bool everything)
+{
+  _read_time = std::chrono::steady_clock::now();
+  while (!_pending_moves.empty())
+  {
+    /* Oldest first, so that the order of the moves is kept */
+    auto oldest = std::min_element(_pending_moves.begin(), _pending_moves.end(), [](const auto &a, const auto &b) {
+      return a.second.deadline < b.second.deadline;
+    });
+    if (!everything && oldest->second.deadline > _read_time) break;
+
+    const uint32_t cookie = oldest->first;
+    const PendingMove move = std::move(oldest->second);
+    _pending_moves.erase(oldest);
+    expireMove(move.is_dir, move.path, cookie);
+  }
+}
+
+/**
+ * Arms a one-shot timer for the earliest timeout of the held back moves, unless one is armed already.
+ */
+void Inotify::scheduleMoveExpiry()
+{
+  if (_move_timer != -1 || _pending_moves.empty()) return;
+
+  auto deadline = std::min_element(_pending_moves.begin(), _pending_moves.end(), [](const auto &a, const auto &b) {
+    return a.second.deadline < b.second.deadline;
+  })->second.deadline;
+  _move_timer = _reactor->addTimer(deadline - std::chrono::steady_clock::now(), [this] {
+    _move_timer = -1;
+    expireMoves(false);
+    deliverBatch();
+    scheduleMoveExpiry();
+  });
+}
+
+/**
+ * Processes the held back file events.
+ * @param everything Process all held back events instead of only those whose window passed.
+ */
+void Inotify::flushCoalesced(bool everything)
+{
+  /* Held back events are reported when they are released */
+  _read_time = std::chrono::steady_clock::now();
+
+  auto process = [this](const FileEventView &event) {
+    /* The directory may have been removed from the cache in the meantime */
+    if (_wd_cache.contains(event.wd)) processFileEvent(event);
+  };
+
+  if (everything)
+    _coalescer->flushAll(process);
+  else
+    _coalescer->flushExpired(_read_time, process);
+}
+
+/**
+ * Arms a one-shot timer for the deadline of the oldest held back file event, unless one is armed already.
+ */
+void Inotify::scheduleCoalescedFlush()
+{
+  if (_coalesce_timer != -1 || _coalescer->empty()) return;
+
+  auto delay = _coalescer->nextDeadline() - std::chrono::steady_clock::now();
+  _coalesce_timer = _reactor->addTimer(delay, [this] {
+    _coalesce_timer = -1;
+    flushCoalesced(false);
+    deliverBatch();
+    scheduleCoalescedFlush();
+  });
+}
+
+/**
+ * Adds an event to the batch of the current read, or logs it if no handler is set.
+ * @param type What happened.
+ * @param is_dir Whether the event is about a directory.
+ * @param path The path the event is about; the new path of a move.
+ * @param old_path The previous path of a move.
+ * @param cookie The kernel cookie of a move half.
+ */
+void Inotify::emit(EventType type, bool is_dir, std::string_view path, std::string_view old_path, uint32_t cookie)
+{
+  if (_verifier && !verifyEvent(type, is_dir, path, old_path)) return;
+  record(type, is_dir, path, old_path, cookie);
+}
+
+/**
+ * Adds an event to the batch of the current read, or logs it if no handler is set, past the content verification.
+ */
+void Inotify::record(EventType type, bool is_dir, std::string_view path, std::string_view old_path, uint32_t cookie)
+{
+  if (_handler)
+    _batch.add(type, is_dir, path, old_path, cookie, _read_time);
+  else
+    logEvent(_logger, Event{type, is_dir, path, old_path, cookie, _read_time});
+}
+
+/**
+ * Holds a modify back until the contents of the file were compared with the last ones. The other events of a file, or
+ * of a directory that contains it, make its recorded contents stale; a modify of it that is still held back is
+ * reported first, unverified, so that it is not reported after the event that followed it.
+ * @return True if the event is reported now.
+ */
+bool Inotify::verifyEvent(EventType type, bool is_dir, std::string_view path, std::string_view old_path)
+{
+  auto report = [this](std::string_view pending) { record(EventType::Modify, false, pending, {}, 0); };
+  if (is_dir)
+  {
+    if (type == EventType::Move) _verifier->forgetUnder(old_path, report);
+    if (type != EventType::Modify && type != EventType::Rescan) _verifier->forgetUnder(path, report);
+    return true;
+  }
+
+  if (type == EventType::Modify) return _verifier->check(path);
+  if (type == EventType::Move && _verifier->forget(old_path)) report(old_path);
+  if (_verifier->forget(path)) report(path); /* Also a file that the move replaced */
+  return true;
 }
+
+/**
+ * Reports the modifies whose verification finished and that changed the contents, and drops the others.
+ * @param everything Wait for the verifications that are still in flight, e.g. when the watcher stops.
+ */
+void Inotify::completeVerifications(bool everything)
+{
+  _read_time = std::chrono::steady_clock::now();
+  auto verdict = [this](std::string_view path, bool changed) {
+    if (changed)
+      record(EventType::Modify, false, path, {}, 0);
+    else
+      _metrics.unchanged_modifies.add();
+  };
+  _metrics.hashed_bytes.add(everything ? _verifier->finish(verdict) : _verifier->collect(verdict));
+  if (!everything) deliverBatch();
+}
+
+/**
+ * Hands the events collected since the last delivery to the handler in one batch. The paths that were built in the
+ * arena for them are dropped, which happens after every read.
+ */
+void Inotify::deliverBatch()
+{
+  _path_arena.reset();
+  if (!_batch.empty())
+  {
+    _handler->onBatch(_batch);
+    _batch.clear();
+  }
+  countDroppedLines();
+}
+
+/**
+ * Mirrors the lines that the async logs dropped, of the watcher and of a handler that logs the events, in the metrics.
+ * The loggers count them, as any thread may log; the metric is only written here, on the watcher thread.
+ */
+void Inotify::countDroppedLines()
+{
+  const uint64_t dropped = _logger.dropped() + (_handler ? _handler->dropped() : 0);
+  const uint64_t counted = _metrics.dropped_log_lines.value();
+  if (dropped > counted) _metrics.dropped_log_lines.add(dropped - counted);
+}
+
+/**
+ * Checks if an entry of a watched directory belongs to another shard. Only the entries directly in the root are
+ * distributed: subdirectories by the hash of their name, files all to the first shard.
+ * @param parent_wd The watch descriptor of the directory that contains the entry.
+ * @param name The name of the entry.
+ * @param is_dir Whether the entry is a directory.
+ * @return True if another shard handles the entry.
+ */
+bool Inotify::isForeign(int parent_wd, std::string_view name, bool is_dir) const
+{
+  if (_options.shard_count <= 1) return false;
+  if (!_wd_cache.contains(parent_wd) || _wd_cache.node(parent_wd).parent != -1) return false;
+
+  return is_dir ? shardOf(name, _options.shard_count) != _options.shard_index : _options.shard_index != 0;
+}
+
+/**
+ * Assigns a top-level directory to a shard. Uses FNV-1a so that the assignment is stable across processes.
+ * @param name The name of the directory.
+ * @param shard_count The number of shards.
+ * @return The index of the shard that watches the directory.
+ */
+size_t Inotify::shardOf(std::string_view name, size_t shard_count)
+{
+  uint64_t hash = 14695981039346656037ull;
+  for (unsigned char c : name)
+  {
+    hash ^= c;
+    hash *= 1099511628211ull;
+  }
+  return shard_count == 0 ? 0 : hash % shard_count;
+}
+
+/**
+ * Sets the consumer of the events. Without a handler the events are logged. Has to be set before the watcher runs.
+ * @param handler Called on the watcher thread with the events of every read; not owned, has to outlive the watcher.
+ */
+void Inotify::setEventHandler(EventHandler *handler) { _handler = handler; }
 }  // namespace inotify
@@ -1,36 +1,250 @@
 #include "include/Logger.hpp"
 
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+
+#include <cerrno>
+#include <cinttypes>
 #include <chrono>
 #include <cstdarg>
-#include <iomanip>
+#include <cstdio>
+#include <ctime>
 #include <iostream>
 
 namespace inotify {
 
+/* Maximum number of lines handed to a single writev call */
+static constexpr int MAX_BATCH_LINES = 64;
+
+/**
+ * Creates a logger.
+ * @param mode Sync writes every line from the calling thread; Async hands the lines to a background writer thread.
+ * @param fd The file descriptor the async writer thread writes to.
+ */
+Logger::Logger(Mode mode, int fd)
+  : _mode(mode)
+  , _fd(fd)
+  , _head(0)
+  , _tail(0)
+  , _writer_waiting(false)
+  , _stopping(false)
+  , _dropped(0)
+  , _wake_fd(-1)
+{
+  if (_mode != Mode::Async) return;
+
+  _ring.reset(new Slot[RING_CAPACITY]);
+  for (size_t i = 0; i < RING_CAPACITY; ++i) _ring[i].sequence.store(i, std::memory_order_relaxed);
+
+  _wake_fd = eventfd(0, 0);
+  _writer = std::thread(&Logger::writerLoop, this);
+}
+
+/**
+ * Flushes the pending lines and stops the writer thread.
+ */
+Logger::~Logger()
+{
+  if (_mode != Mode::Async) return;
+
+  _stopping = true;
+  wakeWriter();
+  _writer.join();
+  close(_wake_fd);
+}
+
 void Logger::logEvent(const char* format, ...)
 {
-  std::cout << '[' << getTimestamp() << "] ";
   va_list args;
   va_start(args, format);
-  vprintf(format, args);
+
+  if (_mode == Mode::Sync && _fd == STDOUT_FILENO)
+  {
+    std::cout << '[' << getTimestamp() << "] ";
+    vprintf(format, args);
+    std::cout << std::endl;
+    va_end(args);
+    return;
+  }
+  if (_mode == Mode::Sync)
+  {
+    /* Another fd, e.g. stderr while stdout carries the structured event stream */
+    dprintf(_fd, "[%s] ", getTimestamp());
+    vdprintf(_fd, format, args);
+    dprintf(_fd, "\n");
+    va_end(args);
+    return;
+  }
+
+  /* Claim a slot; when the ring is full the line is dropped instead of blocking the caller */
+  size_t pos = _head.load(std::memory_order_relaxed);
+  Slot* slot;
+  for (;;)
+  {
+    slot = &_ring[pos & (RING_CAPACITY - 1)];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire);
+    intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+    if (diff == 0)
+    {
+      if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    }
+    else if (diff < 0)
+    {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      va_end(args);
+      return;
+    }
+    else
+    {
+      pos = _head.load(std::memory_order_relaxed);
+    }
+  }
+
+  slot->length = formatLine(slot->line, sizeof(slot->line), format, args);
   va_end(args);
-  std::cout << std::endl;
+  slot->sequence.store(pos + 1, std::memory_order_release);
+
+  /* Pairs with the fence in writerLoop, so either the writer sees the line or we see that it is waiting */
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (_writer_waiting.load(std::memory_order_relaxed)) wakeWriter();
+}
+
+/**
+ * Formats the local time as DD-MM-YYYY HH:MM:SS. The formatted string is cached per thread and only rebuilt when the
+ * second changes, so the hot path does not call localtime for every line.
+ */
+const char* Logger::getTimestamp()
+{
+  thread_local time_t cached_second = -1;
+  thread_local char cached[32];
+
+  time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  if (now != cached_second)
+  {
+    std::tm now_tm;
+    localtime_r(&now, &now_tm);
+    strftime(cached, sizeof(cached), "%d-%m-%Y %H:%M:%S", &now_tm);
+    cached_second = now;
+  }
+
+  return cached;
 }
 
-std::string Logger::getTimestamp() const
+/**
+ * Formats a complete log line, including the timestamp and the trailing newline, truncating it to fit the slot.
+ * @return The number of bytes written into the line.
+ */
+size_t Logger::formatLine(char* line, size_t size, const char* format, va_list args) const
 {
-  // Get the current time as system time
-  auto now = std::chrono::system_clock::now();
-  auto now_t = std::chrono::system_clock::to_time_t(now);
+  int prefix = snprintf(line, size, "[%s] ", getTimestamp());
+  int message = vsnprintf(line + prefix, size - prefix, format, args);
+
+  size_t length = prefix + (message < 0 ? 0 : size_t(message));
+  if (length > size - 1) length = size - 1; /* Truncated; keep room for the newline */
+  line[length++] = '\n';
+  return length;
+}
+
+/**
+ * Writes the lines of the ring in batches with writev until the logger is destroyed.
+ */
+void Logger::writerLoop()
+{
+  iovec iov[MAX_BATCH_LINES];
+  uint64_t reported = 0; /* Dropped lines that were reported already */
+
+  for (;;)
+  {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    int count = 0;
+    while (count < MAX_BATCH_LINES)
+    {
+      Slot& slot = _ring[(tail + count) & (RING_CAPACITY - 1)];
+      if (slot.sequence.load(std::memory_order_acquire) != tail + count + 1) break;
+      iov[count].iov_base = slot.line;
+      iov[count].iov_len = slot.length;
+      count++;
+    }
+
+    if (count == 0)
+    {
+      reportDropped(reported);
+      if (_stopping) return;
 
-  // Convert to local time
-  std::tm now_tm = *std::localtime(&now_t);
+      _writer_waiting.store(true, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      Slot& next = _ring[tail & (RING_CAPACITY - 1)];
+      if (next.sequence.load(std::memory_order_acquire) != tail + 1 && !_stopping)
+      {
+        uint64_t value;
+        if (read(_wake_fd, &value, sizeof(value)) == -1 && errno != EINTR) return;
+      }
+      _writer_waiting.store(false, std::memory_order_relaxed);
+      continue;
+    }
 
-  // Format the time as YYYY-MM-DD HH:MM:SS
-  std::ostringstream oss;
-  oss << std::put_time(&now_tm, "%d-%m-%Y %H:%M:%S");
+    /* Write the whole batch, continuing after partial writes */
+    iovec* pending = iov;
+    int pending_cnt = count;
+    while (pending_cnt > 0)
+    {
+      ssize_t written = writev(_fd, pending, pending_cnt);
+      if (written == -1)
+      {
+        if (errno == EINTR) continue;
+        break; /* The output is gone; drop the batch */
+      }
 
-  return oss.str();
+      while (pending_cnt > 0 && size_t(written) >= pending->iov_len)
+      {
+        written -= pending->iov_len;
+        pending++;
+        pending_cnt--;
+      }
+      if (pending_cnt > 0)
+      {
+        pending->iov_base = static_cast<char*>(pending->iov_base) + written;
+        pending->iov_len -= written;
+      }
+    }
+
+    /* Hand the slots back to the producers */
+    for (int i = 0; i < count; ++i)
+    {
+      _ring[(tail + i) & (RING_CAPACITY - 1)].sequence.store(tail + i + RING_CAPACITY, std::memory_order_release);
+    }
+    _tail.store(tail + count, std::memory_order_relaxed);
+    reportDropped(reported);
+  }
+}
+
+/**
+ * Writes a line about the lines that were dropped since the last report, so that a consumer of the log, e.g. of the
+ * event stream of the command line tool, can tell that it missed some. Runs on the writer thread, after the lines that
+ * were already queued when the ring overran.
+ * @param reported The number of dropped lines that were reported already, updated.
+ */
+void Logger::reportDropped(uint64_t& reported)
+{
+  const uint64_t dropped = _dropped.load(std::memory_order_relaxed);
+  if (dropped == reported) return;
+
+  char line[LINE_MAX_LEN];
+  int length = snprintf(line, sizeof(line), "[%s] %" PRIu64 " lines dropped\n", getTimestamp(), dropped - reported);
+  reported = dropped;
+  for (int written = 0; length > 0 && written < length;)
+  {
+    ssize_t result = write(_fd, line + written, length - written);
+    if (result == -1 && errno == EINTR) continue;
+    if (result == -1) return; /* The output is gone */
+    written += result;
+  }
+}
+
+void Logger::wakeWriter()
+{
+  uint64_t value = 1;
+  (void)!write(_wake_fd, &value, sizeof(value));
 }
 
 }  // namespace inotify
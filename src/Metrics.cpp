@@ -0,0 +1,128 @@
+#include "include/Metrics.hpp"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+
+namespace inotify {
+
+/**
+ * Records a value in the bucket of the smallest power of two that is not below it.
+ * @param value The value to record.
+ */
+void Histogram::record(uint64_t value)
+{
+  size_t index = value <= 1 ? 0 : size_t(64 - __builtin_clzll(value - 1));
+  if (index > BUCKET_CNT) index = BUCKET_CNT;
+  _buckets[index].add();
+  _count.add();
+  _sum.add(value);
+}
+
+namespace {
+
+void appendLine(std::string& out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+void appendLine(std::string& out, const char* format, ...)
+{
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  int length = std::vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length > 0) out.append(line, std::min(size_t(length), sizeof(line) - 1));
+}
+
+/* Label set of a sample, with an extra label pair appended */
+std::string labelSet(const std::string& labels, const std::string& extra = {})
+{
+  if (labels.empty() && extra.empty()) return {};
+  if (labels.empty() || extra.empty()) return "{" + labels + extra + "}";
+  return "{" + labels + "," + extra + "}";
+}
+
+template <typename Metric>
+void appendScalar(std::string& out,
+    const char* name,
+    const char* type,
+    const char* help,
+    const std::vector<Metrics::Source>& sources,
+    Metric Metrics::*metric)
+{
+  appendLine(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+  for (const auto& source : sources)
+    appendLine(out, "%s%s %" PRIu64 "\n", name, labelSet(source.labels).c_str(), (source.metrics->*metric).value());
+}
+
+void appendHistogram(std::string& out,
+    const char* name,
+    const char* help,
+    const std::vector<Metrics::Source>& sources,
+    Histogram Metrics::*metric)
+{
+  appendLine(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  for (const auto& source : sources)
+  {
+    const Histogram& histogram = source.metrics->*metric;
+    uint64_t cumulative = 0;
+    for (size_t i = 0; i < Histogram::BUCKET_CNT; ++i)
+    {
+      cumulative += histogram.bucket(i);
+      const std::string bound = "le=\"" + std::to_string(uint64_t(1) << i) + "\"";
+      appendLine(out, "%s_bucket%s %" PRIu64 "\n", name, labelSet(source.labels, bound).c_str(), cumulative);
+    }
+    appendLine(out, "%s_bucket%s %" PRIu64 "\n", name, labelSet(source.labels, "le=\"+Inf\"").c_str(),
+        histogram.count());
+    appendLine(out, "%s_sum%s %" PRIu64 "\n", name, labelSet(source.labels).c_str(), histogram.sum());
+    appendLine(out, "%s_count%s %" PRIu64 "\n", name, labelSet(source.labels).c_str(), histogram.count());
+  }
+}
+
+}  // namespace
+
+std::string Metrics::format() const { return format({Source{{}, this}}); }
+
+/**
+ * Formats the metrics of several watchers in the Prometheus text exposition format, every metric family once with a
+ * sample per watcher.
+ * @param sources The watchers and the labels that tell them apart.
+ * @return The exposition, one sample per line.
+ */
+std::string Metrics::format(const std::vector<Source>& sources)
+{
+  std::string out;
+  appendScalar(out, "inotify_reads_total", "counter", "Reads that returned events.", sources, &Metrics::reads);
+  appendScalar(out, "inotify_events_total", "counter", "Events read from the kernel.", sources, &Metrics::events);
+  appendScalar(out, "inotify_read_bytes_total", "counter", "Bytes read from the kernel.", sources, &Metrics::bytes);
+  appendScalar(out, "inotify_overflows_total", "counter", "Event queue overflows.", sources, &Metrics::overflows);
+  appendScalar(out, "inotify_reinitializations_total", "counter", "Rebuilds of the watch cache.", sources,
+      &Metrics::reinitializations);
+  appendScalar(out, "inotify_unchanged_modifies_total", "counter", "Modifies dropped as the contents were unchanged.",
+      sources, &Metrics::unchanged_modifies);
+  appendScalar(out, "inotify_hashed_bytes_total", "counter", "Bytes read to verify modified files.", sources,
+      &Metrics::hashed_bytes);
+  appendScalar(out, "inotify_expansions_total", "counter", "Lazily watched directories that were expanded.", sources,
+      &Metrics::expansions);
+  appendScalar(out, "inotify_malformed_events_total", "counter", "Malformed event records that were dropped.", sources,
+      &Metrics::malformed_events);
+  appendScalar(out, "inotify_early_watches_total", "counter", "New directories watched ahead of queued file events.",
+      sources, &Metrics::early_watches);
+  appendScalar(out, "inotify_dropped_log_lines_total", "counter", "Log lines dropped because the output fell behind.",
+      sources, &Metrics::dropped_log_lines);
+  appendScalar(out, "inotify_watches", "gauge", "Watched directories.", sources, &Metrics::watches);
+  appendScalar(out, "inotify_read_buffer_bytes", "gauge", "Current size of the read buffer.", sources,
+      &Metrics::read_buffer_bytes);
+  appendHistogram(out, "inotify_events_per_read", "Events decoded from a read.", sources, &Metrics::events_per_read);
+  appendHistogram(out, "inotify_bytes_per_wakeup", "Bytes read per wakeup of the event loop.", sources,
+      &Metrics::bytes_per_wakeup);
+  appendHistogram(out, "inotify_queue_depth", "Bytes queued in the kernel, or buffers queued in the ring, on wakeup.",
+      sources, &Metrics::queue_depth);
+  appendHistogram(out, "inotify_reinitialize_microseconds", "Duration of a rebuild of the watch cache.", sources,
+      &Metrics::reinitialize_us);
+  appendHistogram(out, "inotify_rename_rewrite_nanoseconds", "Time spent rewriting cached paths for a directory move.",
+      sources, &Metrics::rename_rewrite_ns);
+  return out;
+}
+
+}  // namespace inotify
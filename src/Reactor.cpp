@@ -0,0 +1,185 @@
+#include "include/Reactor.hpp"
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+#include "include/InotifyError.hpp"
+
+namespace inotify {
+
+/**
+ * Creates the epoll instance and registers the wakeup eventfd.
+ * @throws InotifyError if the epoll instance or the eventfd could not be created.
+ */
+Reactor::Reactor() : _stopped(false)
+{
+  _epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epoll_fd < 0) throw InotifyError("Failed to initialize epoll instance");
+
+  _wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_wakeup_fd < 0) throw InotifyError("Failed to initialize event file descriptor");
+
+  add(_wakeup_fd, EPOLLIN, [this](uint32_t) {
+    uint64_t value;
+    while (read(_wakeup_fd, &value, sizeof(value)) > 0)
+    {
+    }
+
+    std::vector<Task> tasks;
+    {
+      std::lock_guard<std::mutex> lock(_tasks_mutex);
+      tasks.swap(_tasks);
+    }
+    for (auto& task : tasks) task();
+  });
+}
+
+/**
+ * Closes the epoll instance, the wakeup eventfd and all timers that are still pending.
+ */
+Reactor::~Reactor()
+{
+  for (int timer_fd : _timers) close(timer_fd);
+  close(_wakeup_fd);
+  close(_epoll_fd);
+}
+
+/**
+ * Registers a file descriptor with the loop. A file descriptor can only be registered once.
+ * @param fd The file descriptor to watch.
+ * @param events The epoll events to wait for, e.g. EPOLLIN.
+ * @param handler Called on the loop thread when the file descriptor is ready.
+ * @throws InotifyError if the file descriptor could not be added to epoll.
+ */
+void Reactor::add(int fd, uint32_t events, Handler handler)
+{
+  epoll_event event{};
+  event.events = events;
+  event.data.fd = fd;
+  if (epoll_ctl(_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+    throw InotifyError("Failed to add file descriptor to epoll");
+
+  _entries[fd] = std::make_shared<Entry>(Entry{std::move(handler)});
+}
+
+/**
+ * Unregisters a file descriptor. It is safe to remove a file descriptor from within its own handler.
+ * @param fd The file descriptor to remove.
+ */
+void Reactor::remove(int fd)
+{
+  if (_entries.erase(fd) == 0) return;
+  epoll_ctl(_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+/**
+ * Arms a timer backed by a timerfd.
+ * @param delay Time until the timer fires, and the interval of a periodic timer.
+ * @param handler Called on the loop thread when the timer fires.
+ * @param periodic Keep firing every delay until the timer is cancelled; one-shot timers cancel themselves.
+ * @return The timer id, used to cancel the timer.
+ * @throws InotifyError if the timer could not be created.
+ */
+int Reactor::addTimer(std::chrono::nanoseconds delay, TimerHandler handler, bool periodic)
+{
+  int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (timer_fd < 0) throw InotifyError("Failed to create timer");
+
+  /* A zero expiration would disarm the timer */
+  if (delay.count() <= 0) delay = std::chrono::nanoseconds(1);
+
+  itimerspec spec{};
+  spec.it_value.tv_sec = delay.count() / 1000000000;
+  spec.it_value.tv_nsec = delay.count() % 1000000000;
+  if (periodic) spec.it_interval = spec.it_value;
+
+  if (timerfd_settime(timer_fd, 0, &spec, nullptr) == -1)
+  {
+    close(timer_fd);
+    throw InotifyError("Failed to arm timer");
+  }
+
+  add(timer_fd, EPOLLIN, [this, timer_fd, periodic, handler = std::move(handler)](uint32_t) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) <= 0) return;
+    if (!periodic) cancelTimer(timer_fd);
+    handler();
+  });
+  _timers.insert(timer_fd);
+  return timer_fd;
+}
+
+/**
+ * Cancels a timer. Cancelling a timer that already fired is a no-op.
+ * @param timer_id The id returned by addTimer.
+ */
+void Reactor::cancelTimer(int timer_id)
+{
+  if (_timers.erase(timer_id) == 0) return;
+  remove(timer_id);
+  close(timer_id);
+}
+
+/**
+ * Waits for ready file descriptors and dispatches their handlers.
+ * @param timeout_ms Max. time to wait in milliseconds, or -1 to wait until something is ready.
+ */
+void Reactor::runOnce(int timeout_ms)
+{
+  int triggered_events = epoll_wait(_epoll_fd, _epoll_events, MAX_EPOLL_EVENTS, timeout_ms);
+  if (triggered_events == -1)
+  {
+    if (errno == EINTR) return;
+    throw InotifyError("Failed to wait for events");
+  }
+
+  for (int i = 0; i < triggered_events; ++i)
+  {
+    /* A previous handler may have removed the fd; keep the entry alive while its handler runs */
+    auto it = _entries.find(_epoll_events[i].data.fd);
+    if (it == _entries.end()) continue;
+    std::shared_ptr<Entry> entry = it->second;
+    entry->handler(_epoll_events[i].events);
+  }
+}
+
+/**
+ * Dispatches events until stop() is called.
+ */
+void Reactor::run()
+{
+  _stopped = false;
+  while (!_stopped) runOnce();
+}
+
+void Reactor::stop()
+{
+  _stopped = true;
+  wakeup();
+}
+
+void Reactor::wakeup()
+{
+  uint64_t value = 1;
+  (void)!write(_wakeup_fd, &value, sizeof(value));
+}
+
+/**
+ * Queues a task for the loop thread, e.g. to change the state of a watcher from another thread. Tasks run in the order
+ * they were posted, on the next iteration of the loop; tasks that are still queued when the reactor is destroyed are
+ * dropped.
+ * @param task The task to run.
+ */
+void Reactor::post(Task task)
+{
+  {
+    std::lock_guard<std::mutex> lock(_tasks_mutex);
+    _tasks.push_back(std::move(task));
+  }
+  wakeup();
+}
+
+}  // namespace inotify
@@ -0,0 +1,51 @@
+#include "include/ReadBuffer.hpp"
+
+#include <algorithm>
+
+namespace inotify {
+
+/**
+ * Allocates the buffer with its minimum size.
+ * @param min_size The smallest size; it has to hold the largest single event.
+ * @param max_size The largest size the buffer grows to under load.
+ */
+ReadBuffer::ReadBuffer(size_t min_size, size_t max_size)
+  : _min_size(min_size), _max_size(std::max(min_size, max_size)), _size(0), _peak(0), _wakeups(0)
+{
+  resize(_min_size);
+}
+
+/**
+ * Grows the buffer to hold the queued bytes in a single read, or shrinks it after a period of low load. Shrinking is
+ * lazy: the buffer is halved only if the peak of the last SHRINK_WAKEUPS wakeups would have fit into a quarter of it,
+ * so a load that hovers around a size does not make the buffer flip between two sizes.
+ * @param queued The number of bytes queued in the kernel.
+ */
+void ReadBuffer::fit(size_t queued)
+{
+  _peak = std::max(_peak, queued);
+
+  if (queued > _size && _size < _max_size)
+  {
+    size_t size = _size;
+    while (size < queued && size < _max_size) size *= 2;
+    resize(std::min(size, _max_size));
+    return;
+  }
+
+  if (++_wakeups < SHRINK_WAKEUPS) return;
+  if (_peak <= _size / 4 && _size > _min_size) resize(std::max(_size / 2, _min_size));
+  _peak = 0;
+  _wakeups = 0;
+}
+
+void ReadBuffer::resize(size_t size)
+{
+  if (size == _size) return;
+  _data.reset(new uint8_t[size]); /* Not value-initialized, the kernel fills it */
+  _size = size;
+  _peak = 0;
+  _wakeups = 0;
+}
+
+}  // namespace inotify
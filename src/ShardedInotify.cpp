@@ -0,0 +1,283 @@
+#include "include/ShardedInotify.hpp"
+
+namespace inotify {
+
+/**
+ * Creates one watcher per shard. Every shard watches the root itself, but only the subdirectories assigned to it.
+ * @param path The root directory to monitor for file system changes.
+ * @param ignored_dirs Ignore patterns for the entries to be excluded from monitoring.
+ * @param options Tunables of every shard; the shard index and count are set per shard.
+ * @param shard_count The number of inotify instances to split the tree across.
+ */
+ShardedInotify::ShardedInotify(const std::filesystem::path& path,
+    const std::vector<std::string>& ignored_dirs,
+    const InotifyOptions& options,
+    size_t shard_count)
+  : ShardedInotify(std::vector<std::filesystem::path>{path}, ignored_dirs, options, shard_count)
+{
+}
+
+/**
+ * Creates one watcher per shard for several trees. The subdirectories of every root are split across the shards.
+ * @param roots The root directories to monitor; they must not be nested in each other.
+ * @param ignored_dirs Ignore patterns for the entries to be excluded from monitoring.
+ * @param options Tunables of every shard; the shard index and count are set per shard.
+ * @param shard_count The number of inotify instances to split the trees across.
+ */
+ShardedInotify::ShardedInotify(const std::vector<std::filesystem::path>& roots,
+    const std::vector<std::string>& ignored_dirs,
+    const InotifyOptions& options,
+    size_t shard_count)
+  : _shard_handler(*this)
+  , _handler(nullptr)
+  , _logger(options.log_mode, options.log_fd)
+  , _control(nullptr)
+  , _half_window(options.move_timeout + REORDER_WINDOW)
+  , _sequence(0)
+  , _running_cnt(0)
+  , _stopped(false)
+{
+  if (shard_count == 0) shard_count = 1;
+
+  for (size_t i = 0; i < shard_count; ++i)
+  {
+    InotifyOptions shard_options = options;
+    shard_options.shard_index = i;
+    shard_options.shard_count = shard_count;
+    if (!options.snapshot_file.empty()) shard_options.snapshot_file += "." + std::to_string(i);
+
+    _shards.push_back(std::make_unique<Inotify>(roots, ignored_dirs, shard_options));
+    _shards.back()->setEventHandler(&_shard_handler);
+  }
+}
+
+ShardedInotify::~ShardedInotify()
+{
+  stop();
+  if (_control) _control->detach();
+}
+
+/**
+ * Runs every shard on its own thread and delivers the merged events on the calling thread, until stop() is called or
+ * all shards stopped on their own.
+ * @throws The first error raised by a shard.
+ */
+void ShardedInotify::run()
+{
+  std::vector<std::thread> threads;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopped = false;
+    _running_cnt = _shards.size();
+  }
+
+  for (auto& shard : _shards)
+  {
+    threads.emplace_back([this, &shard] {
+      try
+      {
+        shard->run();
+      } catch (...)
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_error) _error = std::current_exception();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _running_cnt--;
+      }
+      _reactor.wakeup();
+    });
+  }
+
+  /* Release the merged events every reorder window, and dispatch the control channel in between */
+  for (;;)
+  {
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      if (_stopped || _running_cnt == 0 || _error) break;
+    }
+    _reactor.runOnce(REORDER_WINDOW.count());
+    release(false);
+  }
+
+  for (auto& shard : _shards) shard->stop();
+  for (auto& thread : threads) thread.join();
+  release(true);
+
+  if (_error) std::rethrow_exception(_error);
+}
+
+void ShardedInotify::stop()
+{
+  for (auto& shard : _shards) shard->stop();
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stopped = true;
+  }
+  _reactor.wakeup();
+}
+
+/**
+ * Sets the consumer of the merged events. Without a handler the events are logged. Has to be set before run().
+ * @param handler Called on the thread that runs the sharded watcher with the released events in batches; not owned, has
+ * to outlive the watcher.
+ */
+void ShardedInotify::setEventHandler(EventHandler* handler) { _handler = handler; }
+
+/**
+ * Services a control channel on the merge loop, the thread that runs the sharded watcher. Has to be called before the
+ * watcher runs, or from the loop thread.
+ * @param channel The channel to service, or null to detach the current one; not owned, has to outlive the watcher.
+ */
+void ShardedInotify::setControlChannel(ControlChannel* channel)
+{
+  if (_control) _control->detach();
+  _control = channel;
+  if (_control) _control->attach(_reactor);
+}
+
+/**
+ * Replaces the ignore patterns of every shard; each shard applies them on its own thread.
+ * @param patterns The new ignore patterns; they replace all of the current ones.
+ */
+void ShardedInotify::setIgnorePatterns(const std::vector<std::string>& patterns)
+{
+  for (auto& shard : _shards) shard->setIgnorePatterns(patterns);
+}
+
+/**
+ * Adds a root to every shard; each shard crawls the subdirectories of the root that are assigned to it.
+ * @param path The root directory to monitor.
+ */
+void ShardedInotify::addRoot(const std::filesystem::path& path)
+{
+  for (auto& shard : _shards) shard->addRoot(path);
+}
+
+/**
+ * Watches deeper below a lazily watched directory, with the shard that watches it.
+ * @param path The directory.
+ * @param depth How many levels below the directory are watched, or -1 for all of them.
+ */
+void ShardedInotify::expand(const std::filesystem::path& path, int depth)
+{
+  for (auto& shard : _shards) shard->expand(path, depth);
+}
+
+/**
+ * Removes a root from every shard.
+ * @param path The root directory, as it was added.
+ */
+void ShardedInotify::removeRoot(const std::filesystem::path& path)
+{
+  for (auto& shard : _shards) shard->removeRoot(path);
+}
+
+/**
+ * Formats the runtime metrics of the shards in the Prometheus text format, with a shard label per sample. The merge
+ * loop, which logs or hands out the merged events, is labeled shard="merge".
+ */
+std::string ShardedInotify::metrics() const
+{
+  std::vector<Metrics::Source> sources;
+  for (size_t i = 0; i < _shards.size(); ++i)
+    sources.push_back(Metrics::Source{"shard=\"" + std::to_string(i) + "\"", &_shards[i]->rawMetrics()});
+  sources.push_back(Metrics::Source{"shard=\"merge\"", &_merge_metrics}); /* Lines of the merged event stream */
+  return Metrics::format(sources);
+}
+
+/**
+ * Queues the events of one read of a shard, taking the lock once for the whole batch.
+ * @param batch The events reported by a shard, on the thread of that shard.
+ */
+void ShardedInotify::push(const EventBatch& batch)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  for (size_t i = 0; i < batch.size(); ++i) pushLocked(batch.event(i));
+}
+
+/**
+ * Queues an event of a shard. A shard reports a move into another shard's subtree as moved out, and the other shard
+ * reports the same move as created with the same cookie; the two halves are combined into a single move here.
+ * @param event The event reported by a shard.
+ */
+void ShardedInotify::pushLocked(Event event)
+{
+  const bool is_half = event.cookie != 0 && (event.type == EventType::MoveOut || event.type == EventType::Create);
+  if (is_half)
+  {
+    auto half = _move_halves.find(event.cookie);
+    if (half != _move_halves.end())
+    {
+      Event& other = _pending.at(half->second);
+      const Event& from = other.type == EventType::MoveOut ? other : event;
+      const Event& to = other.type == EventType::MoveOut ? event : other;
+
+      if (from.type == EventType::MoveOut && to.type == EventType::Create)
+      {
+        Event move{EventType::Move, from.is_dir, to.path, from.path, event.cookie, other.time};
+        other = std::move(move);
+        _move_halves.erase(half);
+        return;
+      }
+    }
+  }
+
+  Key key{event.time, _sequence++};
+  if (is_half) _move_halves[event.cookie] = key;
+  _pending.emplace(key, std::move(event));
+}
+
+/**
+ * Delivers the queued events in the order they were read. A move half that is not paired yet is held back for the
+ * move timeout on top of the reorder window, and the events after it with it: the shard that saw the other half of a
+ * move below the top level only reports it as moved out once its own move timeout passed.
+ * @param everything Deliver all queued events instead of only those older than the reorder window.
+ */
+void ShardedInotify::release(bool everything)
+{
+  const auto now = std::chrono::steady_clock::now();
+  const auto horizon = now - REORDER_WINDOW;
+  const auto half_horizon = now - _half_window;
+
+  std::vector<Event> ready;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _pending.begin();
+    while (it != _pending.end() && (everything || it->first.first < horizon))
+    {
+      if (it->second.cookie != 0)
+      {
+        auto half = _move_halves.find(it->second.cookie);
+        if (half != _move_halves.end() && half->second == it->first)
+        {
+          if (!everything && it->first.first >= half_horizon) break;
+          _move_halves.erase(half);
+        }
+      }
+      ready.push_back(std::move(it->second));
+      it = _pending.erase(it);
+    }
+  }
+
+  if (!_handler)
+  {
+    for (const auto& event : ready) logEvent(_logger, event);
+  }
+  else if (!ready.empty())
+  {
+    for (const auto& event : ready) _batch.add(event);
+    _handler->onBatch(_batch);
+    _batch.clear();
+  }
+
+  /* Only the merge loop writes the metric */
+  const uint64_t dropped = _logger.dropped() + (_handler ? _handler->dropped() : 0);
+  const uint64_t counted = _merge_metrics.dropped_log_lines.value();
+  if (dropped > counted) _merge_metrics.dropped_log_lines.add(dropped - counted);
+}
+
+}  // namespace inotify
@@ -0,0 +1,141 @@
+#include "include/Snapshot.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "include/InotifyError.hpp"
+
+namespace inotify {
+
+/**
+ * Maps a snapshot file and checks that its tables are consistent.
+ * @param file The path of the snapshot.
+ * @throws InotifyError if the file could not be opened or mapped.
+ * @throws std::runtime_error if the file is not a valid snapshot.
+ */
+Snapshot::Snapshot(const std::filesystem::path& file) : _data(MAP_FAILED), _length(0)
+{
+  int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) throw InotifyError("Failed to open snapshot " + file.string());
+
+  struct stat st;
+  if (fstat(fd, &st) == -1)
+  {
+    close(fd);
+    throw InotifyError("Failed to stat snapshot " + file.string());
+  }
+
+  _length = st.st_size;
+  if (_length >= sizeof(Header)) _data = mmap(nullptr, _length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (_length < sizeof(Header)) throw std::runtime_error("Truncated snapshot " + file.string());
+  if (_data == MAP_FAILED) throw InotifyError("Failed to map snapshot " + file.string());
+
+  _header = static_cast<const Header*>(_data);
+  _entries = reinterpret_cast<const Entry*>(_header + 1);
+  _names = reinterpret_cast<const char*>(_entries + _header->entry_cnt);
+
+  /* Everything below is only decoded in place, so the tables have to be checked before they are used */
+  const char* error = nullptr;
+  if (std::memcmp(_header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0)
+    error = "Not a snapshot";
+  else if (_header->version != SNAPSHOT_VERSION)
+    error = "Unsupported snapshot version";
+  else if (sizeof(Header) + uint64_t(_header->entry_cnt) * sizeof(Entry) + _header->names_size != _length)
+    error = "Truncated snapshot";
+
+  for (size_t i = 0; error == nullptr && i < size(); ++i)
+  {
+    const Entry& current = _entries[i];
+    if (current.parent >= int32_t(i) || current.parent < -1 ||
+        uint64_t(current.name_offset) + current.name_size > _header->names_size || current.name_size == 0)
+      error = "Corrupt snapshot";
+  }
+
+  if (error != nullptr)
+  {
+    munmap(_data, _length);
+    throw std::runtime_error(std::string(error) + " " + file.string());
+  }
+}
+
+Snapshot::~Snapshot() { munmap(_data, _length); }
+
+/**
+ * Writes the directory index of a cache to a snapshot file. The file is written next to the destination and renamed
+ * over it, so a crash never leaves a partial snapshot behind.
+ * @param file The path of the snapshot.
+ * @param cache The cache to save, with the inode numbers and modification times recorded.
+ * @throws InotifyError if the file could not be written.
+ */
+void Snapshot::save(const std::filesystem::path& file, const WatchCache& cache)
+{
+  std::vector<Entry> entries;
+  std::string names;
+  std::unordered_map<int, int32_t> indices; /* Watch descriptor to entry index */
+  entries.reserve(cache.size());
+  indices.reserve(cache.size());
+
+  for (int root : cache.roots())
+  {
+    /* Subtrees list children first; the snapshot needs parents first */
+    std::vector<int> subtree = cache.subtree(root);
+    for (auto it = subtree.rbegin(); it != subtree.rend(); ++it)
+    {
+      const WatchCache::Node& node = cache.node(*it);
+      std::string_view name = cache.name(*it);
+      int32_t parent = node.parent == -1 ? -1 : indices.at(node.parent);
+
+      indices.emplace(*it, int32_t(entries.size()));
+      entries.push_back(Entry{parent, uint32_t(names.size()), uint32_t(name.size()), 0, node.inode, node.mtime});
+      names.append(name);
+    }
+  }
+
+  Header header{};
+  std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header.version = SNAPSHOT_VERSION;
+  header.entry_cnt = entries.size();
+  header.names_size = names.size();
+
+  const std::string temporary = file.string() + ".tmp";
+  int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1) throw InotifyError("Failed to create snapshot " + temporary);
+
+  const std::pair<const void*, size_t> parts[] = {
+      {&header, sizeof(header)}, {entries.data(), entries.size() * sizeof(Entry)}, {names.data(), names.size()}};
+  for (const auto& [data, length] : parts)
+  {
+    size_t written = 0;
+    while (written < length)
+    {
+      ssize_t result = write(fd, static_cast<const char*>(data) + written, length - written);
+      if (result == -1 && errno == EINTR) continue;
+      if (result == -1)
+      {
+        close(fd);
+        unlink(temporary.c_str());
+        throw InotifyError("Failed to write snapshot " + temporary);
+      }
+      written += result;
+    }
+  }
+
+  bool synced = fsync(fd) == 0;
+  if (close(fd) == -1) synced = false;
+  if (!synced || rename(temporary.c_str(), file.c_str()) == -1)
+  {
+    unlink(temporary.c_str());
+    throw InotifyError("Failed to save snapshot " + file.string());
+  }
+}
+
+}  // namespace inotify
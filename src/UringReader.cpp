@@ -0,0 +1,285 @@
+#include "include/UringReader.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include "include/InotifyError.hpp"
+
+namespace inotify {
+
+namespace {
+
+/* Kinds of requests in the low byte of their user data; the requests on the watched fd carry the generation above it */
+constexpr uint64_t READ_TAG = uint64_t(UringReader::Completion::Read);
+constexpr uint64_t STOP_TAG = uint64_t(UringReader::Completion::Stop);
+constexpr uint64_t READY_TAG = uint64_t(UringReader::Completion::Ready);
+constexpr uint64_t READ_POLL_TAG = 3; /* The poll that the read of the watched fd is linked to */
+
+int setup(unsigned entries, io_uring_params* params)
+{
+  return int(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return int(syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0));
+}
+
+int registerRing(int ring_fd, unsigned opcode, void* arg, unsigned arg_cnt)
+{
+  return int(syscall(__NR_io_uring_register, ring_fd, opcode, arg, arg_cnt));
+}
+
+/* Cancels the requests that match, and waits until they completed */
+int syncCancel(int ring_fd, uint64_t user_data, int fd, uint32_t flags)
+{
+  io_uring_sync_cancel_reg cancel;
+  std::memset(&cancel, 0, sizeof(cancel));
+  cancel.addr = user_data;
+  cancel.fd = fd;
+  cancel.flags = flags;
+  cancel.timeout.tv_sec = -1; /* No timeout */
+  cancel.timeout.tv_nsec = -1;
+  return registerRing(ring_fd, IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+}
+
+}  // namespace
+
+/**
+ * Sets up the ring, maps it and registers the read buffer.
+ * @param buffer_size The size of the buffer the watched fd is read into.
+ * @param poll_fd A file descriptor whose readability is reported, or -1.
+ * @throws InotifyError if the ring could not be set up.
+ */
+UringReader::UringReader(size_t buffer_size, int poll_fd)
+  : _ring_fd(-1)
+  , _stop_fd(-1)
+  , _poll_fd(poll_fd)
+  , _fd(-1)
+  , _buffer_size(buffer_size)
+  , _buffer(new uint8_t[buffer_size])
+  , _stop_value(0)
+  , _generation(0)
+  , _read_armed(false)
+  , _stop_armed(false)
+  , _poll_armed(false)
+  , _to_submit(0)
+  , _sq_ring(MAP_FAILED)
+  , _sq_size(0)
+  , _cq_ring(MAP_FAILED)
+  , _cq_size(0)
+  , _sqes(static_cast<io_uring_sqe*>(MAP_FAILED))
+  , _sqes_size(0)
+{
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  _ring_fd = setup(URING_ENTRIES, &params);
+  if (_ring_fd < 0) throw InotifyError("Failed to set up io_uring");
+
+  /* Map the rings; newer kernels share one mapping between the submission and the completion queue ring */
+  _sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  const size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    _sq_size = std::max(_sq_size, cq_size);
+  else
+    _cq_size = cq_size;
+
+  _sq_ring = mmap(nullptr, _sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQ_RING);
+  if (_cq_size != 0)
+    _cq_ring = mmap(nullptr, _cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_CQ_RING);
+  else
+    _cq_ring = _sq_ring;
+  _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+  _sqes = static_cast<io_uring_sqe*>(
+      mmap(nullptr, _sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, IORING_OFF_SQES));
+  if (_sq_ring == MAP_FAILED || _cq_ring == MAP_FAILED || _sqes == MAP_FAILED)
+  {
+    release();
+    throw InotifyError("Failed to map the io_uring rings");
+  }
+
+  uint8_t* sq = static_cast<uint8_t*>(_sq_ring);
+  uint8_t* cq = static_cast<uint8_t*>(_cq_ring);
+  _sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  _sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  _sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  _cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  _cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  _cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  /* The kernel pins the registered buffer once, instead of mapping it for every read */
+  iovec buffer{_buffer.get(), _buffer_size};
+  if (registerRing(_ring_fd, IORING_REGISTER_BUFFERS, &buffer, 1) < 0)
+  {
+    release();
+    throw InotifyError("Failed to register the io_uring read buffer");
+  }
+
+  /* Blocking, so that its read waits in the kernel instead of failing with EAGAIN */
+  _stop_fd = eventfd(0, EFD_CLOEXEC);
+  if (_stop_fd < 0)
+  {
+    release();
+    throw InotifyError("Failed to create the io_uring stop eventfd");
+  }
+}
+
+/**
+ * Closing the ring cancels the requests that are still in flight.
+ */
+UringReader::~UringReader() { release(); }
+
+void UringReader::release() noexcept
+{
+  if (_sqes != MAP_FAILED) munmap(_sqes, _sqes_size);
+  if (_cq_size != 0 && _cq_ring != MAP_FAILED) munmap(_cq_ring, _cq_size);
+  if (_sq_ring != MAP_FAILED) munmap(_sq_ring, _sq_size);
+  if (_stop_fd >= 0) close(_stop_fd);
+  if (_ring_fd >= 0) close(_ring_fd);
+  _sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  _cq_ring = _sq_ring = MAP_FAILED;
+  _stop_fd = _ring_fd = -1;
+}
+
+/**
+ * Checks if io_uring can be used: it may be missing, disabled by the kernel.io_uring_disabled sysctl or by a seccomp
+ * filter, and synchronous cancellation, which setFd() relies on, needs Linux 6.0.
+ * @return True if a ring with the needed features can be set up.
+ */
+bool UringReader::supported()
+{
+  io_uring_params params;
+  std::memset(&params, 0, sizeof(params));
+  int ring_fd = setup(1, &params);
+  if (ring_fd < 0) return false;
+
+  /* Nothing is in flight, so a kernel that knows the operation reports that nothing matched */
+  const bool sync_cancel = syncCancel(ring_fd, 0, -1, 0) < 0 && errno == ENOENT;
+  close(ring_fd);
+  return sync_cancel;
+}
+
+/**
+ * Switches the watched fd, e.g. when it is recreated. The read of the previous fd is cancelled and waited for, so
+ * that it no longer writes to the buffer, and its completion is dropped.
+ * @param fd The fd to read from now on, or -1 to stop reading.
+ */
+void UringReader::setFd(int fd)
+{
+  if (_read_armed) syncCancel(_ring_fd, 0, _fd, IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL);
+  _read_armed = false;
+  _generation++;
+  _fd = fd;
+}
+
+/**
+ * Completes the stop read, which makes a blocking wait() return.
+ */
+void UringReader::wakeup() { eventfd_write(_stop_fd, 1); }
+
+/**
+ * Queues a request in the submission queue. There are never more requests than entries, so there is always room.
+ * @return The entry to fill in.
+ */
+io_uring_sqe* UringReader::prepare(uint8_t opcode, int fd, uint64_t user_data)
+{
+  const unsigned tail = *_sq_tail;
+  const unsigned index = tail & _sq_mask;
+  io_uring_sqe* sqe = &_sqes[index];
+  std::memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+  _sq_array[index] = index;
+
+  /* The kernel reads the entry once it sees the new tail */
+  __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+  _to_submit++;
+  return sqe;
+}
+
+/**
+ * Re-arms the requests that completed, submits them and waits for at least one completion, all in one system call.
+ * Then dispatches every completion that is ready.
+ * @param handler Called for every completion, in the order the kernel posted them.
+ * @throws InotifyError if io_uring could not be entered.
+ */
+void UringReader::wait(const Handler& handler)
+{
+  if (!_stop_armed)
+  {
+    io_uring_sqe* sqe = prepare(IORING_OP_READ, _stop_fd, STOP_TAG);
+    sqe->addr = reinterpret_cast<uint64_t>(&_stop_value);
+    sqe->len = sizeof(_stop_value);
+    _stop_armed = true;
+  }
+  if (!_poll_armed && _poll_fd != -1)
+  {
+    io_uring_sqe* sqe = prepare(IORING_OP_POLL_ADD, _poll_fd, READY_TAG);
+    sqe->poll32_events = POLLIN;
+    _poll_armed = true;
+  }
+  if (!_read_armed && _fd != -1)
+  {
+    /* The read only runs once the poll saw events, and only the read posts a completion */
+    io_uring_sqe* poll = prepare(IORING_OP_POLL_ADD, _fd, tag(READ_POLL_TAG));
+    poll->poll32_events = POLLIN;
+    poll->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+    io_uring_sqe* read = prepare(IORING_OP_READ_FIXED, _fd, tag(READ_TAG));
+    read->addr = reinterpret_cast<uint64_t>(_buffer.get());
+    read->len = _buffer_size;
+    read->off = uint64_t(-1); /* Current position, the fd is not seekable */
+    read->buf_index = 0;
+    _read_armed = true;
+  }
+
+  int submitted;
+  do
+  {
+    submitted = enter(_ring_fd, _to_submit, 1, IORING_ENTER_GETEVENTS);
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted < 0) throw InotifyError("Failed to wait for io_uring completions");
+  _to_submit -= submitted;
+
+  /* Take the completions off the queue before dispatching them, handlers may switch the fd */
+  io_uring_cqe completions[2 * URING_ENTRIES];
+  size_t completion_cnt = 0;
+  unsigned head = *_cq_head;
+  const unsigned tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail && completion_cnt < 2 * URING_ENTRIES) completions[completion_cnt++] = _cqes[head++ & _cq_mask];
+  __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+
+  for (size_t i = 0; i < completion_cnt; ++i)
+  {
+    const io_uring_cqe& cqe = completions[i];
+    switch (cqe.user_data & 0xff)
+    {
+      case READ_TAG:
+        if (cqe.user_data != tag(READ_TAG)) break; /* Of an fd that was switched */
+        _read_armed = false;
+        handler(Completion::Read, cqe.res);
+        break;
+      case STOP_TAG:
+        _stop_armed = false;
+        handler(Completion::Stop, cqe.res);
+        break;
+      case READY_TAG:
+        _poll_armed = false;
+        handler(Completion::Ready, cqe.res);
+        break;
+      default:
+        break; /* A failed link poll; its read completes with -ECANCELED */
+    }
+  }
+}
+
+}  // namespace inotify
@@ -0,0 +1,366 @@
+#include "include/WatchCache.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace inotify {
+
+/**
+ * Interns a name and adds a reference to it.
+ * @param name The name to intern.
+ * @return The id of the interned name.
+ */
+uint32_t NamePool::intern(std::string_view name)
+{
+  auto it = _ids.find(name);
+  if (it != _ids.end())
+  {
+    _entries[it->second].refcount++;
+    return it->second;
+  }
+
+  uint32_t id;
+  if (_free_ids.empty())
+  {
+    id = _entries.size();
+    _entries.push_back(Entry{std::pmr::string(name, &_pool), 1});
+  }
+  else
+  {
+    id = _free_ids.back();
+    _free_ids.pop_back();
+    _entries[id] = Entry{std::pmr::string(name, &_pool), 1};
+  }
+
+  _ids.emplace(_entries[id].name, id);
+  return id;
+}
+
+/**
+ * Drops a reference to an interned name, releasing the name when it is no longer referenced.
+ * @param id The id of the interned name.
+ */
+void NamePool::release(uint32_t id)
+{
+  Entry& entry = _entries[id];
+  if (--entry.refcount > 0) return;
+
+  _ids.erase(entry.name);
+  entry.name.clear();
+  entry.name.shrink_to_fit(); /* Back to the pool, for the next name of the size */
+  _free_ids.push_back(id);
+}
+
+/**
+ * Looks up the id of a name without adding a reference.
+ * @param name The name to look up.
+ * @return The id of the name, or -1 if the name is not interned.
+ */
+int32_t NamePool::lookup(std::string_view name) const
+{
+  auto it = _ids.find(name);
+  return it == _ids.end() ? -1 : int32_t(it->second);
+}
+
+void NamePool::clear()
+{
+  _ids.clear();
+  _free_ids.clear();
+  _entries.clear();
+}
+
+/**
+ * Adds a watched directory to the cache and links it under its parent directory, if the parent is watched.
+ * Directories without a watched parent become roots.
+ * @param wd The watch descriptor of the directory.
+ * @param path The absolute path of the directory.
+ * @return True if the node was inserted, false if the watch descriptor was already cached.
+ */
+bool WatchCache::insert(int wd, const std::filesystem::path& path)
+{
+  auto [it, inserted] = _nodes.try_emplace(wd, Node{-1, 0, -1, -1, -1, 0, 0, 0});
+  if (!inserted) return false;
+
+  attach(wd, it->second, path);
+  return true;
+}
+
+/**
+ * Removes a single node from the cache. Its children stay cached and become roots.
+ * @param wd The watch descriptor to remove.
+ */
+void WatchCache::erase(int wd)
+{
+  auto it = _nodes.find(wd);
+  if (it == _nodes.end()) return;
+
+  /* Children lose their parent, so they have to remember their full path from now on; they are linked as roots
+   * directly, a lookup of their parent directory would still find the node that is being erased */
+  while (it->second.first_child != -1)
+  {
+    int child = it->second.first_child;
+    Node& node = _nodes.at(child);
+    std::filesystem::path child_path = path(child);
+    detach(child, node);
+    attach(child, node, child_path, true);
+  }
+
+  detach(wd, it->second);
+  _nodes.erase(it);
+}
+
+/**
+ * Removes all nodes from the cache.
+ */
+void WatchCache::clear()
+{
+  _nodes.clear();
+  _child_index.clear();
+  _roots.clear();
+  _names.clear();
+}
+
+/**
+ * Looks up the watch descriptor of a path by descending from the root that contains it.
+ * @param path The absolute path of the directory.
+ * @return The watch descriptor of the path, or -1 if the path is not cached.
+ */
+int WatchCache::find(const std::filesystem::path& path) const
+{
+  const std::string_view target = path.native();
+
+  for (int root : _roots)
+  {
+    const std::string_view root_path = _names.name(_nodes.at(root).name);
+    if (target.compare(0, root_path.size(), root_path) != 0) continue;
+    if (target.size() > root_path.size() && target[root_path.size()] != std::filesystem::path::preferred_separator &&
+        root_path.back() != std::filesystem::path::preferred_separator)
+      continue;
+
+    /* Walk down the remaining components */
+    int wd = root;
+    size_t pos = root_path.size();
+    while (wd != -1 && pos < target.size())
+    {
+      if (target[pos] == std::filesystem::path::preferred_separator)
+      {
+        pos++;
+        continue;
+      }
+
+      size_t end = target.find(std::filesystem::path::preferred_separator, pos);
+      if (end == std::string_view::npos) end = target.size();
+      wd = findChild(wd, target.substr(pos, end - pos));
+      pos = end;
+    }
+
+    if (wd != -1) return wd;
+  }
+
+  return -1;
+}
+
+bool WatchCache::contains(int wd) const { return _nodes.count(wd) != 0; }
+
+/**
+ * Builds the full path of a watch descriptor from its ancestors.
+ * @param wd The watch descriptor.
+ * @return The absolute path of the directory.
+ * @throws std::out_of_range if the watch descriptor is not cached.
+ */
+std::filesystem::path WatchCache::path(int wd) const
+{
+  std::string result(pathSize(wd, {}), '\0');
+  writePath(wd, {}, result.data() + result.size());
+  return std::filesystem::path(std::move(result));
+}
+
+/**
+ * Builds the path of an entry of a watched directory in an arena, without any heap allocation of its own.
+ * @param wd The watch descriptor of the directory.
+ * @param name The name of the entry, or empty for the path of the directory itself.
+ * @param arena The arena to build the path in.
+ * @return The absolute path of the entry, valid until the arena is reset.
+ * @throws std::out_of_range if the watch descriptor is not cached.
+ */
+std::string_view WatchCache::path(int wd, std::string_view name, Arena& arena) const
+{
+  const size_t size = pathSize(wd, name);
+  char* data = arena.allocate(size);
+  writePath(wd, name, data + size);
+  return {data, size};
+}
+
+/**
+ * Collects the node and all of its descendants. Children are always listed before their parents, so the result can be
+ * used to tear down a subtree bottom-up.
+ * @param wd The watch descriptor of the subtree root.
+ * @return The watch descriptors of the subtree, or an empty list if the watch descriptor is not cached.
+ */
+std::vector<int> WatchCache::subtree(int wd) const
+{
+  std::vector<int> result;
+  if (!contains(wd)) return result;
+
+  result.push_back(wd);
+  for (size_t i = 0; i < result.size(); ++i)
+  {
+    for (int child = _nodes.at(result[i]).first_child; child != -1; child = _nodes.at(child).next_sibling)
+      result.push_back(child);
+  }
+
+  /* Breadth-first order lists parents first; reverse it so that children come first */
+  std::reverse(result.begin(), result.end());
+  return result;
+}
+
+/**
+ * Lists all cached watch descriptors.
+ */
+std::vector<int> WatchCache::descriptors() const
+{
+  std::vector<int> result;
+  result.reserve(_nodes.size());
+  for (const auto& [wd, node] : _nodes) result.push_back(wd);
+  return result;
+}
+
+/**
+ * The directory of the given watch descriptor was renamed to the given path.
+ * Only the renamed node is moved under its new parent; descendants keep referring to it.
+ * @param wd The watch descriptor of the renamed directory.
+ * @param path The new absolute path of the directory.
+ * @return The number of nodes that were rewritten.
+ */
+int WatchCache::rename(int wd, const std::filesystem::path& path)
+{
+  auto it = _nodes.find(wd);
+  if (it == _nodes.end()) return 0;
+
+  detach(wd, it->second);
+  attach(wd, it->second, path);
+  return 1;
+}
+
+/**
+ * Lists the watched subdirectories of a watch descriptor.
+ */
+std::vector<int> WatchCache::children(int wd) const
+{
+  std::vector<int> result;
+  for (int child = _nodes.at(wd).first_child; child != -1; child = _nodes.at(child).next_sibling)
+    result.push_back(child);
+  return result;
+}
+
+std::string_view WatchCache::name(int wd) const { return _names.name(_nodes.at(wd).name); }
+
+void WatchCache::setStat(int wd, uint64_t inode, int64_t mtime)
+{
+  Node& node = _nodes.at(wd);
+  node.inode = inode;
+  node.mtime = mtime;
+}
+
+void WatchCache::setMask(int wd, uint32_t mask) { _nodes.at(wd).mask = mask; }
+
+int WatchCache::findChild(int parent, std::string_view name) const
+{
+  int32_t id = _names.lookup(name);
+  if (id == -1) return -1;
+
+  auto it = _child_index.find(childKey(parent, id));
+  return it == _child_index.end() ? -1 : it->second;
+}
+
+/* The components are joined like std::filesystem::path does it: with a separator, unless a root ends with one */
+size_t WatchCache::pathSize(int wd, std::string_view name) const
+{
+  size_t size = name.size();
+  bool tail = !name.empty();
+  for (int node = wd; node != -1; node = _nodes.at(node).parent)
+  {
+    const std::string_view component = _names.name(_nodes.at(node).name);
+    size += component.size() + (tail && component.back() != std::filesystem::path::preferred_separator);
+    tail = true;
+  }
+  return size;
+}
+
+void WatchCache::writePath(int wd, std::string_view name, char* end) const
+{
+  auto prepend = [&end](std::string_view text) {
+    end -= text.size();
+    if (!text.empty()) std::memcpy(end, text.data(), text.size()); /* An empty name may have no storage at all */
+  };
+
+  prepend(name);
+  bool tail = !name.empty();
+  for (int node = wd; node != -1; node = _nodes.at(node).parent)
+  {
+    const std::string_view component = _names.name(_nodes.at(node).name);
+    if (tail && component.back() != std::filesystem::path::preferred_separator) *--end = '/';
+    prepend(component);
+    tail = true;
+  }
+}
+
+void WatchCache::attach(int wd, Node& node, const std::filesystem::path& path, bool root)
+{
+  int parent = root ? -1 : find(path.parent_path());
+  if (parent == wd) parent = -1;
+
+  const std::filesystem::path filename = path.filename();
+  std::string_view name = filename.native();
+  if (parent == -1)
+  {
+    /* Roots are stored by their full path, without trailing separators so that lookups of children match */
+    name = path.native();
+    while (name.size() > 1 && name.back() == std::filesystem::path::preferred_separator) name.remove_suffix(1);
+  }
+
+  node.parent = parent;
+  node.name = _names.intern(name);
+  node.prev_sibling = -1;
+  node.next_sibling = -1;
+
+  if (parent == -1)
+  {
+    _roots.push_back(wd);
+  }
+  else
+  {
+    Node& parent_node = _nodes.at(parent);
+    node.next_sibling = parent_node.first_child;
+    if (parent_node.first_child != -1) _nodes.at(parent_node.first_child).prev_sibling = wd;
+    parent_node.first_child = wd;
+  }
+
+  _child_index[childKey(parent, node.name)] = wd;
+}
+
+void WatchCache::detach(int wd, Node& node)
+{
+  auto indexed = _child_index.find(childKey(node.parent, node.name));
+  if (indexed != _child_index.end() && indexed->second == wd) _child_index.erase(indexed);
+
+  if (node.parent == -1)
+  {
+    _roots.erase(std::remove(_roots.begin(), _roots.end(), wd), _roots.end());
+  }
+  else
+  {
+    if (node.prev_sibling != -1)
+      _nodes.at(node.prev_sibling).next_sibling = node.next_sibling;
+    else
+      _nodes.at(node.parent).first_child = node.next_sibling;
+    if (node.next_sibling != -1) _nodes.at(node.next_sibling).prev_sibling = node.prev_sibling;
+  }
+
+  _names.release(node.name);
+  node.parent = -1;
+  node.prev_sibling = -1;
+  node.next_sibling = -1;
+}
+
+}  // namespace inotify
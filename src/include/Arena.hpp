@@ -0,0 +1,44 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#define ARENA_CHUNK_SIZE (64 * 1024) /* Size of the first chunk of an arena */
+
+namespace inotify {
+
+/**
+ * Bump allocator for short-lived strings, e.g. the paths of the events of one read. Allocating is a pointer increment
+ * within a chunk and nothing is freed on its own; reset() drops all allocations at once. When a reset finds that more
+ * than one chunk was needed, the chunks are merged into one of their total size, so the arena settles at the size of
+ * the peak load and a steady load runs without touching the heap.
+ */
+class Arena
+{
+ public:
+  explicit Arena(size_t chunk_size = ARENA_CHUNK_SIZE);
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  char* allocate(size_t size);                  /* Uninitialized storage, valid until reset() */
+  std::string_view copy(std::string_view text); /* Copy of a string, valid until reset() */
+  void reset();                                 /* Drop all allocations, keeping the memory */
+  size_t capacity() const;                      /* Bytes held by the chunks */
+
+ private:
+  struct Chunk {
+    std::unique_ptr<char[]> data; /* Storage of the chunk */
+    size_t size;                  /* Capacity of the chunk */
+  };
+
+  std::vector<Chunk> _chunks; /* Chunks in the order they were allocated, the last one is bumped */
+  size_t _used;               /* Bytes used of the last chunk */
+};
+
+}  // namespace inotify
+
+#endif  // ARENA_HPP
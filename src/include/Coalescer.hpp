@@ -0,0 +1,55 @@
+#ifndef COALESCER_HPP
+#define COALESCER_HPP
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <string_view>
+#include <string>
+#include <unordered_map>
+
+#include "FileEvent.hpp"
+
+namespace inotify {
+
+/**
+ * Merges bursts of file events before they are processed.
+ * Repeated IN_MODIFY and IN_CLOSE_WRITE events of the same file within the window are folded into one event, and a
+ * file that was created within the window is reported once as created, however often it was written afterwards.
+ * Held events are owned copies, since they outlive the read buffer they were decoded from.
+ */
+class Coalescer
+{
+ public:
+  using Clock = std::chrono::steady_clock;
+  using Callback = std::function<void(const FileEventView& event)>;
+
+  explicit Coalescer(std::chrono::nanoseconds window);
+
+  bool add(const FileEventView& event, Clock::time_point now); /* Hold the event back, returns false if it can't be */
+  void flush(int wd, std::string_view name, const Callback& callback); /* Release the held event of one file */
+  void flushExpired(Clock::time_point now, const Callback& callback);  /* Release the events whose window passed */
+  void flushAll(const Callback& callback);                             /* Release all held events */
+
+  bool empty() const { return _pending.empty(); }
+  Clock::time_point nextDeadline() const { return _pending.front().deadline; } /* Requires a held event */
+
+ private:
+  struct Pending {
+    FileEvent event;            /* Folded event; IN_CREATE if the file was created in the window */
+    Clock::time_point deadline; /* When the event is released */
+    std::string key;            /* Key of the event in _index */
+  };
+
+  const std::string& makeKey(int wd, std::string_view name); /* Builds the key in a reused scratch string */
+
+ private:
+  const std::chrono::nanoseconds _window;                               /* How long events are held back */
+  std::list<Pending> _pending;                                          /* Held events, ordered by deadline */
+  std::unordered_map<std::string, std::list<Pending>::iterator> _index; /* Held event per (wd, name) */
+  std::string _scratch;                                                 /* Reused key buffer for lookups */
+};
+
+}  // namespace inotify
+
+#endif  // COALESCER_HPP
@@ -0,0 +1,106 @@
+#ifndef CONTENT_VERIFIER_HPP
+#define CONTENT_VERIFIER_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#define VERIFY_READ_LEN (256 * 1024) /* Size of the reads the contents of a file are hashed in */
+
+namespace inotify {
+
+/**
+ * Checks whether modified files really changed, so that tools that rewrite identical bytes don't trigger downstream
+ * work. The size, modification time and inode of every modified file are recorded together with an XXH64 hash of its
+ * contents. A modify whose metadata is unchanged is dropped without reading the file; otherwise the file is hashed
+ * again on a worker thread and the modify is only reported if the size or the hash differ.
+ *
+ * Modification times are coarse, so a file that was written in the same second as its state was recorded may be
+ * written again without a visible change of its metadata. Such a racy state, like a racy entry of the git index, is
+ * never trusted: the next modify of the file is hashed even if its size, modification time and inode are unchanged.
+ *
+ * A file is only hashed once it was modified: the first modify of a file is reported right away, and its hash becomes
+ * the baseline of the next one. Apart from the workers, all methods have to be called from the same thread.
+ */
+class ContentVerifier
+{
+ public:
+  using Notify = std::function<void()>;                        /* Called by a worker when results are ready */
+  using Callback = std::function<void(std::string_view path)>; /* Called for a file whose modify is reported */
+  using Verdict = std::function<void(std::string_view path, bool changed)>; /* Called for a verified modify */
+
+  ContentVerifier(size_t workers, Notify notify);
+  ~ContentVerifier();
+
+  ContentVerifier(const ContentVerifier&) = delete;
+  ContentVerifier& operator=(const ContentVerifier&) = delete;
+
+  bool check(std::string_view path);  /* Verify a modify; returns true if it has to be reported right away */
+  bool forget(std::string_view path); /* Drop a file, returns true if its modify was still being verified */
+  void forgetUnder(std::string_view dir, const Callback& pending); /* Drop the files below a directory */
+  uint64_t collect(const Verdict& verdict); /* Apply the finished verifications, returns the bytes they hashed */
+  uint64_t finish(const Verdict& verdict);  /* Wait for and apply all verifications in flight */
+
+ private:
+  /* What is known about the contents of a file */
+  struct State {
+    uint64_t size;  /* Size in bytes */
+    int64_t mtime;  /* Modification time in nanoseconds */
+    uint64_t inode; /* Inode number, changes if the file was replaced */
+    uint64_t hash;  /* XXH64 of the contents */
+    int64_t stated; /* Wall clock time the metadata was read at, in nanoseconds */
+  };
+
+  struct Entry {
+    State state;  /* Last verified state, if known */
+    uint64_t job; /* Id of the verification in flight, 0 if there is none */
+    bool known;   /* The state was recorded */
+    bool report;  /* The verification in flight decides whether the modify is reported */
+    bool again;   /* Modified again while the verification was in flight */
+  };
+
+  struct Job {
+    std::string path; /* The file to verify */
+    uint64_t id;      /* Matches the result to its entry */
+    State previous;   /* Recorded state, if known */
+    bool known;       /* A state was recorded, i.e. the file is compared against it */
+  };
+
+  struct Result {
+    std::string path; /* The verified file */
+    uint64_t id;      /* Id of the job */
+    State state;      /* Current state, if valid */
+    bool valid;       /* The file could be stat'ed and read as a whole */
+    bool changed;     /* The contents differ from the recorded state, or could not be compared */
+    uint64_t bytes;   /* Bytes read for hashing */
+  };
+
+  bool start(const std::string& path, Entry& entry); /* Queue a verification, true if the modify isn't compared */
+  void workerLoop();                                 /* Verifies queued files until the verifier is destroyed */
+  static Result verify(const Job& job, std::vector<char>& buffer); /* Compare a file against its recorded state */
+
+ private:
+  Notify _notify;                                /* Wakes up the owner for collect() */
+  std::unordered_map<std::string, Entry> _files; /* Recorded files, by path; owner thread only */
+  uint64_t _next_job;                            /* Id of the next verification */
+  size_t _in_flight;                             /* Verifications queued and not collected yet */
+
+  std::mutex _mutex;                 /* Guards the queues */
+  std::condition_variable _wakeup;   /* Signals queued jobs, or shutdown, to the workers */
+  std::condition_variable _finished; /* Signals finished verifications to finish() */
+  std::deque<Job> _jobs;             /* Verifications waiting for a worker */
+  std::vector<Result> _results;      /* Finished verifications waiting for collect() */
+  bool _stopping;                    /* Set when the verifier is destroyed */
+  std::vector<std::thread> _workers; /* Hash the files */
+};
+
+}  // namespace inotify
+
+#endif  // CONTENT_VERIFIER_HPP
@@ -0,0 +1,57 @@
+#ifndef CONTROL_CHANNEL_HPP
+#define CONTROL_CHANNEL_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+
+#include "Reactor.hpp"
+
+namespace inotify {
+
+/* What a watcher process is asked to do */
+enum class Command : uint8_t {
+  Stop,       /* Shut down; SIGINT and SIGTERM */
+  Reload,     /* Reload the configuration; SIGHUP */
+  DumpMetrics /* Write the runtime metrics; SIGUSR1 */
+};
+
+/**
+ * Delivers process signals and commands from other threads to the event loop of a watcher, so that they are handled
+ * on the loop thread as soon as they arrive, without a thread that polls for them. Signals are read from a signalfd,
+ * commands are posted through an eventfd; both are serviced by the epoll_wait of the reactor the channel is attached
+ * to.
+ *
+ * The constructor blocks SIGINT, SIGTERM, SIGHUP and SIGUSR1 in the calling thread, so that they are only delivered
+ * through the signalfd. Threads inherit the signal mask, so construct the channel before any other thread is started.
+ */
+class ControlChannel
+{
+ public:
+  using Handler = std::function<void(Command command)>; /* Called on the loop thread for every command */
+
+  explicit ControlChannel(Handler handler);
+  ~ControlChannel();
+
+  ControlChannel(const ControlChannel&) = delete;
+  ControlChannel& operator=(const ControlChannel&) = delete;
+
+  void attach(Reactor& reactor); /* Service the channel on the loop of the reactor */
+  void detach();                 /* Stop servicing the channel, e.g. before the reactor is destroyed */
+  void post(Command command);    /* Queue a command; safe to call from any thread */
+
+ private:
+  void readSignals();  /* Translate the pending signals into commands */
+  void readCommands(); /* Dispatch the posted commands */
+
+ private:
+  Handler _handler;                /* Consumer of the commands */
+  Reactor* _reactor;               /* Loop the channel is attached to, or null */
+  int _signal_fd;                  /* Signalfd for the blocked signals */
+  int _command_fd;                 /* Eventfd, signals posted commands */
+  std::atomic<uint32_t> _commands; /* Bit per posted command that was not dispatched yet */
+};
+
+}  // namespace inotify
+
+#endif  // CONTROL_CHANNEL_HPP
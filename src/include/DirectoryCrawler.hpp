@@ -0,0 +1,70 @@
+#ifndef DIRECTORY_CRAWLER_HPP
+#define DIRECTORY_CRAWLER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace inotify {
+
+/**
+ * Parallel directory tree crawler.
+ * A pool of workers enumerates directories with getdents64, using d_type to recognize subdirectories without a stat
+ * per entry, and balances the work by stealing from each other's queues. Every discovered directory is handed to a
+ * visitor on the calling thread, parents always before their children, so the visitor can register the directory
+ * (e.g. with inotify_add_watch) from a single thread.
+ */
+class DirectoryCrawler
+{
+ public:
+  using Filter = std::function<bool(const std::filesystem::path& parent, const std::string& name)>; /* True to skip */
+  using Visitor = std::function<bool(const std::filesystem::path& path)>; /* Returns false to abort the crawl */
+  using Progress = std::function<void(size_t directories)>;              /* Periodic progress report */
+
+  struct Stats {
+    size_t directories;                /* Number of directories handed to the visitor */
+    std::chrono::microseconds elapsed; /* Wall time of the crawl */
+    bool aborted;                      /* Whether the visitor aborted the crawl */
+  };
+
+  DirectoryCrawler(size_t workers, Filter filter);
+
+  Stats crawl(const std::filesystem::path& root, const Visitor& visit, const Progress& progress = nullptr);
+
+ private:
+  struct WorkQueue {
+    std::mutex mutex;
+    std::deque<std::filesystem::path> dirs;
+  };
+
+  void workerLoop(size_t index);                                  /* Enumerates directories until the crawl is done */
+  bool takeWork(size_t index, std::filesystem::path& dir);        /* Pops local work or steals from another worker */
+  void enumerate(size_t index, const std::filesystem::path& dir); /* Lists the subdirectories of a directory */
+  void emit(const std::filesystem::path& dir);                    /* Hands a directory to the visitor thread */
+  void wakeIdle();                                                /* Wakes the workers that wait for work */
+
+ private:
+  const size_t _worker_cnt;                        /* Number of worker threads */
+  const Filter _filter;                            /* Skips ignored directories */
+  std::vector<std::unique_ptr<WorkQueue>> _queues; /* One work queue per worker */
+  std::atomic<size_t> _pending;                    /* Directories queued or being enumerated */
+  std::atomic<size_t> _queued;                     /* Directories waiting in the queues, to be taken */
+  std::mutex _idle_mutex;                          /* Guards the wakeups of idle workers */
+  std::condition_variable _idle_cv;                /* Signals queued work or the end of the crawl to idle workers */
+  std::atomic<bool> _aborted;                      /* Set when the visitor aborts the crawl */
+  std::mutex _output_mutex;                        /* Guards _output */
+  std::condition_variable _output_cv;              /* Signals new output or the end of the crawl */
+  std::vector<std::filesystem::path> _output;      /* Discovered directories not yet visited */
+};
+
+}  // namespace inotify
+
+#endif  // DIRECTORY_CRAWLER_HPP
@@ -0,0 +1,38 @@
+#ifndef EVENT_HPP
+#define EVENT_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+
+#include "Logger.hpp"
+
+namespace inotify {
+
+/* What happened to a file or directory */
+enum class EventType : uint8_t {
+  Create,  /* Created, or moved into the watched tree */
+  Delete,  /* Deleted */
+  Modify,  /* Contents were modified */
+  Move,    /* Renamed or moved within the watched tree */
+  MoveOut, /* Moved out of the watched tree */
+  Rescan   /* Events for the entries of the directory were lost; its contents have to be rescanned */
+};
+
+/**
+ * A resolved filesystem event, as delivered to consumers of the watcher.
+ */
+struct Event {
+  EventType type;                             /* What happened */
+  bool is_dir;                                /* Whether the event is about a directory */
+  std::filesystem::path path;                 /* Path the event is about; the new path of a move */
+  std::filesystem::path old_path;             /* Previous path of a move, empty otherwise */
+  uint32_t cookie;                            /* Kernel cookie of a move half, 0 if the event is not a move */
+  std::chrono::steady_clock::time_point time; /* When the event was read from the kernel */
+};
+
+void logEvent(Logger& logger, const Event& event); /* Write the event as a human readable line */
+
+}  // namespace inotify
+
+#endif  // EVENT_HPP
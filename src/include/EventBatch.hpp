@@ -0,0 +1,63 @@
+#ifndef EVENT_BATCH_HPP
+#define EVENT_BATCH_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "Event.hpp"
+
+namespace inotify {
+
+/**
+ * The events that resulted from one read of the kernel queue, in a contiguous array. The paths of all entries are
+ * stored back to back in a single string arena and referenced by offset, so a batch costs two allocations at most and
+ * they are reused from batch to batch.
+ */
+class EventBatch
+{
+ public:
+  struct Entry {
+    EventType type;                             /* What happened */
+    bool is_dir;                                /* Whether the event is about a directory */
+    uint32_t cookie;                            /* Kernel cookie of a move half, 0 if the event is not a move */
+    uint32_t path_offset;                       /* Offset of the path in the arena */
+    uint32_t path_size;                         /* Size of the path */
+    uint32_t old_path_offset;                   /* Offset of the previous path of a move in the arena */
+    uint32_t old_path_size;                     /* Size of the previous path, 0 if the event is not a move */
+    std::chrono::steady_clock::time_point time; /* When the event was read from the kernel */
+  };
+
+  void add(EventType type,
+      bool is_dir,
+      std::string_view path,
+      std::string_view old_path,
+      uint32_t cookie,
+      std::chrono::steady_clock::time_point time); /* Append an event */
+  void add(const Event& event);                     /* Append an event */
+  void clear();                                     /* Remove all events, keeping the memory */
+
+  std::string_view path(const Entry& entry) const { return {_arena.data() + entry.path_offset, entry.path_size}; }
+  std::string_view oldPath(const Entry& entry) const
+  {
+    return {_arena.data() + entry.old_path_offset, entry.old_path_size};
+  }
+  Event event(size_t index) const; /* Copy of an entry as a standalone event */
+
+  const std::vector<Entry>& entries() const { return _entries; }
+  std::vector<Entry>::const_iterator begin() const { return _entries.begin(); }
+  std::vector<Entry>::const_iterator end() const { return _entries.end(); }
+  const Entry& operator[](size_t index) const { return _entries[index]; }
+  size_t size() const { return _entries.size(); }
+  bool empty() const { return _entries.empty(); }
+
+ private:
+  std::vector<Entry> _entries; /* The events, in the order they happened */
+  std::string _arena;          /* Paths of all entries */
+};
+
+}  // namespace inotify
+
+#endif  // EVENT_BATCH_HPP
@@ -0,0 +1,53 @@
+#ifndef EVENT_HANDLER_HPP
+#define EVENT_HANDLER_HPP
+
+#include <cstdint>
+
+#include "Event.hpp"
+#include "EventBatch.hpp"
+#include "Logger.hpp"
+
+namespace inotify {
+
+/**
+ * Receives the events of a watcher in-process. Override the callbacks of the events of interest; the others ignore
+ * their events. Consumers that prefer bursts override onBatch() instead, which receives all events of one read at
+ * once. The callbacks run on the thread of the watcher and should return quickly, since the watcher does not read
+ * further events in the meantime.
+ */
+class EventHandler
+{
+ public:
+  virtual ~EventHandler() = default;
+
+  virtual void onBatch(const EventBatch& batch); /* Dispatches every event of the batch to onEvent() */
+  virtual void onEvent(const Event& event);      /* Dispatches the event to the callback of its type */
+
+  virtual void onCreate(const Event&) {}  /* A file or directory was created, or moved into the tree */
+  virtual void onDelete(const Event&) {}  /* A file or directory was deleted */
+  virtual void onModify(const Event&) {}  /* The contents of a file were modified */
+  virtual void onMove(const Event&) {}    /* A file or directory was renamed or moved within the tree */
+  virtual void onMoveOut(const Event&) {} /* A file or directory was moved out of the tree */
+  virtual void onRescan(const Event&) {}  /* Events of a directory were lost and its contents have to be rescanned */
+
+  virtual uint64_t dropped() const { return 0; } /* Events the handler lost, e.g. lines of a full async log */
+};
+
+/**
+ * Writes every event as a human readable line, as the command line tool does.
+ */
+class LoggingHandler : public EventHandler
+{
+ public:
+  explicit LoggingHandler(Logger::Mode mode = Logger::Mode::Sync);
+
+  void onEvent(const Event& event) override;
+  uint64_t dropped() const override { return _logger.dropped(); }
+
+ private:
+  Logger _logger; /* For logging events */
+};
+
+}  // namespace inotify
+
+#endif  // EVENT_HANDLER_HPP
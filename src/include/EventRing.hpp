@@ -0,0 +1,53 @@
+#ifndef EVENT_RING_HPP
+#define EVENT_RING_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace inotify {
+
+/**
+ * Fixed-capacity single-producer/single-consumer ring of read buffers. All buffers are allocated up front; the
+ * producer fills the free slot at the head and publishes it, the consumer processes the slot at the tail in place and
+ * releases it. Neither side locks or allocates.
+ */
+class EventRing
+{
+ public:
+  struct Slot {
+    std::unique_ptr<uint8_t[]> data;            /* Buffer of slot_size bytes */
+    size_t length;                              /* Number of bytes filled in */
+    std::chrono::steady_clock::time_point time; /* When the buffer was filled */
+  };
+
+  EventRing(size_t capacity, size_t slot_size);
+
+  /* Producer side */
+  Slot* acquire(); /* Free slot to fill, or nullptr if the ring is full */
+  void publish();  /* Hand the acquired slot to the consumer */
+  size_t maxOccupancy() const { return _max_occupancy.load(std::memory_order_relaxed); }
+
+  /* Consumer side */
+  Slot* front(); /* Oldest published slot, or nullptr if the ring is empty */
+  void pop();    /* Release the front slot to the producer */
+  void clear();  /* Drop all published slots; only while the producer is stopped */
+
+  size_t size() const; /* Number of published slots */
+  size_t capacity() const { return _slots.size(); }
+  size_t slotSize() const { return _slot_size; }
+
+ private:
+  std::vector<Slot> _slots;              /* Preallocated buffers */
+  const size_t _slot_size;               /* Size of every buffer */
+  alignas(64) std::atomic<size_t> _head; /* Count of published slots, written by the producer */
+  std::atomic<size_t> _max_occupancy;    /* Highest number of published slots seen by the producer */
+  alignas(64) std::atomic<size_t> _tail; /* Count of released slots, written by the consumer */
+};
+
+}  // namespace inotify
+
+#endif  // EVENT_RING_HPP
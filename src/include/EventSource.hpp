@@ -0,0 +1,56 @@
+#ifndef EVENT_SOURCE_HPP
+#define EVENT_SOURCE_HPP
+
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace inotify {
+
+/**
+ * Where an Inotify instance reads its inotify_event records from, instead of the inotify fd. Recorded or synthetic
+ * streams are replayed through a source with Inotify::replay(), so the processing of the events can be profiled and
+ * checked without the kernel queue, and without the noise of the filesystem activity that fills it.
+ */
+class EventSource
+{
+ public:
+  virtual ~EventSource() = default;
+
+  /* Copies queued records into the buffer like read(2) on the inotify fd; returns 0 once none are left */
+  virtual ssize_t read(uint8_t* buffer, size_t size) = 0;
+  virtual size_t pending() const = 0; /* Bytes still queued, like FIONREAD */
+};
+
+/**
+ * Replays a byte stream of inotify_event records as the kernel would hand it out: every read returns as many whole
+ * records as fit into the buffer. The stream is taken as is, e.g. from a file written with InotifyOptions::record_file
+ * or from a fuzzer; a truncated record at its end, or one larger than the buffer, is handed out in raw bytes and
+ * dropped by the decoder.
+ *
+ * A recording only makes sense against a tree in the state it was recorded in: the watch descriptors of the records
+ * are those of the crawl that preceded them, which a fresh instance on the same tree repeats.
+ */
+class ReplaySource : public EventSource
+{
+ public:
+  explicit ReplaySource(std::vector<uint8_t> events);
+  ReplaySource(const uint8_t* data, size_t size);
+  static ReplaySource fromFile(const std::filesystem::path& path); /* Load a recording */
+
+  ssize_t read(uint8_t* buffer, size_t size) override;
+  size_t pending() const override { return _events.size() - _offset; }
+  void rewind() { _offset = 0; } /* Replay the stream again from its start */
+
+ private:
+  std::vector<uint8_t> _events; /* The whole stream */
+  size_t _offset;               /* Start of the records that were not read yet */
+};
+
+}  // namespace inotify
+
+#endif  // EVENT_SOURCE_HPP
@@ -0,0 +1,207 @@
+#ifndef EVENT_STREAM_HPP
+#define EVENT_STREAM_HPP
+
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+ * The binary event stream, as written by EventWriter. All integers are little-endian. The stream starts with a header:
+ *
+ *   char     magic[4]       "INEV"
+ *   uint16_t version        EVENT_STREAM_VERSION
+ *   uint16_t header_size    Size of the fixed part of every record, after its length
+ *
+ * followed by one record per event:
+ *
+ *   uint32_t length         Bytes of the record after this field
+ *   uint8_t  type           RecordType
+ *   uint8_t  flags          RECORD_DIR if the event is about a directory
+ *   uint16_t root           Index of the root the path is in, in the order the roots were given; RECORD_NO_ROOT if none
+ *   uint32_t cookie         Kernel cookie of a move, 0 otherwise
+ *   uint64_t time           Monotonic time the event was read, in nanoseconds (CLOCK_MONOTONIC)
+ *   uint32_t path_size      Size of the path
+ *   uint32_t old_path_size  Size of the previous path of a move, 0 otherwise
+ *   char     path[path_size]
+ *   char     old_path[old_path_size]
+ *
+ * Later versions only append fields, after the fixed part or after the paths, so readers skip to the end of a record by
+ * its length and to the paths by the header size. Paths are raw bytes; Linux file names need not be valid UTF-8.
+ *
+ * This header has no dependencies on the rest of the library, so consumers in other processes can include it alone.
+ */
+
+#define EVENT_STREAM_MAGIC "INEV"
+#define EVENT_STREAM_VERSION 1
+#define EVENT_STREAM_HEADER_LEN 8      /* Size of the stream header */
+#define EVENT_RECORD_HEADER_LEN 24     /* Size of the fixed part of a record in this version, after its length */
+#define EVENT_RECORD_MAX_LEN (1 << 20) /* Records are never larger; a larger length means a corrupt stream */
+
+namespace inotify {
+
+/* Type of a record, with the values of EventType */
+enum class RecordType : uint8_t {
+  Create,
+  Delete,
+  Modify,
+  Move,
+  MoveOut,
+  Rescan
+};
+
+constexpr uint8_t RECORD_DIR = 0x01;        /* Flag of a record about a directory */
+constexpr uint16_t RECORD_NO_ROOT = 0xffff; /* Root of a path that is not in any of the roots */
+
+/**
+ * One decoded record. The paths view into the buffer of the reader and are valid until the next record is read.
+ */
+struct EventRecord {
+  RecordType type;           /* What happened */
+  bool is_dir;               /* Whether the event is about a directory */
+  uint16_t root;             /* Index of the root, or RECORD_NO_ROOT */
+  uint32_t cookie;           /* Kernel cookie of a move, 0 otherwise */
+  uint64_t time;             /* Monotonic time the event was read, in nanoseconds */
+  std::string_view path;     /* Path the event is about; the new path of a move */
+  std::string_view old_path; /* Previous path of a move, empty otherwise */
+};
+
+/**
+ * Reads the binary event stream from a file descriptor, e.g. the read end of a pipe from the watcher. The records are
+ * decoded in place from large reads, so a record costs a few loads and no allocation.
+ */
+class EventStreamReader
+{
+ public:
+  explicit EventStreamReader(int fd, size_t buffer_size = 256 * 1024)
+    : _fd(fd), _buffer(buffer_size), _begin(0), _end(0), _record_header_size(0)
+  {
+  }
+
+  /**
+   * Reads the next record, blocking until it arrived.
+   * @param record The record to fill in.
+   * @return True if a record was read, false at the end of the stream.
+   * @throws std::runtime_error if the stream is corrupt, truncated or can't be read.
+   */
+  bool next(EventRecord& record)
+  {
+    if (_record_header_size == 0)
+    {
+      if (!fill(EVENT_STREAM_HEADER_LEN)) return false;
+      _record_header_size = parseHeader(_buffer.data() + _begin, _end - _begin);
+      _begin += EVENT_STREAM_HEADER_LEN;
+    }
+
+    if (!fill(sizeof(uint32_t))) return false;
+    const uint32_t length = load<uint32_t>(_buffer.data() + _begin);
+    if (length > EVENT_RECORD_MAX_LEN) throw std::runtime_error("Corrupt event stream: record too large");
+    if (!fill(sizeof(uint32_t) + length)) throw std::runtime_error("Truncated event stream");
+
+    decode(_buffer.data() + _begin, sizeof(uint32_t) + length, _record_header_size, record);
+    _begin += sizeof(uint32_t) + length;
+    return true;
+  }
+
+  /**
+   * Checks the stream header.
+   * @param data The start of the stream.
+   * @param size The bytes available, at least EVENT_STREAM_HEADER_LEN.
+   * @return The size of the fixed part of the records.
+   * @throws std::runtime_error if this is no event stream, or its records lack fields of this version.
+   */
+  static size_t parseHeader(const char* data, size_t size)
+  {
+    if (size < EVENT_STREAM_HEADER_LEN || std::memcmp(data, EVENT_STREAM_MAGIC, 4) != 0)
+      throw std::runtime_error("Not an event stream");
+    const uint16_t header_size = load<uint16_t>(data + 6);
+    if (header_size < EVENT_RECORD_HEADER_LEN) throw std::runtime_error("Unsupported event stream version");
+    return header_size;
+  }
+
+  /**
+   * Decodes a record, without reading anything.
+   * @param data The start of the record, at its length field.
+   * @param size The bytes available.
+   * @param header_size The size of the fixed part of the records, from parseHeader().
+   * @param record The record to fill in; its paths view into data.
+   * @return The size of the record, or 0 if less than a whole record is available.
+   * @throws std::runtime_error if the record is corrupt.
+   */
+  static size_t decode(const char* data, size_t size, size_t header_size, EventRecord& record)
+  {
+    if (size < sizeof(uint32_t)) return 0;
+    const uint32_t length = load<uint32_t>(data);
+    if (length > EVENT_RECORD_MAX_LEN) throw std::runtime_error("Corrupt event stream: record too large");
+    if (size - sizeof(uint32_t) < length) return 0;
+    if (length < header_size) throw std::runtime_error("Corrupt event stream: record too short");
+
+    const char* fields = data + sizeof(uint32_t);
+    const uint32_t path_size = load<uint32_t>(fields + 16);
+    const uint32_t old_path_size = load<uint32_t>(fields + 20);
+    if (uint64_t(path_size) + old_path_size > length - header_size)
+      throw std::runtime_error("Corrupt event stream: paths exceed the record");
+    if (uint8_t(fields[0]) > uint8_t(RecordType::Rescan)) throw std::runtime_error("Corrupt event stream: bad type");
+
+    record.type = RecordType(fields[0]);
+    record.is_dir = (uint8_t(fields[1]) & RECORD_DIR) != 0;
+    record.root = load<uint16_t>(fields + 2);
+    record.cookie = load<uint32_t>(fields + 4);
+    record.time = load<uint64_t>(fields + 8);
+    record.path = std::string_view(fields + header_size, path_size);
+    record.old_path = std::string_view(fields + header_size + path_size, old_path_size);
+    return sizeof(uint32_t) + length;
+  }
+
+ private:
+  /* Reads until at least the given number of bytes is buffered, false if the stream ended before any of them */
+  bool fill(size_t size)
+  {
+    if (_end - _begin >= size) return true;
+
+    /* Move the partial record to the front, and grow the buffer if the record doesn't fit */
+    std::memmove(_buffer.data(), _buffer.data() + _begin, _end - _begin);
+    _end -= _begin;
+    _begin = 0;
+    if (_buffer.size() < size) _buffer.resize(size);
+
+    while (_end < size)
+    {
+      ssize_t length = read(_fd, _buffer.data() + _end, _buffer.size() - _end);
+      if (length < 0 && errno == EINTR) continue;
+      if (length < 0) throw std::runtime_error(std::string("Failed to read the event stream: ") + std::strerror(errno));
+      if (length == 0)
+      {
+        if (_end == 0) return false;
+        throw std::runtime_error("Truncated event stream");
+      }
+      _end += length;
+    }
+    return true;
+  }
+
+  template <typename T>
+  static T load(const char* data)
+  {
+    /* Little-endian, like every Linux target the watcher runs on */
+    T value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+  }
+
+ private:
+  int _fd;                    /* Stream to read from, not owned */
+  std::vector<char> _buffer;  /* Buffered part of the stream */
+  size_t _begin;              /* Start of the unread bytes in _buffer */
+  size_t _end;                /* End of the unread bytes in _buffer */
+  size_t _record_header_size; /* Fixed part of the records, 0 until the stream header was read */
+};
+
+}  // namespace inotify
+
+#endif  // EVENT_STREAM_HPP
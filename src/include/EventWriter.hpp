@@ -0,0 +1,55 @@
+#ifndef EVENT_WRITER_HPP
+#define EVENT_WRITER_HPP
+
+#include <unistd.h>
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "EventBatch.hpp"
+#include "EventHandler.hpp"
+#include "EventStream.hpp"
+
+namespace inotify {
+
+/**
+ * Writes the events in a machine readable format, for consumers in other processes: the length-prefixed binary stream
+ * described in EventStream.hpp, or one JSON object per line. Every batch is encoded into one buffer and written with a
+ * single write, so formatting costs a few copies per event and nothing has to be parsed out of text.
+ */
+class EventWriter : public EventHandler
+{
+ public:
+  enum class Format {
+    Binary, /* Length-prefixed records, read with EventStreamReader */
+    Json    /* Newline-delimited JSON objects */
+  };
+
+  EventWriter(Format format, const std::vector<std::filesystem::path>& roots, int fd = STDOUT_FILENO);
+
+  void onBatch(const EventBatch& batch) override;
+  void onEvent(const Event& event) override;
+
+ private:
+  void encode(EventType type,
+      bool is_dir,
+      std::string_view path,
+      std::string_view old_path,
+      uint32_t cookie,
+      std::chrono::steady_clock::time_point time); /* Append an event to the buffer */
+  uint16_t rootOf(std::string_view path) const;    /* Index of the root that contains the path */
+  void flush();                                    /* Write the buffer out */
+
+ private:
+  const Format _format;            /* How the events are encoded */
+  const int _fd;                   /* Output, not owned */
+  std::vector<std::string> _roots; /* Root paths, indexed by root id */
+  std::string _buffer;             /* Encoded events that were not written yet */
+};
+
+}  // namespace inotify
+
+#endif  // EVENT_WRITER_HPP
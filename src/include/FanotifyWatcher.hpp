@@ -0,0 +1,92 @@
+#ifndef FANOTIFY_WATCHER_HPP
+#define FANOTIFY_WATCHER_HPP
+
+#include <sys/fanotify.h>
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ControlChannel.hpp"
+#include "Event.hpp"
+#include "EventHandler.hpp"
+#include "IgnoreMatcher.hpp"
+#include "InotifyOptions.hpp"
+#include "Logger.hpp"
+#include "Metrics.hpp"
+#include "ReadBuffer.hpp"
+#include "Reactor.hpp"
+#include "Watcher.hpp"
+
+#define FANOTIFY_BUFFER_MIN (4 * 1024)    /* Smallest read buffer, holds the largest event with two names */
+#define FANOTIFY_BUFFER_MAX (1024 * 1024) /* Largest read buffer, what a storm is drained with */
+#define MAX_CACHED_DIRS 65536             /* Max. number of directory handles whose paths are remembered */
+
+namespace inotify {
+
+/**
+ * Watcher backend built on fanotify instead of inotify. A single FAN_MARK_FILESYSTEM mark covers the whole filesystem
+ * of the root, so setup cost is constant and no memory is spent per directory; there is no initial crawl and no
+ * max_user_watches limit. Events carry the file handle of the parent directory and the entry name
+ * (FAN_REPORT_DFID_NAME), which are resolved to paths with open_by_handle_at and filtered to the root in user space.
+ * Requires CAP_SYS_ADMIN.
+ */
+class FanotifyWatcher : public Watcher
+{
+ public:
+  FanotifyWatcher(const std::filesystem::path& path,
+      const std::vector<std::string>& ignored_dirs,
+      const InotifyOptions& options = InotifyOptions());
+  ~FanotifyWatcher();
+
+  void run() override;  /* Starts the event-loop */
+  void stop() override; /* Stops the event-loop */
+
+  void setEventHandler(EventHandler* handler) override; /* Receive the events instead of logging them */
+  void setControlChannel(ControlChannel* channel) override; /* Service signals and commands on the reactor */
+  void setIgnorePatterns(const std::vector<std::string>& patterns) override; /* Reload the ignore rules */
+  std::string metrics() const override;                 /* Runtime metrics in the Prometheus text format */
+
+ private:
+  struct Directory {
+    std::string path; /* Absolute path of the directory */
+    bool excluded;    /* Outside of the root, or inside of an ignored subtree */
+  };
+
+  void initialize();         /* Initialize fanotify, mark the filesystem and register it with the reactor */
+  void terminate() noexcept; /* Close the fanotify instance */
+  void drainEvents();        /* Reads and processes events until the fanotify fd is empty */
+  void processEvent(const fanotify_event_metadata* metadata); /* Handle a single event */
+  const Directory* resolve(const struct fanotify_event_info_fid* info); /* Path of the directory of an info record */
+  bool isExcluded(const std::string& path) const; /* Check if a directory is outside of the root or ignored */
+  void emit(EventType type,
+      bool is_dir,
+      const std::filesystem::path& path,
+      const std::filesystem::path& old_path = {}); /* Add an event to the batch for the handler */
+  void countDroppedLines();                         /* Copy the drops of the async logs into the metrics */
+
+ private:
+  const std::filesystem::path _root;                       /* Root path to watch */
+  IgnoreMatcher _ignore;                                   /* Compiled ignore patterns, replaced on reload */
+  const InotifyOptions _options;                           /* Tunables of the instance */
+  std::unique_ptr<Reactor> _reactor;                       /* Event loop that dispatches the fanotify fd */
+  int _fanotify_fd;                                        /* File descriptor for fanotify, non-blocking */
+  int _mount_fd;                                           /* Mount point of the root, for open_by_handle_at */
+  std::unordered_map<std::string, Directory> _directories; /* File handle to resolved directory */
+  ReadBuffer _event_buffer;                                /* Read buffer, sized by the load */
+  std::atomic<bool> _stopped;                              /* Flag to stop the watcher */
+  std::chrono::steady_clock::time_point _read_time;        /* When the buffered events were read */
+  EventHandler* _handler;                                  /* Consumer of the events, logs them if null */
+  EventBatch _batch;                                       /* Events of the current read for the handler */
+  ControlChannel* _control;                                /* Signals and commands serviced by the reactor, or null */
+  Metrics _metrics;                                        /* Counters and histograms of the reads */
+  Logger _logger;                                          /* For logging events */
+};
+
+}  // namespace inotify
+
+#endif  // FANOTIFY_WATCHER_HPP
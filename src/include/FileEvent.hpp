@@ -3,11 +3,27 @@
 
 #include <sys/inotify.h>
 
+#include <cstddef>
 #include <cstdint>
 #include <string>
+#include <string_view>
 
 namespace inotify {
 
+/**
+ * Non-owning view of an inotify event that is decoded in place from a read buffer.
+ * A view is only valid until the buffer it points into is refilled.
+ */
+struct FileEventView {
+  int wd;                    /* Watch descriptor */
+  uint32_t mask;             /* Watch mask */
+  uint32_t cookie;           /* Cookie to synchronize two events */
+  std::string_view filename; /* Name of the file, pointing into the buffer */
+};
+
+/**
+ * Owned copy of an inotify event, for consumers that need to hold an event past the next read.
+ */
 struct FileEvent {
   int wd;               /* Watch descriptor */
   uint32_t mask;        /* Watch mask */
@@ -15,7 +31,32 @@ struct FileEvent {
   std::string filename; /* Name of the file */
 
   FileEvent(const inotify_event* const event);
+  FileEvent(const FileEventView& event);
   ~FileEvent();
+
+  FileEventView view() const { return FileEventView{wd, mask, cookie, filename}; }
+};
+
+/**
+ * Decodes the inotify event records of a read buffer in place, without copying or allocating.
+ */
+class FileEventReader
+{
+ public:
+  FileEventReader() : _buffer(nullptr), _length(0), _offset(0) {}
+  FileEventReader(const uint8_t* buffer, size_t length) : _buffer(buffer), _length(length), _offset(0) {}
+
+  bool next(FileEventView& event);       /* Decode the next event, returns false at the end of the buffer */
+  bool peek(FileEventView& event) const; /* Decode the next event without consuming it */
+  bool empty() const { return _offset >= _length; }
+
+ private:
+  static bool decode(const uint8_t* record, size_t available, FileEventView& event, size_t& record_len);
+
+ private:
+  const uint8_t* _buffer; /* Start of the read buffer */
+  size_t _length;         /* Number of valid bytes in the buffer */
+  size_t _offset;         /* Offset of the next record */
 };
 
 }  // namespace inotify
@@ -0,0 +1,74 @@
+#ifndef IGNORE_MATCHER_HPP
+#define IGNORE_MATCHER_HPP
+
+#include <bitset>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+
+namespace inotify {
+
+/**
+ * Matches paths against a set of ignore patterns, in the spirit of .gitignore:
+ *  - a pattern without a slash matches the basename of an entry at any depth, e.g. "build" or "*.o";
+ *  - a pattern with a slash is anchored to the root and matches the path relative to it, e.g. "src/gen" or "/logs";
+ *    with several roots it is anchored to each of them;
+ *  - a trailing slash restricts a pattern to directories, e.g. "tmp/";
+ *  - "*" and "?" match within a component, "**" also across components, "[a-z]" and "[!a-z]" match character classes.
+ * The patterns are compiled once: literals go into hash sets, so that large rule sets stay cheap to check, and globs
+ * are compiled into token sequences.
+ */
+class IgnoreMatcher
+{
+ public:
+  IgnoreMatcher() = default;
+  IgnoreMatcher(const std::vector<std::string>& patterns, const std::filesystem::path& root);
+  IgnoreMatcher(const std::vector<std::string>& patterns, const std::vector<std::filesystem::path>& roots);
+  IgnoreMatcher(const IgnoreMatcher&) = delete;
+  IgnoreMatcher& operator=(const IgnoreMatcher&) = delete;
+  IgnoreMatcher(IgnoreMatcher&&) = default;
+  IgnoreMatcher& operator=(IgnoreMatcher&&) = default;
+
+  bool matches(std::string_view parent, std::string_view name, bool is_dir) const; /* Check an entry of a directory */
+  bool matches(const std::filesystem::path& path, bool is_dir) const;               /* Check an absolute path */
+  bool matches(std::string_view path, bool is_dir) const;                          /* Check an absolute path */
+  bool empty() const { return _pattern_cnt == 0; }
+
+ private:
+  struct Token {
+    enum Kind : uint8_t { Literal, AnyChar, Star, GlobStar, Class } kind;
+    std::string literal;    /* Text of a Literal; "/" for a GlobStar that spans whole components */
+    std::bitset<256> chars; /* Members of a Class */
+  };
+
+  struct Glob {
+    std::vector<Token> tokens; /* The compiled pattern */
+    bool dir_only;             /* Pattern only applies to directories */
+  };
+
+  static Glob compile(std::string_view pattern, bool dir_only);
+  static bool match(const std::vector<Token>& tokens, size_t token, std::string_view text);
+
+  void add(std::string_view pattern);
+  bool matchesName(std::string_view name, bool is_dir) const;
+  bool matchesRelative(std::string_view relative, bool is_dir) const;
+
+ private:
+  std::vector<std::string> _roots;                 /* Roots that anchored patterns are relative to */
+  std::deque<std::string> _literals;               /* Storage of the literal patterns, viewed by the sets */
+  std::unordered_set<std::string_view> _names;     /* Literal basenames */
+  std::unordered_set<std::string_view> _dir_names; /* Literal basenames of directories */
+  std::unordered_set<std::string_view> _paths;     /* Literal paths relative to the root */
+  std::unordered_set<std::string_view> _dir_paths; /* Literal directory paths relative to the root */
+  std::vector<Glob> _name_globs;                   /* Globs over basenames */
+  std::vector<Glob> _path_globs;                   /* Globs over paths relative to the root */
+  size_t _pattern_cnt = 0;                         /* Number of compiled patterns */
+};
+
+}  // namespace inotify
+
+#endif  // IGNORE_MATCHER_HPP
@@ -1,48 +1,136 @@
 #ifndef INOTIFY_HPP
 #define INOTIFY_HPP
 
-#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/stat.h>
 
 #include <atomic>
+#include <chrono>
+#include <climits>
+#include <exception>
 #include <filesystem>
-#include <queue>
+#include <memory>
+#include <thread>
+#include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "Arena.hpp"
+#include "Coalescer.hpp"
+#include "ContentVerifier.hpp"
+#include "ControlChannel.hpp"
+#include "Event.hpp"
+#include "EventHandler.hpp"
+#include "EventRing.hpp"
+#include "EventSource.hpp"
 #include "FileEvent.hpp"
+#include "IgnoreMatcher.hpp"
+#include "InotifyOptions.hpp"
 #include "Logger.hpp"
-
-#define MAX_EVENTS 4096                           /* Max. number of events that can be read into the buffer */
-#define NAME_MAX 16                               /* Maximum number of bytes in filename */
-#define EVENT_SIZE (sizeof(struct inotify_event)) /* Size of one inotify event */
-#define EVENT_BUFFER_LEN (MAX_EVENTS * (EVENT_SIZE + NAME_MAX))
-
-/* MAX_EPOLL_EVENTS is set to 1 since there exists only one eventbuffer */
-#define MAX_EPOLL_EVENTS 1
+#include "Metrics.hpp"
+#include "ReadBuffer.hpp"
+#include "Reactor.hpp"
+#include "UringReader.hpp"
+#include "WatchCache.hpp"
+#include "Watcher.hpp"
+
+#define EVENT_SIZE (sizeof(struct inotify_event))   /* Size of one inotify event without its name */
+#define EVENT_MAX_SIZE (EVENT_SIZE + NAME_MAX + 1)  /* Size of an event with the longest possible name */
+#define EVENT_BUFFER_MIN (16 * EVENT_MAX_SIZE)      /* Smallest read buffer, what an idle watcher keeps */
+#define EVENT_BUFFER_MAX (4096 * EVENT_MAX_SIZE)    /* Largest read buffer, what a storm is drained with */
+#define EVENT_BUFFER_LEN (512 * EVENT_MAX_SIZE)     /* Size of a buffer of the ring in pipelined mode */
 
 namespace inotify {
 
-class Inotify
+class Inotify : public Watcher
 {
  public:
-  Inotify(const std::filesystem::path& path, const std::vector<std::string>& ignored_dirs);
+  /* Counters of the pipelined mode */
+  struct PipelineStats {
+    uint64_t buffers;     /* Buffers read by the reader thread */
+    uint64_t bytes;       /* Bytes read by the reader thread */
+    uint64_t stalls;      /* Times the reader waited because the ring was full */
+    size_t occupancy;     /* Buffers currently waiting to be processed */
+    size_t max_occupancy; /* Most buffers that were waiting at once */
+    size_t capacity;      /* Buffers in the ring */
+  };
+
+  Inotify(const std::filesystem::path& path,
+      const std::vector<std::string>& ignored_dirs,
+      const InotifyOptions& options = InotifyOptions());
+  Inotify(const std::filesystem::path& path,
+      const std::vector<std::string>& ignored_dirs,
+      const InotifyOptions& options,
+      Reactor& reactor); /* Share an event loop with other watchers, timers and user fds */
+  Inotify(const std::vector<std::filesystem::path>& roots,
+      const std::vector<std::string>& ignored_dirs,
+      const InotifyOptions& options = InotifyOptions()); /* Watch several trees with one inotify fd */
+  Inotify(const std::vector<std::filesystem::path>& roots,
+      const std::vector<std::string>& ignored_dirs,
+      const InotifyOptions& options,
+      Reactor& reactor);
   ~Inotify();
 
-  void run();  /* Starts the event-loop */
-  void stop(); /* Stops the event-loop */
+  void run() override;  /* Starts the event-loop */
+  void stop() override; /* Stops the event-loop */
+  void replay(EventSource& source); /* Process a stream of events instead of the kernel's, on the calling thread */
+
+  void setEventHandler(EventHandler* handler) override; /* Receive the events instead of logging them */
+  void setControlChannel(ControlChannel* channel) override; /* Service signals and commands on the reactor */
+  void setIgnorePatterns(const std::vector<std::string>& patterns) override; /* Reload the ignore rules in place */
+  void addRoot(const std::filesystem::path& path);    /* Start watching another tree; safe to call from any thread */
+  void removeRoot(const std::filesystem::path& path); /* Stop watching a tree; safe to call from any thread */
+  void expand(const std::filesystem::path& path, int depth = -1); /* Watch deeper below a directory, lazy mode */
+  std::string metrics() const override;                 /* Runtime metrics in the Prometheus text format */
+  const Metrics& rawMetrics() const { return _metrics; } /* Runtime metrics, e.g. to be labeled and merged */
+  PipelineStats pipelineStats() const;                  /* Ring counters; all zero unless pipelined */
+  static size_t shardOf(std::string_view name, size_t shard_count); /* Shard of a subdirectory of the root */
 
  private:
-  void initialize();         /* Initialize inotify and epoll */
+  /* A move whose IN_MOVED_TO event has not been seen yet */
+  struct PendingMove {
+    bool is_dir;                                    /* Whether a directory was moved */
+    std::filesystem::path path;                     /* Path before the move */
+    std::chrono::steady_clock::time_point deadline; /* When the move is treated as a move out */
+  };
+
+  Inotify(const std::vector<std::filesystem::path>& roots,
+      const std::vector<std::string>& ignored_dirs,
+      const InotifyOptions& options,
+      std::unique_ptr<Reactor> own_reactor,
+      Reactor* reactor);
+
+  void initialize();         /* Initialize inotify and register it with the reactor */
   void terminate() noexcept; /* Gracefully terminate the inotify instance */
   void runOnce();            /* Run a single iteration of the event-processing loop */
-  void reinitialize();       /* Reinitialize inotify and epoll, and try to rewrite the cache from scracth */
+  void reinitialize();       /* Reinitialize inotify, and try to rewrite the cache from scracth */
+  void recoverOverflow();    /* Repair the cache after lost events with the configured recovery strategy */
+  int rescanDirectories();   /* Rescan the cached directories that changed and synthesize the missed events */
 
   /* Directory and path managment */
-  int watchDirectory(
-      const std::filesystem::path& path);             /* Add a directory and all of its subdirectories to be watched */
-  int addWatch(const std::filesystem::path& path);    /* Register a directory path with inotify */
-  bool isIgnored(const std::string& path_name) const; /* Check if a directory is in the ignore list */
+  int watchDirectory(const std::filesystem::path& path,
+      int depth = -1); /* Add a directory and its subdirectories, down to a depth, to be watched */
+  int watchDirectoryParallel(const std::filesystem::path& path,
+      int depth = -1);                                /* Same as watchDirectory, crawled by a worker pool */
+  int expandDirectory(int wd);                        /* Watch the subdirectories of a directory at the lazy edge */
+  void expandSubtree(const std::filesystem::path& path, int depth); /* Watch a subtree down to a depth */
+  int lazyDepth(const std::filesystem::path& path) const; /* Levels below a directory that are watched upfront */
+  int watchRoot(const std::filesystem::path& path);   /* Crawl a root with the configured crawl mode */
+  void insertRoot(const std::filesystem::path& path); /* Add a root at runtime and crawl it */
+  void dropRoot(const std::filesystem::path& path);   /* Unwatch a root, and stop if it was the last one */
+  std::string checkRoot(const std::filesystem::path& path) const; /* Why a path can't be added as root, or empty */
+  bool isRoot(const std::filesystem::path& path) const; /* Check if a path is one of the roots */
+  void addMaskRules(const std::filesystem::path& root); /* Key the mask rules of the options by a root */
+  int watchFromSnapshot();                            /* Re-add the watches of the snapshot, instead of crawling */
+  void reportSnapshotChanges();                       /* Report what changed since the snapshot was saved */
+  void saveSnapshot();                                /* Save the directory index to the snapshot file */
+  int addWatch(const std::filesystem::path& path,
+      const struct stat* st = nullptr); /* Register a directory path with inotify, optionally with its stat */
+  uint32_t eventMask(const std::filesystem::path& path) const; /* Events selected for the files of a directory */
+  bool isIgnored(const std::filesystem::path& path, bool is_dir) const; /* Check the path against the ignore rules */
+  bool isIgnored(std::string_view path, bool is_dir) const;             /* Same, for a path built in the arena */
+  void applyIgnorePatterns(const std::vector<std::string>& patterns); /* Swap the rules and fix up the watches */
   int zapSubdirectories(const std::filesystem::path&
           old_path); /* Remove all subdirectories from the watch descriptor cache under the given path */
 
@@ -52,26 +140,98 @@ class Inotify
   int findWd(const std::filesystem::path& path); /* Find the watch descriptor for the given path */
 
   /* Event handling */
+  void drainEvents();                        /* Reads and processes events until the inotify fd is empty */
+  void completeUring(UringReader::Completion completion, int result); /* Handles a completion of the ring */
+  void processEvents();                      /* Processes the events decoded from the _event_buffer */
+  void watchAhead();                         /* Watches the new directories of a read before its file events */
   ssize_t readEventsIntoBuffer();            /* Reads inotify events into the _event_buffer */
-  void readEventsFromBuffer(ssize_t length); /* Reads inotify events from the _event_buffer to the _event_queue */
+  void readEventsFromBuffer(ssize_t length); /* Prepares the events in the _event_buffer for in-place decoding */
+  bool nextEvent(FileEventView& event);      /* Decodes the next unprocessed event from the _event_buffer */
+  bool peekEvent(FileEventView& event);      /* Decodes the next unprocessed event without consuming it */
+  static bool isMalformed(const FileEventView& event); /* Check for a record the kernel never produces */
+  void recordEvents(const uint8_t* data, size_t length); /* Append a read to the recording, if enabled */
 
   /* Event processing */
-  void processFileEvent(const FileEvent& event);      /* Handle file related events */
-  void processDirectoryEvent(const FileEvent& event); /* Handle directory related events */
+  void processFileEvent(const FileEventView& event);      /* Handle file related events */
+  void processDirectoryEvent(const FileEventView& event); /* Handle directory related events */
+  void emit(EventType type,
+      bool is_dir,
+      std::string_view path,
+      std::string_view old_path = {},
+      uint32_t cookie = 0); /* Add an event to the batch for the handler */
+  void deliverBatch();      /* Hand the batch to the handler and reset the path arena */
+  void countDroppedLines(); /* Copy the drops of the async logs into the metrics */
+  bool isForeign(int parent_wd, std::string_view name, bool is_dir) const; /* Check if another shard owns an entry */
+
+  /* Move pairing */
+  void completeMove(bool is_dir,
+      const std::filesystem::path& old_path,
+      const FileEventView& to); /* Handle a move of which both halves were seen */
+  void expireMove(bool is_dir,
+      const std::filesystem::path& old_path,
+      uint32_t cookie); /* Handle a move as a move out of the tree */
+  void deferMove(bool is_dir,
+      const std::filesystem::path& old_path,
+      uint32_t cookie);              /* Wait for the IN_MOVED_TO half of a move */
+  void expireMoves(bool everything); /* Give up on held back moves whose timeout passed, or on all of them */
+  void resolveStraddledMoves();      /* Give up on held back moves that the new read doesn't continue */
+  void scheduleMoveExpiry();         /* Arm the timer for the next held back move */
+
+  /* Pipelined mode */
+  void startReader();  /* Start the thread that reads into the ring */
+  void stopReader();   /* Stop and join the reader thread */
+  void readerLoop();   /* Reads the inotify fd into the ring until stopped */
+  void consumeRing();  /* Processes the buffers of the ring */
+
+  /* Event coalescing */
+  void flushCoalesced(bool everything); /* Process held back file events whose window passed, or all of them */
+  void scheduleCoalescedFlush();        /* Arm the timer for the next held back file event */
+
+  /* Content verification */
+  bool verifyEvent(EventType type, bool is_dir, std::string_view path, std::string_view old_path); /* Hold modifies */
+  void record(EventType type, bool is_dir, std::string_view path, std::string_view old_path, uint32_t cookie);
+  void completeVerifications(bool everything); /* Report the modifies that turned out to change the contents */
 
  private:
-  const std::filesystem::path _root;                        /* Root path to watch */
-  const std::vector<std::string> _ignored_dirs;             /* Directories to ignore */
-  int _inotify_fd;                                          /* File descriptor for inotify */
-  int _epoll_fd;                                            /* File descriptor for epoll */
-  int _event_fd;                                            /* File descriptor for interrupt events */
-  epoll_event _inotify_epoll_event;                         /* For registering the inotify instance with epoll */
-  epoll_event _stop_epoll_event;                            /* For registering the stop event with epoll */
-  epoll_event _epoll_events[MAX_EPOLL_EVENTS];              /* Array to store epoll events */
-  std::unordered_map<int, std::filesystem::path> _wd_cache; /* Cache to store watch descriptors with their path */
-  std::array<uint8_t, EVENT_BUFFER_LEN> _event_buffer;      /* Buffer to store inotify events */
-  std::queue<FileEvent> _event_queue;                       /* Queue to store inotify events */
+  std::vector<std::filesystem::path> _roots;                /* Root paths to watch, never nested in each other */
+  std::vector<std::string> _ignore_patterns;                /* Ignore patterns, to anchor them to new roots */
+  IgnoreMatcher _ignore;                                    /* Compiled ignore patterns, replaced on reload */
+  std::unordered_map<std::string, uint32_t> _mask_rules;    /* Absolute subtree path to selected events */
+  const InotifyOptions _options;                            /* Tunables of the instance */
+  std::unique_ptr<Reactor> _own_reactor;                    /* Event loop created when none is shared */
+  Reactor* _reactor;                                        /* Event loop that dispatches the inotify fd */
+  int _inotify_fd;                                          /* File descriptor for inotify, non-blocking */
+  WatchCache _wd_cache;                                     /* Directory tree of the watch descriptors */
+  ReadBuffer _event_buffer;                                 /* Buffer to store inotify events, sized by the load */
+  FileEventReader _event_reader;                            /* Decodes the events of the _event_buffer in place */
   std::atomic<bool> _stopped;                               /* Flag to stop the inotify instance */
+  std::chrono::steady_clock::time_point _read_time;         /* When the events in the _event_buffer were read */
+  EventHandler* _handler;                                   /* Consumer of the events, logs them if null */
+  EventBatch _batch;                                        /* Events of the current read for the handler */
+  Arena _path_arena;                                        /* Paths of the file events of the current batch */
+  ControlChannel* _control;                                 /* Signals and commands serviced by the reactor, or null */
+  std::unordered_map<uint32_t, PendingMove> _pending_moves; /* Moves waiting for their IN_MOVED_TO, by cookie */
+  int _move_timer;                                          /* Timer id of the next move timeout, or -1 */
+  std::unique_ptr<Coalescer> _coalescer;                    /* Merges bursts of file events, if enabled */
+  std::unique_ptr<ContentVerifier> _verifier;               /* Drops modifies that left the contents as they were */
+  std::unordered_set<int> _unexpanded;                      /* Watched directories whose subdirectories are not */
+  std::unordered_map<std::string, bool> _watched_ahead;     /* New directories of the read, whether the watch worked */
+  int _coalesce_timer;                                      /* Timer id of the next coalescer flush, or -1 */
+  std::unique_ptr<EventRing> _ring;                         /* Buffers between the reader thread and the processing */
+  std::thread _reader;                                      /* Reads the inotify fd in pipelined mode */
+  std::atomic<bool> _reader_stopped;                        /* Flag to stop the reader thread */
+  std::atomic<bool> _reader_blocked;                        /* The reader waits for a free slot of the ring */
+  std::exception_ptr _reader_error;                         /* Error that stopped the reader thread */
+  int _ring_fd;                                             /* Eventfd, signals published buffers to the reactor */
+  int _space_fd;                                            /* Eventfd, signals free slots or stop to the reader */
+  uint64_t _ring_generation;                                /* Bumped when the ring is dropped on reinitialization */
+  std::unique_ptr<UringReader> _uring;                      /* Reads the inotify fd through io_uring, if enabled */
+  std::atomic<uint64_t> _reader_stalls;                     /* Times the reader waited for a free slot */
+  EventSource* _source;                                     /* Events that are replayed, null when reading the fd */
+  int _record_fd;                                           /* Recording of the events that were read, or -1 */
+  std::vector<std::filesystem::path> _snapshot_deleted;     /* Directories of the snapshot that no longer exist */
+  bool _warm_start;                                         /* Watches were restored from a snapshot */
+  Metrics _metrics;                                         /* Counters and histograms of the hot paths */
   Logger _logger;                                           /* For logging events */
 };
 
@@ -0,0 +1,65 @@
+#ifndef INOTIFY_OPTIONS_HPP
+#define INOTIFY_OPTIONS_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+#include "Logger.hpp"
+
+namespace inotify {
+
+/* Kernel interface that the watcher is built on */
+enum class Backend {
+  Inotify, /* One inotify watch per directory, see Inotify */
+  Fanotify /* One fanotify mark for the whole filesystem, see FanotifyWatcher */
+};
+
+/* How the watcher recovers when the kernel event queue overflowed and events were lost */
+enum class OverflowRecovery {
+  Reinitialize, /* Drop all watches, recreate the inotify instance and crawl the root again */
+  Rescan        /* Keep the watches and only rescan directories whose modification time changed */
+};
+
+/**
+ * Selects the file events that are reported for a subtree, as a mask of IN_CREATE, IN_DELETE, IN_MOVE, IN_MODIFY and
+ * IN_CLOSE_WRITE. Content events that are not selected are filtered by the kernel. IN_CREATE, IN_DELETE
+ * and IN_MOVE are always requested, since they keep the directory tree up to date; unselected ones are dropped for
+ * files before they are reported. Subdirectories inherit the mask when they are watched, unless a rule of their own
+ * applies.
+ */
+struct MaskRule {
+  std::filesystem::path subtree; /* Directory the rule applies to, absolute or relative to the root */
+  uint32_t events;               /* Events to report for the files in the subtree */
+};
+
+/**
+ * Tunables of an Inotify instance. The defaults reproduce the plain single-threaded watcher.
+ */
+struct InotifyOptions {
+  Backend backend = Backend::Inotify;         /* Kernel interface to watch with */
+  Logger::Mode log_mode = Logger::Mode::Sync; /* Write log lines synchronously or through the async writer thread */
+  int log_fd = STDOUT_FILENO;                 /* Where the log lines of the watcher are written */
+  size_t crawl_threads = 0; /* Workers for the initial crawl of the root; 0 or 1 crawls on the watcher thread */
+  int lazy_depth = -1; /* Watch only this many levels below the roots upfront, the rest on activity; -1 watches all */
+  OverflowRecovery overflow_recovery = OverflowRecovery::Reinitialize; /* Recovery strategy for IN_Q_OVERFLOW */
+  size_t shard_index = 0; /* Which part of the root's subdirectories this instance watches, see ShardedInotify */
+  size_t shard_count = 1; /* Number of instances the root's subdirectories are split across */
+  std::chrono::milliseconds coalesce_window{0}; /* Merge repeated file events within this window; 0 disables it */
+  size_t verify_threads = 0; /* Hash modified files on this many threads, dropping no-op modifies; 0 disables it */
+  bool close_write = false;        /* Report a modification once, on IN_CLOSE_WRITE, instead of on every IN_MODIFY */
+  bool only_dir = false;           /* Watch with IN_ONLYDIR, so a directory that was swapped for a file isn't watched */
+  bool excl_unlink = false;        /* Watch with IN_EXCL_UNLINK, no events for unlinked files that are still open */
+  std::vector<MaskRule> mask_rules; /* Per-subtree selection of file events */
+  std::chrono::milliseconds move_timeout{10}; /* How long a move whose halves straddle two reads is held back */
+  size_t pipeline_slots = 0; /* Read on a separate thread into a ring of this many buffers; 0 reads inline */
+  bool io_uring = false;     /* Read through io_uring if the kernel allows it, into a fixed buffer of maximal size */
+  std::filesystem::path snapshot_file; /* Save the directory index here on shutdown and restart from it, if set */
+  std::filesystem::path record_file; /* Write the raw events that are read to this file, for replay, if set */
+};
+
+}  // namespace inotify
+
+#endif  // INOTIFY_OPTIONS_HPP
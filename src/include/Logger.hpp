@@ -1,17 +1,62 @@
 #ifndef LOGGER_HPP
 #define LOGGER_HPP
 
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
 #include <string>
+#include <thread>
 
 namespace inotify {
 
 class Logger
 {
  public:
+  enum class Mode {
+    Sync, /* Write every line from the calling thread */
+    Async /* Format into a lock-free ring and let a background thread write the lines in batches */
+  };
+
+  static constexpr size_t LINE_MAX_LEN = 512;   /* Lines longer than this are truncated in async mode */
+  static constexpr size_t RING_CAPACITY = 8192; /* Number of lines the async ring can hold, a power of two */
+
+  explicit Logger(Mode mode = Mode::Sync, int fd = STDOUT_FILENO);
+  ~Logger();
+
+  Logger(const Logger&) = delete;
+  Logger& operator=(const Logger&) = delete;
+
   void logEvent(const char *format, ...);
+  uint64_t dropped() const { return _dropped.load(std::memory_order_relaxed); } /* Lines lost to a full ring */
+
+ private:
+  struct Slot {
+    std::atomic<size_t> sequence; /* Ring position the slot is ready for */
+    size_t length;                /* Number of bytes in the line */
+    char line[LINE_MAX_LEN];      /* Formatted line, including the newline */
+  };
+
+  static const char *getTimestamp();      /* Formatted local time, cached per thread for one second */
+  size_t formatLine(char *line, size_t size, const char *format, va_list args) const; /* Timestamped line */
+  void writerLoop();                      /* Drains the ring in batches until stopped */
+  void wakeWriter();                      /* Wakes the writer thread if it is waiting for lines */
+  void reportDropped(uint64_t &reported); /* Writes how many lines were dropped since the last report */
 
  private:
-  std::string getTimestamp() const;
+  const Mode _mode;                      /* Whether lines are written synchronously or by the writer thread */
+  const int _fd;                         /* Output for async mode */
+  std::unique_ptr<Slot[]> _ring;         /* Lock-free ring of formatted lines */
+  alignas(64) std::atomic<size_t> _head; /* Next position to be claimed by a producer */
+  alignas(64) std::atomic<size_t> _tail; /* Next position to be written by the writer thread */
+  std::atomic<bool> _writer_waiting;     /* Set while the writer thread is blocked on _wake_fd */
+  std::atomic<bool> _stopping;           /* Asks the writer thread to drain the ring and exit */
+  std::atomic<uint64_t> _dropped;        /* Number of lines dropped because the ring was full */
+  int _wake_fd;                          /* Eventfd that wakes the writer thread */
+  std::thread _writer;                   /* Background writer thread */
 };
 
 }  // namespace inotify
@@ -0,0 +1,100 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace inotify {
+
+/**
+ * A monotonic counter with a single writer. The writer updates it without a locked instruction, any thread can read
+ * it.
+ */
+class Counter
+{
+ public:
+  void add(uint64_t value = 1)
+  {
+    _value.store(_value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+  }
+  uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> _value{0};
+};
+
+/**
+ * A value that goes up and down, e.g. the number of watches.
+ */
+class Gauge
+{
+ public:
+  void set(uint64_t value) { _value.store(value, std::memory_order_relaxed); }
+  uint64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+ private:
+  std::atomic<uint64_t> _value{0};
+};
+
+/**
+ * A lock-free histogram with a single writer and power of two buckets: bucket i counts the values up to 2^i, the last
+ * one everything larger. Recording is a bit scan and three relaxed stores.
+ */
+class Histogram
+{
+ public:
+  static constexpr size_t BUCKET_CNT = 32; /* Finite buckets, the largest bound is 2^31 */
+
+  void record(uint64_t value);
+  uint64_t count() const { return _count.value(); }
+  uint64_t sum() const { return _sum.value(); }
+  uint64_t bucket(size_t index) const { return _buckets[index].value(); } /* Values of the bucket, not cumulative */
+
+ private:
+  std::array<Counter, BUCKET_CNT + 1> _buckets; /* The extra bucket holds the values above the largest bound */
+  Counter _count;                               /* Number of recorded values */
+  Counter _sum;                                 /* Sum of the recorded values */
+};
+
+/**
+ * Runtime metrics of a watcher. Every metric is written by one thread only, the watcher thread, or the reader thread in
+ * pipelined mode, so instrumenting the hot paths costs a few plain stores. Any thread can read the metrics while the
+ * watcher runs, e.g. to serve them in the Prometheus text format.
+ */
+struct Metrics {
+  Counter reads;               /* Reads that returned events */
+  Counter events;              /* Events decoded from the reads */
+  Counter bytes;               /* Bytes read */
+  Counter overflows;           /* Event queue overflows */
+  Counter reinitializations;   /* Times the cache was rebuilt from scratch */
+  Counter unchanged_modifies;  /* Modifies that were dropped as the contents were unchanged */
+  Counter hashed_bytes;        /* Bytes read to verify the contents of modified files */
+  Counter expansions;          /* Directories at the edge of the lazily watched tree that were expanded */
+  Counter malformed_events;    /* Records the kernel never produces, dropped before processing */
+  Counter early_watches;       /* New directories watched ahead of the file events queued before them */
+  Counter dropped_log_lines;   /* Lines of the async logs, events included, lost because the output fell behind */
+  Gauge watches;               /* Watched directories */
+  Gauge read_buffer_bytes;     /* Current size of the read buffer */
+  Histogram events_per_read;   /* Events decoded from every read */
+  Histogram bytes_per_wakeup;  /* Bytes read every time the event loop woke up */
+  Histogram queue_depth;       /* Bytes queued in the kernel, or buffers queued in the ring, on wakeup */
+  Histogram reinitialize_us;   /* Duration of a rebuild of the cache, in microseconds */
+  Histogram rename_rewrite_ns; /* Time spent rewriting cached paths for a directory move, in nanoseconds */
+
+  /* The metrics of one watcher, tagged with Prometheus labels */
+  struct Source {
+    std::string labels;     /* Label pairs without the braces, e.g. shard="0"; may be empty */
+    const Metrics* metrics; /* Not owned */
+  };
+
+  std::string format() const;                                   /* Prometheus text exposition of the metrics */
+  static std::string format(const std::vector<Source>& sources); /* Exposition of several watchers, one per label set */
+};
+
+}  // namespace inotify
+
+#endif  // METRICS_HPP
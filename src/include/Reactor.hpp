@@ -0,0 +1,68 @@
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+#include <sys/epoll.h>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/* Max. number of ready file descriptors handled per epoll_wait call */
+#define MAX_EPOLL_EVENTS 64
+
+namespace inotify {
+
+/**
+ * epoll based event loop that multiplexes any number of file descriptors and timers on one thread.
+ * Several Inotify instances can share a reactor, together with timers and user file descriptors.
+ * All methods except post(), wakeup() and stop() must be called from the thread that runs the loop.
+ */
+class Reactor
+{
+ public:
+  using Handler = std::function<void(uint32_t events)>; /* Called with the ready epoll events of the fd */
+  using TimerHandler = std::function<void()>;
+  using Task = std::function<void()>;
+
+  Reactor();
+  ~Reactor();
+
+  Reactor(const Reactor&) = delete;
+  Reactor& operator=(const Reactor&) = delete;
+
+  void add(int fd, uint32_t events, Handler handler); /* Register a file descriptor */
+  void remove(int fd);                                /* Unregister a file descriptor */
+  int addTimer(std::chrono::nanoseconds delay, TimerHandler handler, bool periodic = false); /* Returns a timer id */
+  void cancelTimer(int timer_id);                     /* Cancel a timer before it fires */
+
+  void runOnce(int timeout_ms = -1); /* Wait for and dispatch one round of ready file descriptors */
+  void run();                        /* Dispatch until stop() is called */
+  void stop();                       /* Make run() return; safe to call from any thread */
+  void wakeup();                     /* Interrupt a blocking runOnce(); safe to call from any thread */
+  void post(Task task);              /* Run a task on the loop thread; safe to call from any thread */
+  bool stopped() const { return _stopped; }
+  int fd() const { return _epoll_fd; } /* Readable when runOnce(0) has something to dispatch */
+
+ private:
+  struct Entry {
+    Handler handler; /* Callback of the registered fd */
+  };
+
+  int _epoll_fd;                                            /* File descriptor for epoll */
+  int _wakeup_fd;                                           /* Eventfd for interrupting epoll_wait */
+  epoll_event _epoll_events[MAX_EPOLL_EVENTS];              /* Array to store the ready epoll events */
+  std::unordered_map<int, std::shared_ptr<Entry>> _entries; /* Registered file descriptors */
+  std::unordered_set<int> _timers;                          /* Timer file descriptors that are still armed */
+  std::atomic<bool> _stopped;                               /* Flag to stop run() */
+  std::mutex _tasks_mutex;                                  /* Guards _tasks */
+  std::vector<Task> _tasks;                                 /* Posted tasks that have not run yet */
+};
+
+}  // namespace inotify
+
+#endif  // REACTOR_HPP
@@ -0,0 +1,43 @@
+#ifndef READ_BUFFER_HPP
+#define READ_BUFFER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+namespace inotify {
+
+/**
+ * Heap buffer that the events of a kernel queue are read into, sized by the load. Before every burst of reads the
+ * caller passes the number of queued bytes (FIONREAD): the buffer doubles until it holds all of them, so a storm is
+ * drained in few reads, and it halves again once the peak of a number of consecutive wakeups stayed well below its
+ * size.
+ */
+class ReadBuffer
+{
+ public:
+  static constexpr size_t SHRINK_WAKEUPS = 64; /* Wakeups of low load before the buffer shrinks */
+
+  ReadBuffer(size_t min_size, size_t max_size);
+
+  /* Resize for the queued bytes; invalidates the contents, so only call it once every event was processed */
+  void fit(size_t queued);
+
+  uint8_t* data() { return _data.get(); }
+  size_t size() const { return _size; }
+
+ private:
+  void resize(size_t size); /* Replace the storage, dropping the contents */
+
+ private:
+  const size_t _min_size;           /* The buffer never gets smaller than this */
+  const size_t _max_size;           /* The buffer never gets larger than this */
+  std::unique_ptr<uint8_t[]> _data; /* Storage of _size bytes */
+  size_t _size;                     /* Current capacity */
+  size_t _peak;                     /* Most bytes queued on a wakeup since the last shrink check */
+  size_t _wakeups;                  /* Wakeups since the last shrink check */
+};
+
+}  // namespace inotify
+
+#endif  // READ_BUFFER_HPP
@@ -0,0 +1,97 @@
+#ifndef SHARDED_INOTIFY_HPP
+#define SHARDED_INOTIFY_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "Event.hpp"
+#include "EventHandler.hpp"
+#include "Inotify.hpp"
+#include "Logger.hpp"
+#include "Reactor.hpp"
+#include "Watcher.hpp"
+
+namespace inotify {
+
+/**
+ * Watches one tree, or several, with several Inotify instances, each with its own inotify fd and thread.
+ * The subdirectories of the roots are split across the shards by the hash of their name. The events of all shards are
+ * merged into one stream that is ordered by the time they were read, and moves between shards, which every shard only
+ * sees half of, are paired again by their cookie.
+ */
+class ShardedInotify : public Watcher
+{
+ public:
+  static constexpr std::chrono::milliseconds REORDER_WINDOW{10}; /* How long events are held back for reordering */
+
+  ShardedInotify(const std::filesystem::path& path,
+      const std::vector<std::string>& ignored_dirs,
+      const InotifyOptions& options,
+      size_t shard_count);
+  ShardedInotify(const std::vector<std::filesystem::path>& roots,
+      const std::vector<std::string>& ignored_dirs,
+      const InotifyOptions& options,
+      size_t shard_count);
+  ~ShardedInotify();
+
+  void run() override;  /* Runs the shards and merges their events until stopped */
+  void stop() override; /* Stops all shards */
+
+  void setEventHandler(EventHandler* handler) override; /* Receive the merged events instead of logging them */
+  void setControlChannel(ControlChannel* channel) override; /* Service signals and commands on the merge loop */
+  void setIgnorePatterns(const std::vector<std::string>& patterns) override; /* Reload the ignore rules of all shards */
+  std::string metrics() const override;                 /* Runtime metrics of every shard, labeled by shard */
+  void addRoot(const std::filesystem::path& path);      /* Start watching another tree with every shard */
+  void removeRoot(const std::filesystem::path& path);   /* Stop watching a tree with every shard */
+  void expand(const std::filesystem::path& path, int depth = -1); /* Watch deeper below a lazily watched directory */
+
+ private:
+  using Key = std::pair<std::chrono::steady_clock::time_point, uint64_t>; /* Read time and arrival order */
+
+  /* Forwards the events of a shard to the merge queue */
+  class ShardHandler : public EventHandler
+  {
+   public:
+    explicit ShardHandler(ShardedInotify& owner) : _owner(owner) {}
+    void onBatch(const EventBatch& batch) override { _owner.push(batch); }
+
+   private:
+    ShardedInotify& _owner;
+  };
+
+  void push(const EventBatch& batch); /* Queue the events of a shard for merging */
+  void pushLocked(Event event);       /* Queue a single event, with _mutex held */
+  void release(bool everything);      /* Deliver the events that are older than the reorder window */
+
+ private:
+  ShardHandler _shard_handler;                   /* Receives the events of all shards */
+  std::vector<std::unique_ptr<Inotify>> _shards; /* One watcher per shard */
+  EventHandler* _handler;                        /* Consumer of the merged events, logs them if null */
+  EventBatch _batch;                             /* Released events for the handler */
+  Logger _logger;                                /* For logging events */
+  Metrics _merge_metrics;                        /* Of the merge loop; only the dropped log lines are counted */
+  std::mutex _mutex;                             /* Guards the merge state */
+  Reactor _reactor;                              /* Merge loop; woken by stopped shards, stop() and commands */
+  ControlChannel* _control;                      /* Signals and commands serviced by the merge loop, or null */
+  std::map<Key, Event> _pending;                 /* Events waiting for the reorder window to pass */
+  std::unordered_map<uint32_t, Key> _move_halves; /* Pending move halves by cookie */
+  const std::chrono::nanoseconds _half_window;   /* How long an unpaired move half waits for its other half */
+  uint64_t _sequence;                            /* Arrival counter, keeps the order of equal read times */
+  size_t _running_cnt;                           /* Number of shards that are still running */
+  bool _stopped;                                 /* Set when stop() was called */
+  std::exception_ptr _error;                     /* First error raised by a shard */
+};
+
+}  // namespace inotify
+
+#endif  // SHARDED_INOTIFY_HPP
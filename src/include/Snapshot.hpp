@@ -0,0 +1,65 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string_view>
+
+#include "WatchCache.hpp"
+
+#define SNAPSHOT_MAGIC "INOSNAP" /* Identifies snapshot files, followed by the format version */
+#define SNAPSHOT_VERSION 1       /* Bumped whenever the layout changes */
+
+namespace inotify {
+
+/**
+ * Compact on-disk copy of the directory index of a WatchCache, for warm restarts.
+ * The file is a header, a table of fixed-size entries and a blob with the names of the entries. Parents always come
+ * before their children, so the tree can be rebuilt in a single pass. Opened snapshots are memory-mapped read-only
+ * and decoded in place.
+ */
+class Snapshot
+{
+ public:
+  struct Header {
+    char magic[8];       /* SNAPSHOT_MAGIC */
+    uint32_t version;    /* SNAPSHOT_VERSION */
+    uint32_t entry_cnt;  /* Number of entries */
+    uint64_t names_size; /* Size of the name blob in bytes */
+  };
+
+  struct Entry {
+    int32_t parent;       /* Index of the parent entry, or -1 for a root */
+    uint32_t name_offset; /* Offset of the name in the name blob */
+    uint32_t name_size;   /* Size of the name; a root's name is its full path */
+    uint32_t reserved;    /* Padding, always 0 */
+    uint64_t inode;       /* Inode number of the directory */
+    int64_t mtime;        /* Modification time of the directory in nanoseconds */
+  };
+
+  explicit Snapshot(const std::filesystem::path& file); /* Map and validate a snapshot file */
+  ~Snapshot();
+  Snapshot(const Snapshot&) = delete;
+  Snapshot& operator=(const Snapshot&) = delete;
+
+  static void save(const std::filesystem::path& file, const WatchCache& cache); /* Write the cache atomically */
+
+  size_t size() const { return _header->entry_cnt; }
+  const Entry& entry(size_t index) const { return _entries[index]; }
+  std::string_view name(size_t index) const
+  {
+    return {_names + _entries[index].name_offset, _entries[index].name_size};
+  }
+
+ private:
+  void* _data;           /* The mapped file */
+  size_t _length;        /* Size of the mapping */
+  const Header* _header; /* Header at the start of the file */
+  const Entry* _entries; /* Entry table after the header */
+  const char* _names;    /* Name blob after the entry table */
+};
+
+}  // namespace inotify
+
+#endif  // SNAPSHOT_HPP
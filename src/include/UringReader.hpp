@@ -0,0 +1,88 @@
+#ifndef URING_READER_HPP
+#define URING_READER_HPP
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#define URING_ENTRIES 8 /* Submission queue entries; at most four requests are in flight */
+
+namespace inotify {
+
+/**
+ * Reads a file descriptor through io_uring instead of epoll_wait and read(2), with the raw system calls and without
+ * liburing. The requests in flight on the ring are a poll of the watched fd linked to a read of it into a registered
+ * buffer, a read of a stop eventfd and a poll of another fd, e.g. the epoll fd of a reactor for its timers and user
+ * fds. Every wait() submits the requests that completed last time and waits for the next completion in a single
+ * io_uring_enter call, so a burst of events costs one system call instead of an epoll_wait and two reads.
+ *
+ * The watched fd can stay non-blocking: the linked poll only lets the read run once there is something to read.
+ * All methods except wakeup() must be called from the same thread.
+ */
+class UringReader
+{
+ public:
+  /* What a completion is about */
+  enum class Completion : uint8_t {
+    Read, /* The read of the watched fd finished; the result is its length or a negative errno */
+    Stop, /* wakeup() was called */
+    Ready /* The polled fd is readable */
+  };
+
+  using Handler = std::function<void(Completion completion, int result)>;
+
+  UringReader(size_t buffer_size, int poll_fd);
+  ~UringReader();
+
+  UringReader(const UringReader&) = delete;
+  UringReader& operator=(const UringReader&) = delete;
+
+  static bool supported(); /* Whether the kernel lets the process set up a ring with the needed features */
+
+  void setFd(int fd);                /* Read another fd, or none if -1; cancels the read in flight */
+  void wait(const Handler& handler); /* Submit the requests and dispatch the completions of one wakeup */
+  void wakeup();                     /* Complete the stop read; safe to call from any thread */
+  uint8_t* data() { return _buffer.get(); }
+  size_t size() const { return _buffer_size; }
+
+ private:
+  io_uring_sqe* prepare(uint8_t opcode, int fd, uint64_t user_data); /* Queue a request */
+  uint64_t tag(uint64_t kind) const { return kind | _generation << 8; } /* User data of a request on _fd */
+  void release() noexcept;                                            /* Unmap the rings and close the fds */
+
+ private:
+  int _ring_fd;                       /* File descriptor of the io_uring instance */
+  int _stop_fd;                       /* Blocking eventfd that wakeup() writes to */
+  int _poll_fd;                       /* Fd whose readability is reported, or -1 */
+  int _fd;                            /* Fd that is read into the buffer, or -1 */
+  size_t _buffer_size;                /* Size of the registered buffer */
+  std::unique_ptr<uint8_t[]> _buffer; /* Registered read buffer */
+  uint64_t _stop_value;               /* Target of the stop read */
+  uint64_t _generation;               /* Bumped by setFd(), tells completions of an earlier fd apart */
+  bool _read_armed;                   /* A read of _fd is in flight */
+  bool _stop_armed;                   /* A read of _stop_fd is in flight */
+  bool _poll_armed;                   /* A poll of _poll_fd is in flight */
+  unsigned _to_submit;                /* Requests queued since the last io_uring_enter */
+
+  /* Mappings of the rings, shared with the kernel */
+  void* _sq_ring;      /* Submission queue ring, and the completion queue ring with IORING_FEAT_SINGLE_MMAP */
+  size_t _sq_size;     /* Size of the mapping of _sq_ring */
+  void* _cq_ring;      /* Completion queue ring */
+  size_t _cq_size;     /* Size of the mapping of _cq_ring, 0 if it is shared with _sq_ring */
+  io_uring_sqe* _sqes; /* Submission queue entries */
+  size_t _sqes_size;   /* Size of the mapping of _sqes */
+  unsigned* _sq_tail;  /* Submission queue tail, written by us */
+  unsigned* _sq_array; /* Submission queue index array */
+  unsigned _sq_mask;   /* Index mask of the submission queue */
+  unsigned* _cq_head;  /* Completion queue head, written by us */
+  unsigned* _cq_tail;  /* Completion queue tail, written by the kernel */
+  unsigned _cq_mask;   /* Index mask of the completion queue */
+  io_uring_cqe* _cqes; /* Completion queue entries */
+};
+
+}  // namespace inotify
+
+#endif  // URING_READER_HPP
@@ -0,0 +1,107 @@
+#ifndef WATCH_CACHE_HPP
+#define WATCH_CACHE_HPP
+
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Arena.hpp"
+
+namespace inotify {
+
+/**
+ * Interned directory names. Each distinct name is stored once and referenced by a small id; the entries are reference
+ * counted so names of removed directories are released again. The names and the index are allocated from a pool of
+ * size classes, so the blocks of released names are reused for new ones instead of going back to malloc.
+ */
+class NamePool
+{
+ public:
+  uint32_t intern(std::string_view name);      /* Id of the name, adding a reference */
+  void release(uint32_t id);                   /* Drop a reference to the name */
+  int32_t lookup(std::string_view name) const; /* Id of the name, or -1 if it is not interned */
+  std::string_view name(uint32_t id) const { return _entries[id].name; }
+  void clear();
+
+ private:
+  struct Entry {
+    std::pmr::string name; /* The interned name */
+    uint32_t refcount;     /* Number of nodes referring to the name */
+  };
+
+  std::pmr::unsynchronized_pool_resource _pool;                     /* Slabs of the names and of the index */
+  std::pmr::deque<Entry> _entries{&_pool};                          /* Stable storage, indexed by id */
+  std::vector<uint32_t> _free_ids;                                  /* Released ids that can be reused */
+  std::pmr::unordered_map<std::string_view, uint32_t> _ids{&_pool}; /* Name to id, viewing into _entries */
+};
+
+/**
+ * Directory-tree index of the watched directories.
+ * Every watch descriptor is a node that only stores its parent and its interned basename; full paths are built on
+ * demand. Roots store their whole path as their name. Looking up a path walks its components (O(depth)), and renaming a
+ * directory only rewrites the renamed node, not its descendants. The nodes are allocated from slabs of a pool that
+ * reuses the blocks of erased nodes, so crawls and churn don't allocate from malloc one node at a time.
+ */
+class WatchCache
+{
+ public:
+  struct Node {
+    int parent;       /* Watch descriptor of the parent directory, or -1 for a root */
+    uint32_t name;    /* Interned basename, or the full path for a root */
+    int first_child;  /* First watched subdirectory, or -1 */
+    int next_sibling; /* Next subdirectory of the same parent, or -1 */
+    int prev_sibling; /* Previous subdirectory of the same parent, or -1 */
+    uint64_t inode;   /* Inode number of the directory, if recorded */
+    int64_t mtime;    /* Modification time of the directory in nanoseconds, if recorded */
+    uint32_t mask;    /* Events selected for the files of the directory */
+  };
+
+  bool insert(int wd, const std::filesystem::path& path); /* Add a watched directory, linking it to its parent */
+  void erase(int wd);                                     /* Remove a single node, detaching its children */
+  void clear();                                           /* Remove all nodes */
+
+  int find(const std::filesystem::path& path) const;     /* Watch descriptor of the path, or -1 */
+  bool contains(int wd) const;                           /* Check if the watch descriptor is cached */
+  std::filesystem::path path(int wd) const;              /* Path of the watch descriptor, throws if not cached */
+  std::string_view path(int wd, std::string_view name, Arena& arena) const; /* Path of an entry, built in the arena */
+  std::vector<int> subtree(int wd) const;                /* The node and all of its descendants, children first */
+  std::vector<int> descriptors() const;                  /* All cached watch descriptors */
+  const std::vector<int>& roots() const { return _roots; } /* Nodes without a cached parent */
+  int rename(int wd, const std::filesystem::path& path); /* Move a subtree to a new path, returns nodes rewritten */
+  std::vector<int> children(int wd) const;               /* Watched subdirectories of the watch descriptor */
+  std::string_view name(int wd) const;                   /* Basename, or the full path for a root */
+  const Node& node(int wd) const { return _nodes.at(wd); }
+  void setStat(int wd, uint64_t inode, int64_t mtime);   /* Record the inode and modification time */
+  void setMask(int wd, uint32_t mask);                   /* Record the selected events */
+
+  bool empty() const { return _nodes.empty(); }
+  size_t size() const { return _nodes.size(); }
+
+ private:
+  static uint64_t childKey(int parent, uint32_t name) { return (uint64_t(uint32_t(parent)) << 32) | name; }
+
+  int findChild(int parent, std::string_view name) const;             /* Watch descriptor of a subdirectory, or -1 */
+  size_t pathSize(int wd, std::string_view name) const;               /* Length of the path of an entry */
+  void writePath(int wd, std::string_view name, char* end) const;     /* Write the path of an entry backwards */
+  void attach(int wd,
+      Node& node,
+      const std::filesystem::path& path,
+      bool root = false);          /* Set parent and name from the path, or link as a root */
+  void detach(int wd, Node& node); /* Unlink from the parent, release the name */
+
+ private:
+  std::pmr::unsynchronized_pool_resource _pool;                /* Slabs of the nodes of both maps */
+  std::pmr::unordered_map<int, Node> _nodes{&_pool};           /* Watch descriptor to node */
+  std::pmr::unordered_map<uint64_t, int> _child_index{&_pool}; /* (parent, name) to watch descriptor */
+  std::vector<int> _roots;                                     /* Nodes without a cached parent */
+  NamePool _names;                                             /* Interned basenames */
+};
+
+}  // namespace inotify
+
+#endif  // WATCH_CACHE_HPP
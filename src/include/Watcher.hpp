@@ -0,0 +1,38 @@
+#ifndef WATCHER_HPP
+#define WATCHER_HPP
+
+#include <string>
+#include <vector>
+
+namespace inotify {
+
+class ControlChannel;
+class EventHandler;
+
+/**
+ * Common interface of the watcher implementations, so that callers can drive any of them the same way.
+ */
+class Watcher
+{
+ public:
+  virtual ~Watcher() = default;
+
+  virtual void run() = 0;  /* Starts the event-loop, returns when the watcher is stopped */
+  virtual void stop() = 0; /* Stops the event-loop; safe to call from any thread */
+
+  /* Receive the events instead of logging them; the handler has to outlive the watcher */
+  virtual void setEventHandler(EventHandler* handler) = 0;
+
+  /* Runtime metrics in the Prometheus text format; safe to call from any thread while the watcher runs */
+  virtual std::string metrics() const = 0;
+
+  /* Service signals and commands on the event loop of the watcher; null detaches, the channel has to outlive it */
+  virtual void setControlChannel(ControlChannel* channel) = 0;
+
+  /* Replace the ignore patterns while the watcher runs; applied on the event loop, safe to call from any thread */
+  virtual void setIgnorePatterns(const std::vector<std::string>& patterns) = 0;
+};
+
+}  // namespace inotify
+
+#endif  // WATCHER_HPP
@@ -1,16 +1,32 @@
-#include <csignal>
+#include <sys/inotify.h>
+
+#include <algorithm>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <thread>
 
+#include "include/ControlChannel.hpp"
+#include "include/EventHandler.hpp"
+#include "include/EventWriter.hpp"
+#include "include/FanotifyWatcher.hpp"
 #include "include/Inotify.hpp"
+#include "include/ShardedInotify.hpp"
 
 // Global state variables
-bool running = true;
 bool had_error = false;
 
-// Signal handler to gracefully stop the program
-void signalHandler(int) { running = false; }
+// Settings of the command line tool itself, next to the options of the watcher
+struct CommandLine {
+  bool main_thread = false;          // Run the watcher on the main thread
+  std::vector<std::string> patterns; // Ignore patterns given as arguments
+  std::filesystem::path ignore_file; // File with more ignore patterns, read again on SIGHUP
+  std::string format = "text";       // Output format of the events: text, json or binary
+  std::filesystem::path replay_file; // Recording to process instead of the events of the kernel
+};
 
 // Check if a directory exists and is valid
 bool isValidDirectory(const std::filesystem::path& path)
@@ -28,41 +44,241 @@ bool isValidDirectory(const std::filesystem::path& path)
   return true;
 }
 
-// Parse and validate command-line arguments
-bool parseArguments(int argc, char* argv[], std::filesystem::path& path, std::vector<std::string>& ignored_dirs)
+// Print the command-line usage
+void printUsage(const char* program)
+{
+  std::cerr << "Usage: " << program << " [options] [path] [ignore_patterns...]" << std::endl;
+  std::cerr << "Options:" << std::endl;
+  std::cerr << "  --fanotify           Watch the whole filesystem with fanotify instead of inotify" << std::endl;
+  std::cerr << "  --async-log          Write events from a background thread in batches" << std::endl;
+  std::cerr << "  --crawl-threads=N    Crawl the directory tree with N threads at startup" << std::endl;
+  std::cerr << "  --lazy-depth=N       Watch N levels below the roots, deeper ones once they see activity" << std::endl;
+  std::cerr << "  --overflow-rescan    Rescan only changed directories after a queue overflow" << std::endl;
+  std::cerr << "  --move-timeout=MS    Wait up to MS milliseconds for the second half of a move" << std::endl;
+  std::cerr << "  --pipeline=N         Read events on a separate thread into a ring of N buffers" << std::endl;
+  std::cerr << "  --io-uring           Read events through io_uring, falls back to epoll if it is unavailable"
+            << std::endl;
+  std::cerr << "  --shards=N           Split the tree across N inotify instances and threads" << std::endl;
+  std::cerr << "  --coalesce=MS        Merge repeated file events within MS milliseconds" << std::endl;
+  std::cerr << "  --verify=N           Hash modified files on N threads and drop modifies that left them unchanged"
+            << std::endl;
+  std::cerr << "                       (a modify with unchanged size, mtime and inode is dropped unhashed, unless the"
+            << std::endl;
+  std::cerr << "                       file was written in the second its last state was recorded)" << std::endl;
+  std::cerr << "  --snapshot=FILE      Save the watched tree to FILE on exit and restart from it" << std::endl;
+  std::cerr << "  --record=FILE        Write the raw events that are read to FILE" << std::endl;
+  std::cerr << "  --replay=FILE        Process the events recorded in FILE against the tree, then exit" << std::endl;
+  std::cerr << "  --close-write        Report modifications when a written file is closed" << std::endl;
+  std::cerr << "  --only-dir           Only add watches for paths that are still directories" << std::endl;
+  std::cerr << "  --excl-unlink        Drop events of files that were unlinked but are still open" << std::endl;
+  std::cerr << "  --mask=DIR:EVENTS    Report only EVENTS (create,delete,move,modify,close_write) for files under DIR"
+            << std::endl;
+  std::cerr << "  --main-thread        Run the watcher on the main thread instead of a thread of its own" << std::endl;
+  std::cerr << "  --ignore-file=FILE   Read ignore patterns from FILE, one per line; reloaded on SIGHUP" << std::endl;
+  std::cerr << "  --root=DIR           Watch DIR too, with the same inotify instance; can be repeated" << std::endl;
+  std::cerr << "  --format=FORMAT      Write the events to stdout as text, json (one object per line) or binary"
+            << std::endl;
+  std::cerr << "Signals:" << std::endl;
+  std::cerr << "  SIGINT, SIGTERM      Stop the watcher" << std::endl;
+  std::cerr << "  SIGUSR1              Write the metrics to stderr, in the Prometheus text format" << std::endl;
+  std::cerr << "  SIGHUP               Read the --ignore-file again and apply its patterns in place" << std::endl;
+}
+
+// Parse a subtree mask rule of the form DIR:EVENT[,EVENT...]
+bool parseMaskRule(const std::string& spec, inotify::MaskRule& rule)
 {
-  if (argc < 2)
+  static const std::pair<const char*, uint32_t> names[] = {{"create", IN_CREATE},
+      {"delete", IN_DELETE},
+      {"move", IN_MOVE},
+      {"modify", IN_MODIFY},
+      {"close_write", IN_CLOSE_WRITE}};
+
+  size_t colon = spec.rfind(':');
+  if (colon == std::string::npos || colon == 0) return false;
+
+  rule.subtree = spec.substr(0, colon);
+  rule.events = 0;
+  std::stringstream events(spec.substr(colon + 1));
+  std::string event;
+  while (std::getline(events, event, ','))
   {
-    std::cerr << "Usage: " << argv[0] << " [path] [ignored_dirs...]" << std::endl;
+    auto it =
+        std::find_if(std::begin(names), std::end(names), [&event](const auto& name) { return event == name.first; });
+    if (it == std::end(names)) return false;
+    rule.events |= it->second;
+  }
+  return true;
+}
+
+// Read the ignore patterns of a file, skipping blank lines and # comments
+bool readIgnoreFile(const std::filesystem::path& file, std::vector<std::string>& patterns)
+{
+  std::ifstream in(file);
+  if (!in)
+  {
+    std::cerr << "Failed to read ignore file: " << file << std::endl;
     return false;
   }
 
-  path = std::filesystem::path(argv[1]);
-  if (!isValidDirectory(path)) return false;
+  std::string line;
+  while (std::getline(in, line))
+  {
+    line.erase(0, line.find_first_not_of(" \t"));
+    line.erase(line.find_last_not_of(" \t\r") + 1);
+    if (!line.empty() && line[0] != '#') patterns.push_back(line);
+  }
+  return true;
+}
+
+// The ignore patterns of the arguments and of the ignore file
+bool collectIgnorePatterns(const CommandLine& cli, std::vector<std::string>& patterns)
+{
+  patterns = cli.patterns;
+  return cli.ignore_file.empty() || readIgnoreFile(cli.ignore_file, patterns);
+}
+
+// Parse and validate command-line arguments
+bool parseArguments(int argc,
+    char* argv[],
+    std::vector<std::filesystem::path>& roots,
+    CommandLine& cli,
+    inotify::InotifyOptions& options)
+{
+  std::vector<std::string> positional;
+  std::vector<std::filesystem::path> extra_roots;
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg == "--fanotify")
+      options.backend = inotify::Backend::Fanotify;
+    else if (arg == "--async-log")
+      options.log_mode = inotify::Logger::Mode::Async;
+    else if (arg == "--overflow-rescan")
+      options.overflow_recovery = inotify::OverflowRecovery::Rescan;
+    else if (arg.rfind("--snapshot=", 0) == 0)
+      options.snapshot_file = arg.substr(std::strlen("--snapshot="));
+    else if (arg.rfind("--record=", 0) == 0)
+      options.record_file = arg.substr(std::strlen("--record="));
+    else if (arg.rfind("--replay=", 0) == 0)
+      cli.replay_file = arg.substr(std::strlen("--replay="));
+    else if (arg == "--main-thread")
+      cli.main_thread = true;
+    else if (arg.rfind("--ignore-file=", 0) == 0)
+      cli.ignore_file = arg.substr(std::strlen("--ignore-file="));
+    else if (arg.rfind("--root=", 0) == 0)
+      extra_roots.emplace_back(arg.substr(std::strlen("--root=")));
+    else if (arg == "--close-write")
+      options.close_write = true;
+    else if (arg == "--only-dir")
+      options.only_dir = true;
+    else if (arg == "--excl-unlink")
+      options.excl_unlink = true;
+    else if (arg.rfind("--mask=", 0) == 0)
+    {
+      inotify::MaskRule rule;
+      if (!parseMaskRule(arg.substr(std::strlen("--mask=")), rule))
+      {
+        std::cerr << "Invalid mask rule: " << arg << std::endl;
+        printUsage(argv[0]);
+        return false;
+      }
+      options.mask_rules.push_back(std::move(rule));
+    }
+    else if (arg.rfind("--coalesce=", 0) == 0)
+      options.coalesce_window = std::chrono::milliseconds(std::stoul(arg.substr(std::strlen("--coalesce="))));
+    else if (arg.rfind("--format=", 0) == 0)
+    {
+      cli.format = arg.substr(std::strlen("--format="));
+      if (cli.format != "text" && cli.format != "json" && cli.format != "binary")
+      {
+        std::cerr << "Unknown format: " << cli.format << std::endl;
+        printUsage(argv[0]);
+        return false;
+      }
+    }
+    else if (arg.rfind("--verify=", 0) == 0)
+      options.verify_threads = std::stoul(arg.substr(std::strlen("--verify=")));
+    else if (arg.rfind("--move-timeout=", 0) == 0)
+      options.move_timeout = std::chrono::milliseconds(std::stoul(arg.substr(std::strlen("--move-timeout="))));
+    else if (arg.rfind("--pipeline=", 0) == 0)
+      options.pipeline_slots = std::stoul(arg.substr(std::strlen("--pipeline=")));
+    else if (arg == "--io-uring")
+      options.io_uring = true;
+    else if (arg.rfind("--shards=", 0) == 0)
+      options.shard_count = std::stoul(arg.substr(std::strlen("--shards=")));
+    else if (arg.rfind("--crawl-threads=", 0) == 0)
+      options.crawl_threads = std::stoul(arg.substr(std::strlen("--crawl-threads=")));
+    else if (arg.rfind("--lazy-depth=", 0) == 0)
+      options.lazy_depth = std::stoi(arg.substr(std::strlen("--lazy-depth=")));
+    else if (arg.rfind("--", 0) == 0)
+    {
+      std::cerr << "Unknown option: " << arg << std::endl;
+      printUsage(argv[0]);
+      return false;
+    }
+    else
+      positional.push_back(std::move(arg));
+  }
+
+  if (positional.empty())
+  {
+    printUsage(argv[0]);
+    return false;
+  }
 
-  for (int i = 2; i < argc; ++i)
+  roots.assign(1, std::filesystem::path(positional[0]));
+  roots.insert(roots.end(), extra_roots.begin(), extra_roots.end());
+  for (const auto& root : roots)
+  {
+    if (!isValidDirectory(root)) return false;
+  }
+  if (roots.size() > 1 && options.backend == inotify::Backend::Fanotify)
+  {
+    std::cerr << "--root is not supported with --fanotify" << std::endl;
+    return false;
+  }
+  if (options.verify_threads > 0 && options.backend == inotify::Backend::Fanotify)
   {
-    ignored_dirs.push_back(argv[i]);
+    std::cerr << "--verify is not supported with --fanotify" << std::endl;
+    return false;
   }
+  if (options.lazy_depth >= 0 && options.backend == inotify::Backend::Fanotify)
+  {
+    std::cerr << "--lazy-depth is not supported with --fanotify" << std::endl;
+    return false;
+  }
+  if (!cli.replay_file.empty() && (options.backend == inotify::Backend::Fanotify || options.shard_count > 1))
+  {
+    std::cerr << "--replay is not supported with --fanotify or --shards" << std::endl;
+    return false;
+  }
+  if (options.io_uring && options.pipeline_slots > 0)
+  {
+    std::cerr << "--io-uring and --pipeline can't be combined" << std::endl;
+    return false;
+  }
+
+  cli.patterns.assign(positional.begin() + 1, positional.end());
   return true;
 }
 
-// Display information about the monitored directory and ignored directories
-void displayWatchInfo(const std::filesystem::path& path, const std::vector<std::string>& ignored_dirs)
+// Display information about the monitored directories and ignored directories
+void displayWatchInfo(
+    std::ostream& out, const std::vector<std::filesystem::path>& roots, const std::vector<std::string>& ignored_dirs)
 {
-  std::cout << "Press Ctrl+C to stop the program." << std::endl;
-  std::cout << "Watching directory: " << path << std::endl;
-  std::cout << "Ignored directories: ";
+  out << "Press Ctrl+C to stop the program." << std::endl;
+  for (const auto& root : roots) out << "Watching directory: " << root << std::endl;
+  out << "Ignored directories: ";
   for (size_t i = 0; i < ignored_dirs.size(); ++i)
   {
-    std::cout << ignored_dirs[i];
-    if (i < ignored_dirs.size() - 1) std::cout << ", ";
+    out << ignored_dirs[i];
+    if (i < ignored_dirs.size() - 1) out << ", ";
   }
-  std::cout << std::endl;
+  out << std::endl;
 }
 
-// Run the Inotify instance in a separate thread context
-void runInotify(inotify::Inotify& inotify_instance)
+// Run the watcher until it is stopped, on the calling thread
+void runInotify(inotify::Watcher& inotify_instance)
 {
   try
   {
@@ -72,30 +288,106 @@ void runInotify(inotify::Inotify& inotify_instance)
     std::cerr << "Unexpected error: " << e.what() << std::endl;
     had_error = true;
   }
-  running = false;
+}
+
+// Process a recording instead of the events of the kernel, on the calling thread
+void replayInotify(inotify::Inotify& inotify_instance, const std::filesystem::path& file)
+{
+  try
+  {
+    inotify::ReplaySource source = inotify::ReplaySource::fromFile(file);
+    inotify_instance.replay(source);
+  } catch (const std::exception& e)
+  {
+    std::cerr << "Unexpected error: " << e.what() << std::endl;
+    had_error = true;
+  }
+}
+
+// Handle a signal or command on the event loop of the watcher
+void handleCommand(inotify::Watcher& inotify_instance, const CommandLine& cli, inotify::Command command)
+{
+  std::vector<std::string> patterns;
+  switch (command)
+  {
+    case inotify::Command::Stop:
+      inotify_instance.stop();
+      break;
+    case inotify::Command::Reload:
+      // Keep the current rules if the file can't be read
+      if (cli.ignore_file.empty())
+        std::cerr << "Nothing to reload" << std::endl;
+      else if (collectIgnorePatterns(cli, patterns))
+        inotify_instance.setIgnorePatterns(patterns);
+      break;
+    case inotify::Command::DumpMetrics:
+      std::cerr << inotify_instance.metrics() << std::flush;
+      break;
+  }
 }
 
 int main(int argc, char* argv[])
 {
-  std::filesystem::path path;
+  std::vector<std::filesystem::path> roots;
   std::vector<std::string> ignored_dirs;
+  inotify::InotifyOptions options;
+  CommandLine cli;
 
-  if (!parseArguments(argc, argv, path, ignored_dirs)) return EXIT_FAILURE;
+  if (!parseArguments(argc, argv, roots, cli, options)) return EXIT_FAILURE;
+  if (!collectIgnorePatterns(cli, ignored_dirs)) return EXIT_FAILURE;
 
-  inotify::Inotify inotify_instance(path, ignored_dirs);
+  // With a structured format stdout only carries the events, everything else goes to stderr
+  const bool structured = cli.format != "text";
+  if (structured) options.log_fd = STDERR_FILENO;
+  std::ostream& info = structured ? std::cerr : std::cout;
 
-  std::signal(SIGINT, signalHandler);  // Setup interrupt signal handler
+  // Signals are handled on the event loop of the watcher; this blocks them before any thread is started
+  inotify::Watcher* target = nullptr;
+  inotify::ControlChannel control([&target, &cli](inotify::Command command) { handleCommand(*target, cli, command); });
 
-  displayWatchInfo(path, ignored_dirs);
+  // The command line tool is just a sink that writes the events to stdout
+  std::unique_ptr<inotify::EventHandler> handler;
+  if (cli.format == "json")
+    handler = std::make_unique<inotify::EventWriter>(inotify::EventWriter::Format::Json, roots);
+  else if (cli.format == "binary")
+    handler = std::make_unique<inotify::EventWriter>(inotify::EventWriter::Format::Binary, roots);
+  else
+    handler = std::make_unique<inotify::LoggingHandler>(options.log_mode);
 
-  std::thread watcher_thread(runInotify, std::ref(inotify_instance));
+  std::unique_ptr<inotify::Watcher> watcher;
+  inotify::Inotify* single = nullptr; // The watcher if it is a single inotify instance, which can replay
+  if (options.backend == inotify::Backend::Fanotify)
+    watcher = std::make_unique<inotify::FanotifyWatcher>(roots.front(), ignored_dirs, options);
+  else if (options.shard_count > 1)
+    watcher = std::make_unique<inotify::ShardedInotify>(roots, ignored_dirs, options, options.shard_count);
+  else
+  {
+    auto instance = std::make_unique<inotify::Inotify>(roots, ignored_dirs, options);
+    single = instance.get();
+    watcher = std::move(instance);
+  }
+  inotify::Watcher& inotify_instance = *watcher;
+  inotify_instance.setEventHandler(handler.get());
+  target = &inotify_instance;
+  inotify_instance.setControlChannel(&control);
 
-  // Keep main thread alive until interrupted
-  while (running) std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  displayWatchInfo(info, roots, ignored_dirs);
 
-  inotify_instance.stop();
-  watcher_thread.join();
+  // The watcher returns when it is stopped by a signal or has nothing left to watch
+  if (!cli.replay_file.empty())
+  {
+    replayInotify(*single, cli.replay_file);
+  }
+  else if (cli.main_thread)
+  {
+    runInotify(inotify_instance);
+  }
+  else
+  {
+    std::thread watcher_thread(runInotify, std::ref(inotify_instance));
+    watcher_thread.join();
+  }
 
-  std::cout << "Bye!" << std::endl;
+  info << "Bye!" << std::endl;
   return had_error ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,61 @@
+#include <memory>
+
+#include "Coalescer.hpp"
+#include "Inotify.hpp"
+#include "Test.hpp"
+
+// Folding of repeated file events, on its own and in a watcher that replays them
+
+namespace {
+
+inotify::FileEventView view(int wd, uint32_t mask, const char* name)
+{
+  inotify::FileEventView event{};
+  event.wd = wd;
+  event.mask = mask;
+  event.filename = name;
+  return event;
+}
+
+}  // namespace
+
+TEST(Coalescer, FoldsRepeatedEventsOfAFile)
+{
+  inotify::Coalescer coalescer(std::chrono::milliseconds(10));
+  const auto now = inotify::Coalescer::Clock::now();
+  CHECK(coalescer.add(view(1, IN_CREATE, "new"), now));
+  CHECK(coalescer.add(view(1, IN_MODIFY, "new"), now));
+  CHECK(coalescer.add(view(1, IN_CLOSE_WRITE, "old"), now));
+  CHECK(coalescer.add(view(1, IN_MODIFY, "old"), now));
+  CHECK(!coalescer.add(view(1, IN_DELETE, "old"), now));
+
+  std::vector<std::string> released;
+  coalescer.flushAll([&released](const inotify::FileEventView& event) {
+    released.push_back(std::string(event.filename) + ":" + std::to_string(event.mask));
+  });
+  CHECK(released == (std::vector<std::string>{"new:" + std::to_string(IN_CREATE),
+                        "old:" + std::to_string(IN_CLOSE_WRITE | IN_MODIFY)}));
+}
+
+TEST(Coalescer, KeepsCloseWritesOfCloseWriteWatches)
+{
+  test::TempTree tree;
+  inotify::InotifyOptions options;
+  options.log_fd = test::nullFd();
+  options.close_write = true;
+  options.coalesce_window = std::chrono::milliseconds(10);
+  inotify::Inotify watcher(tree.root(), {}, options);
+  test::CaptureHandler handler;
+  watcher.setEventHandler(&handler);
+
+  // Directories that only select IN_CLOSE_WRITE for their files have to see it after folding
+  std::vector<uint8_t> stream;
+  test::appendEvent(stream, 1, IN_CLOSE_WRITE, 0, "file");
+  test::appendEvent(stream, 1, IN_CLOSE_WRITE, 0, "file");
+  test::appendEvent(stream, 1, IN_CLOSE_WRITE, 0, "other");
+  inotify::ReplaySource source(std::move(stream));
+  watcher.replay(source);
+
+  CHECK_EQ(handler.joined(),
+      "Modify " + (tree.root() / "file").string() + "\n" + "Modify " + (tree.root() / "other").string() + "\n");
+}
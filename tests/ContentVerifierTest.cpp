@@ -0,0 +1,94 @@
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ctime>
+#include <fstream>
+#include <string>
+
+#include "ContentVerifier.hpp"
+#include "Test.hpp"
+
+// Verification of modifies against the recorded state of a file, with the metadata shortcut and its racy case
+
+namespace {
+
+void write(const std::filesystem::path& path, const std::string& contents)
+{
+  std::ofstream(path, std::ios::binary | std::ios::trunc) << contents;
+}
+
+// Sets the modification time, to make a rewrite invisible in the metadata like a coarse timestamp does
+void setMtime(const std::filesystem::path& path, time_t seconds)
+{
+  struct timespec times[2] = {{0, UTIME_OMIT}, {seconds, 0}};
+  if (utimensat(AT_FDCWD, path.c_str(), times, 0) != 0) throw std::runtime_error("Failed to set the mtime");
+}
+
+// Verifies one modify of a file with its recorded state, returns whether it was found to change the contents
+bool verified(inotify::ContentVerifier& verifier, const std::filesystem::path& path)
+{
+  CHECK(!verifier.check(path.native()));
+  bool changed = false;
+  int verdicts = 0;
+  verifier.finish([&](std::string_view, bool result) {
+    changed = result;
+    verdicts++;
+  });
+  CHECK_EQ(verdicts, 1);
+  return changed;
+}
+
+}  // namespace
+
+TEST(ContentVerifier, DropsRewritesOfTheSameContents)
+{
+  test::TempTree tree;
+  const std::filesystem::path file = tree.root() / "file";
+  write(file, "same");
+  inotify::ContentVerifier verifier(1, [] {});
+
+  // The first modify of a file is reported right away and records its state
+  CHECK(verifier.check(file.native()));
+  verifier.finish([](std::string_view, bool) {});
+
+  write(file, "same");
+  CHECK(!verified(verifier, file));
+  write(file, "diff");
+  CHECK(verified(verifier, file));
+  write(file, "longer");
+  CHECK(verified(verifier, file));
+}
+
+TEST(ContentVerifier, HashesRacyStatesDespiteUnchangedMetadata)
+{
+  test::TempTree tree;
+  const std::filesystem::path file = tree.root() / "file";
+  write(file, "aaaa");
+  const time_t now = time(nullptr);
+  setMtime(file, now + 60); // Modified in, or after, the second its state is recorded in
+  inotify::ContentVerifier verifier(1, [] {});
+  CHECK(verifier.check(file.native()));
+  verifier.finish([](std::string_view, bool) {});
+
+  write(file, "bbbb");
+  setMtime(file, now + 60);
+  CHECK(verified(verifier, file));
+}
+
+TEST(ContentVerifier, TrustsMetadataOfSettledStates)
+{
+  test::TempTree tree;
+  const std::filesystem::path file = tree.root() / "file";
+  write(file, "aaaa");
+  const time_t past = time(nullptr) - 60;
+  setMtime(file, past);
+  inotify::ContentVerifier verifier(1, [] {});
+  CHECK(verifier.check(file.native()));
+  verifier.finish([](std::string_view, bool) {});
+
+  // Unchanged size, modification time and inode are taken for unchanged contents, without reading the file
+  write(file, "bbbb");
+  setMtime(file, past);
+  CHECK(!verified(verifier, file));
+}
@@ -0,0 +1,102 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include "EventStream.hpp"
+#include "EventWriter.hpp"
+#include "Test.hpp"
+
+// Encoding events with EventWriter and decoding them with the header-only EventStreamReader
+
+namespace {
+
+inotify::Event makeEvent(inotify::EventType type, bool is_dir, const std::string& path, const std::string& old_path,
+    uint32_t cookie)
+{
+  return inotify::Event{type, is_dir, path, old_path, cookie, std::chrono::steady_clock::time_point(
+                                                                  std::chrono::nanoseconds(123456789))};
+}
+
+}  // namespace
+
+TEST(EventStream, RoundTripsBinaryRecords)
+{
+  test::TempTree tree;
+  const std::filesystem::path file = tree.root() / "events";
+  const int out = open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  CHECK(out != -1);
+  {
+    inotify::EventWriter writer(inotify::EventWriter::Format::Binary, {"/r", "/s/"}, out);
+    writer.onEvent(makeEvent(inotify::EventType::Create, false, "/r/file", "", 0));
+    writer.onEvent(makeEvent(inotify::EventType::Move, true, "/s/new", "/s/old", 42));
+    writer.onEvent(makeEvent(inotify::EventType::Delete, false, "/elsewhere", "", 0));
+  }
+  close(out);
+
+  const int in = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+  CHECK(in != -1);
+  inotify::EventStreamReader reader(in, 64); // Smaller than the stream, so records are refilled across reads
+  inotify::EventRecord record;
+
+  CHECK(reader.next(record));
+  CHECK(record.type == inotify::RecordType::Create);
+  CHECK(!record.is_dir);
+  CHECK_EQ(record.root, 0u);
+  CHECK_EQ(record.path, "/r/file");
+  CHECK(record.old_path.empty());
+  CHECK_EQ(record.time, 123456789u);
+
+  CHECK(reader.next(record));
+  CHECK(record.type == inotify::RecordType::Move);
+  CHECK(record.is_dir);
+  CHECK_EQ(record.root, 1u);
+  CHECK_EQ(record.cookie, 42u);
+  CHECK_EQ(record.path, "/s/new");
+  CHECK_EQ(record.old_path, "/s/old");
+
+  CHECK(reader.next(record));
+  CHECK(record.type == inotify::RecordType::Delete);
+  CHECK_EQ(record.root, inotify::RECORD_NO_ROOT);
+
+  CHECK(!reader.next(record));
+  close(in);
+}
+
+TEST(EventStream, RejectsCorruptStreams)
+{
+  auto rejected = [](const std::string& bytes) {
+    try
+    {
+      inotify::EventStreamReader::parseHeader(bytes.data(), bytes.size());
+    } catch (const std::runtime_error&)
+    {
+      return true;
+    }
+    return false;
+  };
+
+  CHECK(rejected(std::string("INEX\x01\x00\x18\x00", 8)));
+  CHECK(rejected(std::string("INEV", 4)));
+  CHECK(rejected(std::string("INEV\x01\x00\x04\x00", 8))); // Records without the fields of this version
+  CHECK(!rejected(std::string("INEV\x01\x00\x18\x00", 8)));
+
+  // A record whose paths don't fit into its length
+  std::string record(4 + EVENT_RECORD_HEADER_LEN, '\0');
+  const uint32_t length = EVENT_RECORD_HEADER_LEN;
+  const uint32_t path_size = 100;
+  std::memcpy(&record[0], &length, sizeof(length));
+  std::memcpy(&record[4 + 16], &path_size, sizeof(path_size));
+  inotify::EventRecord decoded;
+  bool corrupt = false;
+  try
+  {
+    inotify::EventStreamReader::decode(record.data(), record.size(), EVENT_RECORD_HEADER_LEN, decoded);
+  } catch (const std::runtime_error&)
+  {
+    corrupt = true;
+  }
+  CHECK(corrupt);
+}
@@ -0,0 +1,71 @@
+#include <filesystem>
+
+#include "IgnoreMatcher.hpp"
+#include "Test.hpp"
+
+// The ignore rules: basename and anchored patterns, directory-only patterns and globs
+
+namespace {
+
+bool ignored(const inotify::IgnoreMatcher& matcher, const std::string& path, bool is_dir = false)
+{
+  return matcher.matches(std::filesystem::path(path), is_dir);
+}
+
+}  // namespace
+
+TEST(IgnoreMatcher, BasenamesMatchAtAnyDepth)
+{
+  inotify::IgnoreMatcher matcher({"build", "*.o"}, "/r");
+  CHECK(ignored(matcher, "/r/build", true));
+  CHECK(ignored(matcher, "/r/src/deep/build", true));
+  CHECK(ignored(matcher, "/r/src/main.o"));
+  CHECK(!ignored(matcher, "/r/src/main.c"));
+  CHECK(!ignored(matcher, "/r/builder", true));
+  CHECK(matcher.matches("/r/src", "main.o", false));
+}
+
+TEST(IgnoreMatcher, SlashAnchorsToTheRoot)
+{
+  inotify::IgnoreMatcher matcher({"src/gen", "/logs"}, "/r");
+  CHECK(ignored(matcher, "/r/src/gen", true));
+  CHECK(!ignored(matcher, "/r/other/src/gen", true));
+  CHECK(ignored(matcher, "/r/logs", true));
+  CHECK(!ignored(matcher, "/r/src/logs", true));
+  CHECK(!ignored(matcher, "/elsewhere/logs", true));
+}
+
+TEST(IgnoreMatcher, AnchorsToEveryRoot)
+{
+  inotify::IgnoreMatcher matcher({"/logs"}, std::vector<std::filesystem::path>{"/r", "/s"});
+  CHECK(ignored(matcher, "/r/logs", true));
+  CHECK(ignored(matcher, "/s/logs", true));
+  CHECK(!ignored(matcher, "/t/logs", true));
+}
+
+TEST(IgnoreMatcher, TrailingSlashOnlyMatchesDirectories)
+{
+  inotify::IgnoreMatcher matcher({"tmp/"}, "/r");
+  CHECK(ignored(matcher, "/r/tmp", true));
+  CHECK(ignored(matcher, "/r/a/tmp", true));
+  CHECK(!ignored(matcher, "/r/tmp", false));
+}
+
+TEST(IgnoreMatcher, NegatedClassesExcludeTheirCharacters)
+{
+  inotify::IgnoreMatcher matcher({"log[!0-9]", "tmp[^a-z]"}, "/r");
+  CHECK(ignored(matcher, "/r/logx"));
+  CHECK(!ignored(matcher, "/r/log1"));
+  CHECK(ignored(matcher, "/r/tmp_"));
+  CHECK(!ignored(matcher, "/r/tmpa"));
+}
+
+TEST(IgnoreMatcher, GlobsStayWithinComponentsUnlessDoubled)
+{
+  inotify::IgnoreMatcher matcher({"src/*.tmp", "cache/**/obj"}, "/r");
+  CHECK(ignored(matcher, "/r/src/a.tmp"));
+  CHECK(!ignored(matcher, "/r/src/sub/a.tmp"));
+  CHECK(ignored(matcher, "/r/cache/obj", true));
+  CHECK(ignored(matcher, "/r/cache/x/y/obj", true));
+  CHECK(!ignored(matcher, "/r/other/obj", true));
+}
@@ -0,0 +1,60 @@
+#include "Inotify.hpp"
+#include "Test.hpp"
+
+// Lazy watching: directories that turn up in the tree are only watched down to the lazy edge, like the initial crawl
+
+namespace {
+
+struct Fixture {
+  Fixture()
+  {
+    tree.mkdir("a/b");
+    options.log_fd = test::nullFd();
+    options.lazy_depth = 1;
+  }
+
+  size_t replay(std::vector<uint8_t> stream)
+  {
+    inotify::Inotify watcher(tree.root(), {}, options);
+    watcher.setEventHandler(&handler);
+    inotify::ReplaySource source(std::move(stream));
+    watcher.replay(source);
+    return watcher.rawMetrics().watches.value();
+  }
+
+  test::TempTree tree;
+  inotify::InotifyOptions options;
+  test::CaptureHandler handler;
+};
+
+}  // namespace
+
+TEST(LazyWatch, MovedInDirectoryIsWatchedToTheEdge)
+{
+  // root and root/a are watched upfront, root/a/b is below the edge
+  Fixture fixture;
+  fixture.tree.mkdir("moved/x/y");
+  std::vector<uint8_t> stream;
+  test::appendEvent(stream, 1, IN_MOVED_TO | IN_ISDIR, 5, "moved");
+  CHECK_EQ(fixture.replay(std::move(stream)), 3u);
+  CHECK_EQ(fixture.handler.joined(), "Create " + (fixture.tree.root() / "moved").string() + "\n");
+}
+
+TEST(LazyWatch, MovedInDirectoryExpandsOnActivity)
+{
+  Fixture fixture;
+  fixture.tree.mkdir("moved/x/y");
+  std::vector<uint8_t> stream;
+  test::appendEvent(stream, 1, IN_MOVED_TO | IN_ISDIR, 5, "moved");
+  test::appendEvent(stream, 3, IN_CREATE, 0, "file");
+  CHECK_EQ(fixture.replay(std::move(stream)), 4u);
+}
+
+TEST(LazyWatch, CreatedDirectoryIsWatchedToTheEdge)
+{
+  Fixture fixture;
+  fixture.tree.mkdir("new/x/y");
+  std::vector<uint8_t> stream;
+  test::appendEvent(stream, 1, IN_CREATE | IN_ISDIR, 0, "new");
+  CHECK_EQ(fixture.replay(std::move(stream)), 3u);
+}
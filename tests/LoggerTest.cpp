@@ -0,0 +1,55 @@
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "Logger.hpp"
+#include "Test.hpp"
+
+// The async logger, when its output can't keep up
+
+TEST(Logger, ReportsDroppedLines)
+{
+  int pipe_fds[2];
+  CHECK(pipe(pipe_fds) == 0);
+
+  // Nothing reads the pipe until all lines were logged, so the writer blocks and the ring overruns
+  auto logger = std::make_unique<inotify::Logger>(inotify::Logger::Mode::Async, pipe_fds[1]);
+  const int line_cnt = 4 * int(inotify::Logger::RING_CAPACITY);
+  for (int i = 0; i < line_cnt; ++i) logger->logEvent("line %d", i);
+  const uint64_t dropped = logger->dropped();
+  CHECK(dropped > 0);
+
+  std::string output;
+  std::thread reader([&output, fd = pipe_fds[0]] {
+    char buffer[65536];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) output.append(buffer, length);
+  });
+  logger.reset();
+  close(pipe_fds[1]);
+  reader.join();
+  close(pipe_fds[0]);
+
+  // Every line is either written or counted in a report
+  uint64_t written = 0;
+  uint64_t reported = 0;
+  size_t pos = 0;
+  while (pos < output.size())
+  {
+    const size_t end = output.find('\n', pos);
+    const std::string line = output.substr(pos, end - pos);
+    pos = end + 1;
+    const size_t report = line.find(" lines dropped");
+    if (report == std::string::npos)
+    {
+      written++;
+      continue;
+    }
+    const size_t count = line.find("] ") + 2;
+    reported += std::stoull(line.substr(count, report - count));
+  }
+  CHECK_EQ(reported, dropped);
+  CHECK_EQ(written + reported, uint64_t(line_cnt));
+}
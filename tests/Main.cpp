@@ -0,0 +1,31 @@
+#include <exception>
+#include <iostream>
+
+#include "Test.hpp"
+
+// Runs the test cases of the suites given on the command line, or all of them. Exits non-zero if a case failed.
+int main(int argc, char* argv[])
+{
+  int run = 0;
+  int failed = 0;
+  for (const test::Case& test_case : test::cases())
+  {
+    bool selected = argc < 2;
+    for (int i = 1; i < argc && !selected; ++i) selected = test_case.suite == argv[i];
+    if (!selected) continue;
+
+    run++;
+    try
+    {
+      test_case.body();
+      std::cout << "[ OK ] " << test_case.suite << "." << test_case.name << std::endl;
+    } catch (const std::exception& e)
+    {
+      failed++;
+      std::cout << "[FAIL] " << test_case.suite << "." << test_case.name << "\n  " << e.what() << std::endl;
+    }
+  }
+
+  std::cout << run - failed << "/" << run << " passed" << std::endl;
+  return run == 0 || failed > 0 ? 1 : 0;
+}
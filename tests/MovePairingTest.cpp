@@ -0,0 +1,82 @@
+#include <memory>
+
+#include "Inotify.hpp"
+#include "Test.hpp"
+
+// Pairing of the two halves of a move from replayed streams, also when the halves end up in different reads. The tree
+// is a single chain root/a/b, so a fresh watcher numbers the directories 1, 2 and 3 in crawl order.
+
+namespace {
+
+struct Fixture {
+  Fixture()
+  {
+    tree.mkdir("a/b");
+    options.log_fd = test::nullFd();
+    watcher = std::make_unique<inotify::Inotify>(tree.root(), std::vector<std::string>{}, options);
+    watcher->setEventHandler(&handler);
+  }
+
+  std::string path(const std::string& relative) const { return (tree.root() / relative).string(); }
+
+  test::TempTree tree;
+  inotify::InotifyOptions options;
+  std::unique_ptr<inotify::Inotify> watcher;
+  test::CaptureHandler handler;
+};
+
+}  // namespace
+
+TEST(MovePairing, PairsHalvesOfOneRead)
+{
+  Fixture fixture;
+  std::vector<uint8_t> stream;
+  test::appendEvent(stream, 1, IN_MOVED_FROM, 7, "file");
+  test::appendEvent(stream, 3, IN_MOVED_TO, 7, "file");
+  inotify::ReplaySource source(std::move(stream));
+  fixture.watcher->replay(source);
+
+  CHECK_EQ(fixture.handler.joined(), "Move " + fixture.path("a/b/file") + " " + fixture.path("file") + "\n");
+}
+
+TEST(MovePairing, PairsHalvesAcrossReads)
+{
+  Fixture fixture;
+  std::vector<uint8_t> stream;
+  test::appendEvent(stream, 1, IN_MOVED_FROM | IN_ISDIR, 7, "a");
+  test::appendEvent(stream, 1, IN_MOVED_TO | IN_ISDIR, 7, "c");
+  test::appendEvent(stream, 3, IN_CREATE, 0, "file");
+  test::ChunkedSource source(std::move(stream));
+  fixture.watcher->replay(source);
+
+  // The renamed directory keeps its watches, and the events below it resolve to the new path
+  CHECK_EQ(fixture.handler.joined(),
+      "Move " + fixture.path("c") + " " + fixture.path("a") + "\n" + "Create " + fixture.path("c/b/file") + "\n");
+}
+
+TEST(MovePairing, UnpairedHalfIsAMoveOut)
+{
+  Fixture fixture;
+  std::vector<uint8_t> stream;
+  test::appendEvent(stream, 1, IN_MOVED_FROM | IN_ISDIR, 7, "a");
+  test::appendEvent(stream, 1, IN_CREATE, 0, "file");
+  test::appendEvent(stream, 3, IN_CREATE, 0, "lost");
+  test::ChunkedSource source(std::move(stream));
+  fixture.watcher->replay(source);
+
+  // The subtree that left is no longer watched, so later events of its directories are dropped
+  CHECK_EQ(fixture.handler.joined(), "MoveOut " + fixture.path("a") + "\n" + "Create " + fixture.path("file") + "\n");
+}
+
+TEST(MovePairing, MismatchedCookiesDoNotPair)
+{
+  Fixture fixture;
+  std::vector<uint8_t> stream;
+  test::appendEvent(stream, 1, IN_MOVED_FROM, 7, "file");
+  test::appendEvent(stream, 1, IN_MOVED_TO, 8, "other");
+  test::ChunkedSource source(std::move(stream));
+  fixture.watcher->replay(source);
+
+  CHECK_EQ(fixture.handler.joined(),
+      "MoveOut " + fixture.path("file") + "\n" + "Create " + fixture.path("other") + "\n");
+}
@@ -0,0 +1,56 @@
+#include <string>
+
+#include "Snapshot.hpp"
+#include "Test.hpp"
+#include "WatchCache.hpp"
+
+// Saving the directory index and mapping it back
+
+TEST(Snapshot, RoundTripsTheIndex)
+{
+  test::TempTree tree;
+  inotify::WatchCache cache;
+  cache.insert(1, "/r");
+  cache.insert(2, "/r/a");
+  cache.insert(3, "/r/a/b");
+  cache.insert(4, "/s");
+  for (int wd = 1; wd <= 4; ++wd) cache.setStat(wd, 100 + wd, 1000 * wd);
+
+  const std::filesystem::path file = tree.root() / "snapshot";
+  inotify::Snapshot::save(file, cache);
+  inotify::Snapshot snapshot(file);
+  CHECK_EQ(snapshot.size(), 4u);
+
+  // Rebuild the path of every entry from its parents, and compare it with the cache
+  for (size_t i = 0; i < snapshot.size(); ++i)
+  {
+    std::filesystem::path path = std::string(snapshot.name(i));
+    for (int32_t parent = snapshot.entry(i).parent; parent != -1; parent = snapshot.entry(parent).parent)
+      path = std::filesystem::path(std::string(snapshot.name(parent))) / path;
+
+    const int wd = cache.find(path);
+    CHECK(wd != -1);
+    CHECK_EQ(snapshot.entry(i).inode, uint64_t(100 + wd));
+    CHECK_EQ(snapshot.entry(i).mtime, int64_t(1000 * wd));
+  }
+}
+
+TEST(Snapshot, RejectsACorruptFile)
+{
+  test::TempTree tree;
+  const std::filesystem::path file = tree.root() / "snapshot";
+  inotify::WatchCache cache;
+  cache.insert(1, "/r");
+  inotify::Snapshot::save(file, cache);
+  std::filesystem::resize_file(file, 4);
+
+  bool rejected = false;
+  try
+  {
+    inotify::Snapshot snapshot(file);
+  } catch (const std::runtime_error&)
+  {
+    rejected = true;
+  }
+  CHECK(rejected);
+}
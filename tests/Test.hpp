@@ -0,0 +1,172 @@
+#ifndef TEST_HPP
+#define TEST_HPP
+
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "EventHandler.hpp"
+#include "EventSource.hpp"
+
+// A minimal test harness, so that the tests need nothing beyond the library: TEST() registers a case with the runner
+// of Main.cpp, and the CHECK macros throw on the first failure of a case.
+
+namespace test {
+
+struct Case {
+  std::string suite;
+  std::string name;
+  std::function<void()> body;
+};
+
+inline std::vector<Case>& cases()
+{
+  static std::vector<Case> registry;
+  return registry;
+}
+
+struct Registrar {
+  Registrar(const char* suite, const char* name, std::function<void()> body)
+  {
+    cases().push_back(Case{suite, name, std::move(body)});
+  }
+};
+
+struct Failure : std::runtime_error {
+  using std::runtime_error::runtime_error;
+};
+
+template <typename A, typename B>
+void checkEqual(const A& actual, const B& expected, const char* expression, const char* file, int line)
+{
+  if (actual == expected) return;
+  std::ostringstream message;
+  message << file << ":" << line << ": " << expression;
+  message << "\n    actual:   " << actual << "\n    expected: " << expected;
+  throw Failure(message.str());
+}
+
+// A temporary directory that is removed with everything in it
+class TempTree
+{
+ public:
+  TempTree()
+  {
+    char templ[] = "/tmp/inotify-test.XXXXXX";
+    if (mkdtemp(templ) == nullptr) throw std::runtime_error("Failed to create a temporary directory");
+    _root = templ;
+  }
+  ~TempTree()
+  {
+    std::error_code error;
+    std::filesystem::remove_all(_root, error);
+  }
+  TempTree(const TempTree&) = delete;
+  TempTree& operator=(const TempTree&) = delete;
+
+  const std::filesystem::path& root() const { return _root; }
+  std::filesystem::path mkdir(const std::string& relative) const
+  {
+    std::filesystem::create_directories(_root / relative);
+    return _root / relative;
+  }
+
+ private:
+  std::filesystem::path _root;
+};
+
+// Appends an inotify_event record to a synthetic stream, padded like the kernel pads the names
+inline void appendEvent(std::vector<uint8_t>& stream, int wd, uint32_t mask, uint32_t cookie, const std::string& name)
+{
+  const size_t len = (name.size() + sizeof(inotify_event)) / sizeof(inotify_event) * sizeof(inotify_event);
+  inotify_event header{wd, mask, cookie, uint32_t(len)};
+  const size_t offset = stream.size();
+  stream.resize(offset + sizeof(header) + len, 0);
+  std::memcpy(stream.data() + offset, &header, sizeof(header));
+  std::memcpy(stream.data() + offset + sizeof(header), name.data(), name.size());
+}
+
+// Hands out one record per read, so that every record of a stream is processed as a read of its own
+class ChunkedSource : public inotify::EventSource
+{
+ public:
+  explicit ChunkedSource(std::vector<uint8_t> events) : _events(std::move(events)), _offset(0) {}
+
+  ssize_t read(uint8_t* buffer, size_t size) override
+  {
+    if (_offset == _events.size()) return 0;
+    inotify_event header;
+    std::memcpy(&header, _events.data() + _offset, sizeof(header));
+    const size_t length = sizeof(header) + header.len;
+    if (length > size) return -1;
+    std::memcpy(buffer, _events.data() + _offset, length);
+    _offset += length;
+    return ssize_t(length);
+  }
+  size_t pending() const override { return _events.size() - _offset; }
+
+ private:
+  std::vector<uint8_t> _events;
+  size_t _offset;
+};
+
+// Collects the events of a watcher as "Type path [old_path]" lines, in the order they were delivered
+class CaptureHandler : public inotify::EventHandler
+{
+ public:
+  void onEvent(const inotify::Event& event) override
+  {
+    static const char* const names[] = {"Create", "Delete", "Modify", "Move", "MoveOut", "Rescan"};
+    std::string line = std::string(names[int(event.type)]) + " " + event.path.string();
+    if (!event.old_path.empty()) line += " " + event.old_path.string();
+    events.push_back(std::move(line));
+  }
+
+  std::string joined() const
+  {
+    std::string result;
+    for (const std::string& event : events) result += event + "\n";
+    return result;
+  }
+
+  std::vector<std::string> events;
+};
+
+// Where the log lines of the watchers of the tests go
+inline int nullFd()
+{
+  static const int fd = open("/dev/null", O_WRONLY | O_CLOEXEC);
+  return fd;
+}
+
+}  // namespace test
+
+#define TEST_CONCAT_INNER(a, b) a##b
+#define TEST_CONCAT(a, b) TEST_CONCAT_INNER(a, b)
+
+// Defines and registers a test case of a suite; ctest runs every suite as a test of its own
+#define TEST(suite, name)                                                                                              \
+  static void suite##_##name();                                                                                        \
+  static const test::Registrar TEST_CONCAT(registrar_, __LINE__)(#suite, #name, suite##_##name);                       \
+  static void suite##_##name()
+
+#define CHECK(condition)                                                                                               \
+  do                                                                                                                   \
+  {                                                                                                                    \
+    if (!(condition))                                                                                                  \
+      throw test::Failure(std::string(__FILE__) + ":" + std::to_string(__LINE__) + ": CHECK(" #condition ")");         \
+  } while (false)
+
+#define CHECK_EQ(actual, expected) test::checkEqual((actual), (expected), #actual " == " #expected, __FILE__, __LINE__)
+
+#endif  // TEST_HPP
@@ -0,0 +1,111 @@
+#include <algorithm>
+
+#include "Test.hpp"
+#include "WatchCache.hpp"
+
+// The directory index: lookups, renames of subtrees and their teardown, without a watcher
+
+namespace {
+
+bool contains(const std::vector<int>& wds, int wd) { return std::find(wds.begin(), wds.end(), wd) != wds.end(); }
+
+}  // namespace
+
+TEST(WatchCache, LinksChildrenUnderTheirParents)
+{
+  inotify::WatchCache cache;
+  CHECK(cache.insert(1, "/r"));
+  CHECK(cache.insert(2, "/r/a"));
+  CHECK(cache.insert(3, "/r/a/b"));
+  CHECK(!cache.insert(3, "/r/a/other"));
+
+  CHECK_EQ(cache.find("/r/a/b"), 3);
+  CHECK_EQ(cache.find("/r/a/b/"), 3);
+  CHECK_EQ(cache.find("/r/a/missing"), -1);
+  CHECK_EQ(cache.path(3).string(), "/r/a/b");
+  CHECK_EQ(cache.name(3), "b");
+  CHECK_EQ(cache.roots().size(), 1u);
+}
+
+TEST(WatchCache, RenameMovesTheSubtree)
+{
+  inotify::WatchCache cache;
+  cache.insert(1, "/r");
+  cache.insert(2, "/r/a");
+  cache.insert(3, "/r/a/b");
+  cache.insert(4, "/r/c");
+
+  CHECK_EQ(cache.rename(2, "/r/c/moved"), 1);
+  CHECK_EQ(cache.path(3).string(), "/r/c/moved/b");
+  CHECK_EQ(cache.find("/r/c/moved/b"), 3);
+  CHECK_EQ(cache.find("/r/a/b"), -1);
+  CHECK(contains(cache.children(4), 2));
+  CHECK(cache.children(1) == std::vector<int>{4});
+}
+
+TEST(WatchCache, SubtreeListsChildrenFirst)
+{
+  inotify::WatchCache cache;
+  cache.insert(1, "/r");
+  cache.insert(2, "/r/a");
+  cache.insert(3, "/r/a/b");
+  cache.insert(4, "/r/a/b/c");
+
+  const std::vector<int> subtree = cache.subtree(2);
+  CHECK(subtree == (std::vector<int>{4, 3, 2}));
+
+  // Zap the subtree the way a move out of the tree does, bottom-up
+  for (int wd : subtree) cache.erase(wd);
+  CHECK(cache.descriptors() == std::vector<int>{1});
+  CHECK(cache.children(1).empty());
+  CHECK_EQ(cache.find("/r/a"), -1);
+  CHECK(cache.subtree(2).empty());
+}
+
+TEST(WatchCache, SiblingsSharingAPrefixStayApart)
+{
+  inotify::WatchCache cache;
+  cache.insert(1, "/a");
+  cache.insert(2, "/a/foo");
+  cache.insert(3, "/a/foobar");
+  cache.insert(4, "/a/foobar/x");
+
+  CHECK_EQ(cache.find("/a/foobar/x"), 4);
+  CHECK_EQ(cache.find("/a/foo/x"), -1);
+
+  cache.rename(2, "/a/renamed");
+  CHECK_EQ(cache.path(3).string(), "/a/foobar");
+  CHECK_EQ(cache.path(4).string(), "/a/foobar/x");
+
+  CHECK(cache.subtree(2) == std::vector<int>{2});
+}
+
+TEST(WatchCache, RootsSharingAPrefixStayApart)
+{
+  inotify::WatchCache cache;
+  cache.insert(1, "/r/foo");
+  cache.insert(2, "/r/foobar");
+  cache.insert(3, "/r/foobar/x");
+
+  CHECK_EQ(cache.roots().size(), 2u);
+  CHECK_EQ(cache.find("/r/foobar/x"), 3);
+  CHECK_EQ(cache.find("/r/foo/x"), -1);
+  CHECK_EQ(cache.find("/r/foob"), -1);
+}
+
+TEST(WatchCache, ErasedNodeLeavesItsChildrenAsRoots)
+{
+  inotify::WatchCache cache;
+  cache.insert(1, "/r");
+  cache.insert(2, "/r/a");
+  cache.insert(3, "/r/a/b");
+  cache.insert(4, "/r/a/c");
+
+  cache.erase(2);
+  CHECK(!cache.contains(2));
+  CHECK_EQ(cache.roots().size(), 3u);
+  CHECK_EQ(cache.path(3).string(), "/r/a/b");
+  CHECK_EQ(cache.path(4).string(), "/r/a/c");
+  CHECK_EQ(cache.find("/r/a/b"), 3);
+  CHECK(cache.children(1).empty());
+}